@@ -34,6 +34,74 @@ file_size)` リングバッファを初期化します。メモリバッファ
 - file_name: 使用するファイルの名前。
 - file_size: ファイルバッファのサイズ。
 
+memory_size を2のべき乗にすると、メモリバッファの折り返し計算がマスク演算になります。
+
+linux ターゲットでは、ファイルを file_size まで拡張してメモリマップし、メモリバッファと同じコピー処理で読み書きします。
+マップできない場合や ESP ターゲットでは stdio を使います。RING_BUFFER_USE_MMAP を 0 に定義すると常に stdio を使います。
+
+### `void ring_buffer_init_with_config(RingBuffer *buffer, uint8_t *memory, size_t memory_size, const char *file_name, size_t file_size, const RingBufferConfig *config)`
+ring_buffer_init と同じですが、config で動作を指定します。config は RING_BUFFER_CONFIG_DEFAULT で初期化してから
+必要な項目だけを変更してください。
+
+- config->persistent: true の場合、ファイルを切り詰めずに開き、前回のファイルバッファの内容を引き継ぎます。
+  ファイルの先頭に head、length、sequence を持つ2つのヘッダを置き、交互に書き込むので、
+  起動時はデータを走査せずに一定時間で復元できます。メモリバッファと staging の内容は引き継がれません。
+  ヘッダを書く前と後に fsync するので、ストレージに届いていないデータをヘッダが指すことはありません。
+- config->checkpoint_interval: 永続モードで、ファイルバッファのデータがこのバイト数だけ書き込まれるか読み出されるごとに
+  ヘッダを書き込みます。電源断時には、最後のヘッダ以降の変化が失われます (読み出した分は再度読めることがあります)。
+  ring_buffer_flush と ring_buffer_free でも書き込みます。
+- config->preallocate: 初期化時にファイルをデータ領域の末尾まで確保する方法です。
+  RING_BUFFER_PREALLOCATE_LAZY (初期値) は確保せず、書き込み位置が進むのに合わせてファイルが伸びます。
+  RING_BUFFER_PREALLOCATE_ZERO_FILL は RING_BUFFER_ZERO_PAGE_SIZE バイトのゼロページをまとめて書き込みます。
+  RING_BUFFER_PREALLOCATE_TRUNCATE は fallocate (linux) または ftruncate で確保し、VFS が対応していなければゼロ埋めします。
+  既にあるデータは書き換えません。
+- config->compress_work: RING_BUFFER_COMPRESS_WORK_SIZE バイトの作業領域を渡すと、ファイルバッファを圧縮します。
+  書き込んだデータを RING_BUFFER_COMPRESS_CHUNK バイトずつ RAM に溜め、ヒープを使わない LZ 形式で圧縮してから
+  ファイルへ書き込み、読み込みと補充の際に展開します。縮まないデータはそのまま格納します。
+  空きは縮まなかった場合を見込んで数えるので、圧縮が効くほどファイルバッファに多くのデータを積めます。
+  溜めているチャンクは ring_buffer_flush と ring_buffer_free で書き出します (永続モードの場合)。
+  圧縮モードでは ring_buffer_start_spill_task は使えません。永続モードでは、前回と同じ設定で開いてください。
+  永続モードでは展開後のバイト数もヘッダに保存するので、起動時にフレームを読まずに一定時間で復元できます。
+- config->sector_buffer, config->sector_size: sector_size バイトのバッファを渡すと、ファイルバッファへの書き込みを
+  セクタ単位にまとめます。末尾のセクタをバッファに溜め、セクタが埋まったときだけ、揃った位置へセクタ全体を書き込むので、
+  フラッシュの部分書き換え (読み出し、消去、書き込み) が起きません。溜めているデータも読み込めます。
+  半端なセクタは ring_buffer_flush と、永続モードのヘッダ書き込みの際に書き込みます。
+  file_size は sector_size の倍数にしてください。この場合はファイルをメモリマップせず、
+  永続モードではヘッダのためにファイルの先頭のセクタを1つ使います。
+- config->segment_size, config->segment_recycle: segment_size を指定すると、ファイルバッファを segment_size バイトの
+  セグメントに分け、セグメントごとに "<file_name>.<番号>" のファイルを使います。セグメントの数は
+  file_size / segment_size (最大 RING_BUFFER_SEGMENTS_MAX) です。ファイルは書き込むときに作り、
+  先頭のセグメントを読み終えるとファイルごと削除するので、ファイルの書き換えや切り詰めをせずに容量を返せます。
+  segment_recycle が true の場合は、読み終えたファイルを削除せずに次のセグメントに使い回します。
+  先頭のセグメントの読み終えた部分は、そのセグメントを読み終えるまで空きになりません。
+  初期化時に、前回の実行で残ったセグメントファイルを削除します。
+  セグメントに分ける場合は、永続モード、圧縮モード、メモリマップは使えません。
+- config->tiers, config->tier_count: メモリバッファとファイルバッファの間に積む階層を、メモリに近い順に
+  最大 RING_BUFFER_TIERS_MAX 個指定します。階層は RingBufferTierOps (write、peek、consume、usage、space) を
+  実装したバックエンドで、PSRAM などの RAM には ring_buffer_memory_tier_init で作る階層を使えます。
+  メモリに入りきらない分は前の階層から順にまとめてあふれ、最後にファイルバッファ (書き出しタスクがあれば staging) へ
+  書き込みます。読み込み時は前の階層から補充し、隣り合う階層の間でも後ろの階層の先頭を前の階層へまとめて繰り上げます。
+  階層の配列は初期化時にコピーしますが、各階層の ctx は ring_buffer_free まで有効にしてください。
+
+### `RING_BUFFER_DEFINE(name, mem_size, file_size)` / `void ring_buffer_init_static(RingBuffer *buffer, RingBufferStatic *storage, const char *file_name, const RingBufferConfig *config)
+RING_BUFFER_DEFINE は、name という RingBuffer と、mem_size バイトのメモリバッファ、ミューテックスとイベントグループの
+領域 (name##_static) を静的に定義します。初期化は RING_BUFFER_INIT_STATIC(name, file_name, config) で行い、
+ミューテックスとイベントグループを xSemaphoreCreateMutexStatic と xEventGroupCreateStatic で作るので、
+初期化にヒープを使いません (書き込みの集約、補充タスク、書き出しタスクはヒープを使います)。
+mem_size は2のべき乗でなければコンパイルエラーになるので、折り返しは必ずマスク演算になります。
+マスクは ring_buffer_init に2のべき乗のサイズを渡した場合と同じく実行時の値なので、書き込み1回あたりの速さは
+変わりません。RING_BUFFER_DEFINE の違いは、領域を静的に確保することだけです。
+静的に確保する RingBuffer の大きさ (sizeof(RingBuffer)) は、RING_BUFFER_COMBINING_SLOTS、RING_BUFFER_READERS_MAX、
+RING_BUFFER_TIERS_MAX、RING_BUFFER_SEGMENTS_MAX、RING_BUFFER_SEGMENT_NAME_MAX と CONFIG_RING_BUFFER_STATS で変わります
+(既定の設定では、64 ビットのホストで約 1.9 KB です)。これらのマクロを変える場合は、コンポーネントを含むすべての
+翻訳単位で同じ値になるよう、プロジェクト全体のコンパイル定義で指定してください。RING_BUFFER_DEFINE は定義した側の
+sizeof(RingBuffer) を name##_static に記録し、ring_buffer_init_static はコンポーネント側の大きさと違えば configASSERT で止めます。
+
+- buffer: RingBuffer構造体のポインタ。
+- storage: RING_BUFFER_DEFINE で定義した領域のポインタ。
+- file_name: 使用するファイル名。
+- config: 設定。NULL の場合は RING_BUFFER_CONFIG_DEFAULT を使います。
+
 ### `int ring_buffer_write(RingBuffer *buffer, const uint8_t *data, size_t size)
 データをリングバッファに書き込みます。メモリバッファがいっぱいの場合はファイルバッファに書き込みます。
 
@@ -42,20 +110,423 @@ file_size)` リングバッファを初期化します。メモリバッファ
 - size: 書き込むデータのサイズ。
 
 戻り値は、書き込みの結果を示す定数 (RING_BUFFER_OK, RING_BUFFER_OVERFLOW, RING_BUFFER_FINISHED, RING_BUFFER_CANCELED)
-です。
+です。両方のバッファがいっぱいの場合の扱いは ring_buffer_set_overflow_policy で設定した方針に従い、
+RING_BUFFER_OVERFLOW_BLOCK では方針に設定した時間まで待ちます。
+
+### `int ring_buffer_write_timeout(RingBuffer *buffer, const uint8_t *data, size_t size, TickType_t xTicksToWait)
+ring_buffer_write と同じですが、両方のバッファがいっぱいの場合は、読み込みによって空きができるのを
+指定時間待ちます。待機中はポーリングせず、読み込み側からの通知で起床します。
+
+- buffer: RingBuffer構造体のポインタ。
+- data: 書き込むデータのポインタ。
+- size: 書き込むデータのサイズ。
+- xTicksToWait: 待機する時間（FreeRTOSのTick単位）。
+
+戻り値は ring_buffer_write と同じです。時間内に書き込みきれなかった場合は RING_BUFFER_OVERFLOW を返します
+(RING_BUFFER_OVERFLOW_BLOCK の場合は RING_BUFFER_TIMEOUT)。
+
+### `int ring_buffer_write_report(RingBuffer *buffer, const uint8_t *data, size_t size, TickType_t xTicksToWait, RingBufferWriteReport *report)
+ring_buffer_write_timeout と同じですが、書き込めたバイト数 (accepted) と、空きを作るために捨てたバイト数 (dropped) を
+report に格納します。RING_BUFFER_OVERFLOW が返っても、実際に書き込まれた量が分かります。
+
+- buffer: RingBuffer構造体のポインタ。
+- data: 書き込むデータのポインタ。
+- size: 書き込むデータのサイズ。
+- xTicksToWait: 待機する時間（FreeRTOSのTick単位）。
+- report: 結果を格納する構造体のポインタ。NULL でもかまいません。
+
+戻り値は ring_buffer_write_timeout と同じです。
+
+### `int ring_buffer_writev(RingBuffer *buffer, const RingBufferVec *vec, size_t count)
+複数のデータ (ヘッダ、ペイロード、トレーラなど) を1回のロックで続けて書き込みます。
+全体が入りきらない場合は何も書き込まずに RING_BUFFER_OVERFLOW を返すため、
+他のタスクの書き込みに分断されたり、途中まで書き込まれたりすることはありません。
+
+- buffer: RingBuffer構造体のポインタ。
+- vec: 書き込むデータの配列。
+- count: vec の要素数。
+
+戻り値は ring_buffer_write と同じです。
 
 ### `int ring_buffer_read(RingBuffer *buffer, uint8_t *data, size_t size, TickType_t xTicksToWait)
 リングバッファからデータを読み込みます。指定したバイト数を読み込むまで指定時間待ちます。
+待機中はポーリングせず、書き込み、書き込み終了、キャンセルの通知で起床します。
 
 - buffer: RingBuffer構造体のポインタ。
 - data: 読み込んだデータを格納するバッファのポインタ。
 - size: 読み込むバイト数。
+- xTicksToWait: 待機する時間（FreeRTOSのTick単位）。0 の場合は待たずに、あるだけ読み込みます。
+
+戻り値は、実際に読み込んだバイト数です。時間切れや書き込み終了の場合は size より少なくなります。
+書き込みが終了していて読み込むデータがない場合は RING_BUFFER_FINISHED を、
+キャンセルされた場合は RING_BUFFER_CANCELED を返します。
+
+### `int ring_buffer_readv(RingBuffer *buffer, const RingBufferVec *vec, size_t count, TickType_t xTicksToWait)
+ring_buffer_read と同じですが、読み込んだデータを vec の各バッファへ先頭から順に詰めて格納します。
+
+- buffer: RingBuffer構造体のポインタ。
+- vec: 読み込んだデータを格納するバッファの配列。
+- count: vec の要素数。
+- xTicksToWait: 待機する時間（FreeRTOSのTick単位）。
+
+戻り値は ring_buffer_read と同じで、vec 全体で読み込んだバイト数です。
+
+### `int ring_buffer_write_msg(RingBuffer *buffer, const void *data, size_t size)
+data をひとつのメッセージとして書き込みます。メッセージの前には、長さを表す可変長 (LEB128) のヘッダが付きます。
+ring_buffer_writev と同じく、全体が入りきらない場合は何も書き込まずに RING_BUFFER_OVERFLOW を返すので、
+メッセージが途中で切れることはありません。メモリバッファとファイルバッファのどちらにまたがっても構いません。
+メッセージを使うリングバッファには、ring_buffer_write など他の関数で書き込まないでください。
+
+- buffer: RingBuffer構造体のポインタ。
+- data: メッセージのポインタ。
+- size: メッセージのサイズ (RING_BUFFER_MSG_SIZE_MAX 以下)。
+
+戻り値は ring_buffer_write と同じです。size が大きすぎる場合は RING_BUFFER_MSG_TOO_LARGE を返します。
+
+### `int ring_buffer_read_msg(RingBuffer *buffer, void *data, size_t size, TickType_t xTicksToWait)
+メッセージをひとつ読み込みます。メッセージ全体が揃うまで指定時間待ちます。
+
+- buffer: RingBuffer構造体のポインタ。
+- data: メッセージを格納するバッファのポインタ。
+- size: data のサイズ。
+- xTicksToWait: 待機する時間（FreeRTOSのTick単位）。
+
+戻り値は、読み込んだメッセージのサイズです。時間切れの場合は RING_BUFFER_TIMEOUT を、
+メッセージが size より大きい場合は、メッセージを残したまま RING_BUFFER_MSG_TOO_LARGE を返します。
+書き込みが終了していてメッセージがない場合は RING_BUFFER_FINISHED を、キャンセルされた場合は RING_BUFFER_CANCELED を返します。
+
+### `int ring_buffer_read_msgs(RingBuffer *buffer, void *data, size_t size, size_t *lengths, size_t max_msgs, TickType_t xTicksToWait)
+1回のロックで、data に入るだけのメッセージを最大 max_msgs 個まとめて読み込みます。
+少なくともひとつのメッセージが揃うまで指定時間待ちます。
+
+- buffer: RingBuffer構造体のポインタ。
+- data: メッセージを先頭から詰めて格納するバッファのポインタ。
+- size: data のサイズ。
+- lengths: 各メッセージのサイズを受け取る配列。
+- max_msgs: lengths の要素数。
+- xTicksToWait: 待機する時間（FreeRTOSのTick単位）。
+
+戻り値は、読み込んだメッセージの個数です。それ以外は ring_buffer_read_msg と同じです。
+
+### `int ring_buffer_write_elements(RingBuffer *buffer, const void *data, size_t element_size, size_t count)
+element_size バイトの要素を、1回のロックで入るだけ最大 count 個書き込みます。
+要素単位で書き込むので、入りきらない場合でも要素が途中で切れることはありません。
+オーバーフロー時の方針によらず、入りきらなかった要素は書き込まずに残します。
+
+- buffer: RingBuffer構造体のポインタ。
+- data: 要素を先頭から詰めた配列のポインタ。
+- element_size: 要素のバイト数。
+- count: 書き込む要素の個数。
+
+戻り値は、書き込んだ要素の個数です。RING_BUFFER_FINISHED、RING_BUFFER_CANCELED を返すこともあります。
+
+### `int ring_buffer_read_elements(RingBuffer *buffer, void *data, size_t element_size, size_t max_count, TickType_t xTicksToWait)
+element_size バイトの要素を、1回のロックで揃っている分だけ最大 max_count 個読み込みます。
+少なくともひとつの要素が揃うまで指定時間待ちます。要素に満たない残りは読み込みません。
+
+- buffer: RingBuffer構造体のポインタ。
+- data: 要素を格納する配列のポインタ。
+- element_size: 要素のバイト数。
+- max_count: data に入る要素の個数。
+- xTicksToWait: 待機する時間（FreeRTOSのTick単位）。
+
+戻り値は、読み込んだ要素の個数です。時間切れの場合は RING_BUFFER_TIMEOUT を返します。
+書き込みが終了していて要素がない場合は RING_BUFFER_FINISHED を、キャンセルされた場合は RING_BUFFER_CANCELED を返します。
+
+C++ からは、ring_buffer.hpp の TypedRingBuffer<T> を使うと、これらの関数で T をまとめて読み書きできます。
+
+### `int ring_buffer_write_reserve(RingBuffer *buffer, size_t size, RingBufferSpan spans[2])
+メモリバッファの空き領域を最大 size バイト予約し、その領域を最大2つの連続領域として spans に返します。
+呼び出し側は spans に直接データを書き込み、ring_buffer_write_commit で確定します。
+ファイルバッファにデータが残っている間は、順序を保つために 0 を返します。
+その場合は ring_buffer_write を使ってください。
+
+- buffer: RingBuffer構造体のポインタ。
+- size: 予約したいバイト数。
+- spans: 予約した領域を受け取る配列。2つ目の領域は、折り返す場合だけサイズが 0 以外になります。
+
+戻り値は、予約できたバイト数です。RING_BUFFER_FINISHED、RING_BUFFER_CANCELED を返すこともあります。
+
+注意: ring_buffer_set_spsc で SPSC モードにしていない場合、1 以上を返したときはミューテックスを保持したまま戻り、
+ring_buffer_write_commit まで解放しません。その間は他のタスクの読み書き、書き出し、補充、統計の取得まで
+すべて止まります。次のことを守ってください。
+- 予約から確定までの間に、待ちを伴う処理 (キューやセマフォの待ち、vTaskDelay、ファイルやネットワークの入出力など) をしない。
+- 必ず同じタスクから ring_buffer_write_commit を呼ぶ。書かずにやめる場合も size に 0 を渡して呼ぶ。
+- 確定するまで、同じタスクからこのリングバッファの関数 (ring_buffer_write_reserve を含む) を呼ばない。
+  ミューテックスは再帰的に取れないので、その場でデッドロックします。
+
+### `int ring_buffer_write_commit(RingBuffer *buffer, size_t size)
+ring_buffer_write_reserve で予約した領域の先頭 size バイトを確定し、読み込めるようにします。
+
+- buffer: RingBuffer構造体のポインタ。
+- size: 確定するバイト数 (予約したバイト数以下)。0 を渡すと予約を取り消します。
+
+戻り値は RING_BUFFER_OK です。SPSC モードでない場合は、ここでミューテックスを解放します。
+
+### `int ring_buffer_read_peek(RingBuffer *buffer, size_t size, RingBufferSpan spans[2])
+メモリバッファにあるデータを最大 size バイト、コピーせずに最大2つの連続領域として spans に返します。
+メモリバッファが空でファイルバッファにデータがある場合は、先にファイルからメモリへ移動します。
+返した領域は ring_buffer_read_consume を呼ぶまで有効です。読み込みは1つのタスクから行ってください。
+
+- buffer: RingBuffer構造体のポインタ。
+- size: 取得したい最大バイト数。
+- spans: データの領域を受け取る配列。
+
+戻り値は、取得できたバイト数です。待機はしません。書き込みが終了していてデータがない場合は RING_BUFFER_FINISHED を、
+キャンセルされた場合は RING_BUFFER_CANCELED を返します。
+
+### `int ring_buffer_read_consume(RingBuffer *buffer, size_t size)
+ring_buffer_read_peek で取得したデータの先頭 size バイトを消費します。
+
+- buffer: RingBuffer構造体のポインタ。
+- size: 消費するバイト数。
+
+戻り値は RING_BUFFER_OK です。
+
+### `int ring_buffer_drain(RingBuffer *buffer, RingBufferSink sink, void *ctx, size_t max_bytes)
+積んであるデータを先頭から最大 max_bytes バイト、読み込み用のバッファを使わずに sink に渡します。
+メモリのデータは memory_buffer の連続領域をそのまま渡し、ファイルなどメモリより後ろにあるデータは
+RING_BUFFER_DRAIN_CHUNK バイトずつまとめて読み込んで渡します。メモリへの補充は行いません。
+sink が受け付けたバイト数だけを消費し、sink が size より小さい値を返した時点で止めるので、途中までの送信にも使えます。
+sink はミューテックスを保持したまま呼ばれます。sink の中で同じバッファの関数を呼ばないでください。
+sink が戻るまで、書き込み側は待たされます。待たずに、今あるデータだけを渡します。
+
+- buffer: RingBuffer構造体のポインタ。
+- sink: データを受け取るコールバック。
+- ctx: sink に渡すポインタ。
+- max_bytes: 渡す最大バイト数。
+
+戻り値は、sink が受け付けたバイト数の合計です。書き込みが終了していてデータがない場合は RING_BUFFER_FINISHED を、
+キャンセルされた場合は RING_BUFFER_CANCELED を返します。
+
+### `int ring_buffer_add_reader(RingBuffer *buffer, RingBufferReaderPolicy policy)
+ひとつのデータ列を複数のタスクがそれぞれ読み込むための、読み込みカーソルを登録します。
+データはすべてのカーソルが読み終えるまで残り、いちばん遅いカーソルが進んだ分だけ空きになります。
+カーソルは登録した時点で積んであるデータの先頭から読み込みます。
+カーソルを登録している間は、ring_buffer_read などの通常の読み込み関数を使わないでください。
+
+遅れているカーソルのために書き込む空きがない場合の扱いを policy で指定します。
+RING_BUFFER_READER_BLOCK は通常の読み込みと同じく、書き込み側を待たせるかオーバーフローさせます。
+RING_BUFFER_READER_SKIP は古いデータを読み飛ばし、RING_BUFFER_READER_DETACH はカーソルを切り離します。
+
+- buffer: RingBuffer構造体のポインタ。
+- policy: 遅れた場合の扱い。
+
+戻り値は、カーソルの番号です。RING_BUFFER_READERS_MAX 個を超える場合は -1 を返します。
+
+### `void ring_buffer_remove_reader(RingBuffer *buffer, int reader)
+読み込みカーソルを削除します。切り離されたカーソルも削除してください。
+
+- buffer: RingBuffer構造体のポインタ。
+- reader: カーソルの番号。
+
+### `int ring_buffer_reader_read(RingBuffer *buffer, int reader, uint8_t *data, size_t size, TickType_t xTicksToWait)
+読み込みカーソルの位置から読み込みます。待ち方と戻り値は ring_buffer_read と同じです。
+カーソルが切り離されている場合は RING_BUFFER_DETACHED を返します。
+
+- buffer: RingBuffer構造体のポインタ。
+- reader: カーソルの番号。
+- data: 読み込むデータのポインタ。
+- size: 読み込むデータのサイズ。
+- xTicksToWait: データを待つ最大 tick 数。
+
+### `uint64_t ring_buffer_reader_skipped(RingBuffer *buffer, int reader)
+RING_BUFFER_READER_SKIP のカーソルが、これまでに読み飛ばしたバイト数を返します。
+
+- buffer: RingBuffer構造体のポインタ。
+- reader: カーソルの番号。
+
+### `void ring_buffer_set_spsc(RingBuffer *buffer, bool enable)
+単一の書き込みタスクと単一の読み込みタスクだけがリングバッファを使う場合の SPSC モードを設定します。
+SPSC モードでは、メモリバッファだけで完結する読み書きはミューテックスを取らずに行い、
+ファイルバッファが関わる場合だけミューテックスを取ります。
+RING_BUFFER_OVERFLOW_DROP_OLDEST では書き込み側が古いデータを捨てるので、読み込みは常にミューテックスを取ります。
+
+- buffer: RingBuffer構造体のポインタ。
+- enable: SPSC モードを有効にする場合 true。
+
+### `void ring_buffer_set_overflow_policy(RingBuffer *buffer, RingBufferOverflowPolicy policy, TickType_t block_ticks)
+メモリバッファとファイルバッファがいっぱいのときの書き込みの扱いを設定します。初期値は RING_BUFFER_OVERFLOW_PARTIAL です。
+
+- RING_BUFFER_OVERFLOW_PARTIAL: 入る分だけ書き込んで RING_BUFFER_OVERFLOW を返します。
+- RING_BUFFER_OVERFLOW_REJECT: 全体が入らなければ何も書き込まずに RING_BUFFER_OVERFLOW を返します。
+- RING_BUFFER_OVERFLOW_DROP_OLDEST: いちばん古いデータを捨てて空きを作り、常に新しいデータを残します。
+  データは読まずに、メモリ、ファイル、ステージングの先頭を進めるだけで捨てます。
+  捨てるのは、新しいデータを末尾に足せる空きに足りない分です。ファイルにデータがある間は新しいデータをその後ろにしか
+  足せないので、メモリ (と途中の階層) のデータも合わせて捨て、ファイルの先頭から足りない分を捨てます。
+  空いたメモリはファイルを読み終えるまで使いません。階層の間でデータを移さないので、ファイルを読むことはありません。書き出しタスクがある場合、ファイルに空きがあってステージングだけが足りないときは、捨てずに書き出しを待ちます。
+  全体がバッファに入りきらない書き込みは、末尾の入る分だけを残します。読み込みカーソルが読んでいなかった分は読み飛ばしになります。
+- RING_BUFFER_OVERFLOW_BLOCK: 全体が入るまで待ちます。ring_buffer_write は block_ticks まで待ち、
+  時間切れの場合は何も書き込まずに RING_BUFFER_TIMEOUT を返します。
+
+REJECT と BLOCK では、待ってもバッファ全体に入りきらない書き込みはすぐに RING_BUFFER_OVERFLOW を返します。
+
+- buffer: RingBuffer構造体のポインタ。
+- policy: オーバーフロー時の方針。
+- block_ticks: RING_BUFFER_OVERFLOW_BLOCK で ring_buffer_write が待つ時間（FreeRTOSのTick単位）。
+
+### `void ring_buffer_get_overflow_stats(RingBuffer *buffer, RingBufferOverflowStats *stats)
+ring_buffer_write、ring_buffer_write_timeout、ring_buffer_write_report の累計を取得します。
+accepted は書き込めたバイト数、dropped は空きを作るために捨てたバイト数、
+rejected はオーバーフローや時間切れで書き込めなかったバイト数です。
+
+- buffer: RingBuffer構造体のポインタ。
+- stats: 統計を格納する構造体のポインタ。
+
+### `bool ring_buffer_set_write_combining(RingBuffer *buffer, bool enable)
+複数の書き込みタスクが小さなデータを書き込む場合の、書き込みの集約を設定します。
+有効にすると、ring_buffer_write はミューテックスを待たずにデータをスロットに公開し、
+その時点でミューテックスを持っているタスクが、解放する前にスロットの書き込みをまとめて反映します。
+ミューテックスの受け渡しが減るため、書き込みタスクが多い場合のスループットと待ち時間が改善します。
+スロット (RING_BUFFER_COMBINING_SLOTS 個) がすべて使われている場合は、通常どおりミューテックスを待ちます。
+書き込みの結果は ring_buffer_write と同じです。書き込みタスクが動いていないときに設定してください。
+無効な場合 (初期値) は、ミューテックスの解放はセマフォを返すだけで、集約のための処理は行いません。
+
+- buffer: RingBuffer構造体のポインタ。
+- enable: 書き込みの集約を有効にする場合 true。
+
+戻り値は、設定できた場合 true です。
+
+### `void ring_buffer_set_promotion_watermarks(RingBuffer *buffer, size_t low, size_t high)
+ファイルからメモリへの補充の水位を設定します。読み込み後にメモリの使用量が low を下回り、
+ファイルにデータがある場合、メモリの使用量が high になるまでファイルからまとめて移動します。
+初期値はどちらも memory_size です。
+
+- buffer: RingBuffer構造体のポインタ。
+- low: 補充を開始するメモリ使用量。
+- high: 補充を終えるメモリ使用量 (memory_size 以下)。
+
+### `bool ring_buffer_start_promotion_task(RingBuffer *buffer, uint32_t stack_size, UBaseType_t priority)
+ファイルからメモリへの補充をバックグラウンドのFreeRTOSタスクで行うようにします。
+補充は RING_BUFFER_PROMOTION_CHUNK バイトごとにミューテックスを手放しながら行うため、
+読み込み側はファイルの読み込みを待たず、書き込み側も補充の間ずっと待たされることはありません。
+タスクは ring_buffer_free で停止します。
+
+- buffer: RingBuffer構造体のポインタ。
+- stack_size: タスクのスタックサイズ。
+- priority: タスクの優先度。
+
+戻り値は、タスクを開始できた場合 true です。
+
+### `void ring_buffer_set_read_threshold(RingBuffer *buffer, size_t bytes, TickType_t max_delay_ticks)
+ring_buffer_wait_read_threshold で待っている読み込みタスクを起こす条件を設定します。
+メモリ、階層、ファイル、staging に積んであるデータの合計が bytes 以上になるか、
+待機中のタスクが最初のデータを見つけてから max_delay_ticks 経つと起こします。
+書き込み側は条件を満たしたときだけ待機中のタスクにタスク通知を送るので、書き込みごとに読み込み側が起きることはありません。
+初期値は 1 バイトで、遅延の上限はありません (portMAX_DELAY)。
+
+- buffer: RingBuffer構造体のポインタ。
+- bytes: 読み込みタスクを起こすバイト数。0 は 1 として扱います。
+- max_delay_ticks: 最初のデータから待つ時間の上限（FreeRTOSのTick単位）。portMAX_DELAY なら上限なし。
+
+### `int ring_buffer_wait_read_threshold(RingBuffer *buffer, TickType_t xTicksToWait)
+ring_buffer_set_read_threshold の条件を満たすまで待ちます。データは読み込まないので、戻った後に ring_buffer_read などで読み込みます。
+待てるタスクは同時にひとつだけです。CONFIG_FREERTOS_TASK_NOTIFICATION_ARRAY_ENTRIES が 2 以上の場合は、
+RING_BUFFER_THRESHOLD_NOTIFY_INDEX 番 (初期値は通知の配列の最後の要素) のタスク通知で待ちます。
+1 の場合 (ESP-IDF の初期値) は、リングバッファのイベントグループのビットで待ちます。
+どちらの場合も、アプリケーションが使う 0 番の通知には触れません。
+
+- buffer: RingBuffer構造体のポインタ。
 - xTicksToWait: 待機する時間（FreeRTOSのTick単位）。
 
-戻り値は、実際に読み込んだバイト数です。キャンセルされた場合は RING_BUFFER_CANCELED を返します。
+戻り値は、しきい値に届いたか、遅延の上限が過ぎたか、書き込みが終了した時点で積んであるバイト数です。
+時間切れの場合は RING_BUFFER_TIMEOUT を返します。
+書き込みが終了していてデータがない場合は RING_BUFFER_FINISHED を、キャンセルされた場合は RING_BUFFER_CANCELED を返します。
+
+### `bool ring_buffer_start_spill_task(RingBuffer *buffer, uint8_t *staging, size_t staging_size, uint32_t stack_size, UBaseType_t priority)
+ファイルバッファへの書き込みをバックグラウンドのFreeRTOSタスクで行うようにします。
+メモリバッファがいっぱいの場合、書き込み側はファイルではなく staging に書き込み、
+タスクが staging のデータをまとめてファイルへ書き出します。書き込み側がフラッシュへの書き込みを待つことはありません。
+読み込みはメモリ、ファイル、staging の順に行うため、FIFO の順序は保たれます。
+
+staging がいっぱいでファイルバッファに空きがある場合、書き込み側はタスクが staging を書き出すのを待ちます。
+この待機は xTicksToWait に関係なく行われます。
+staging のデータはファイルバッファの空きとして予約されるため、全体の容量は変わりません。
+タスクは ring_buffer_free で停止します。
+
+- buffer: RingBuffer構造体のポインタ。
+- staging: ステージング用のバッファのポインタ。
+- staging_size: ステージング用のバッファのサイズ。
+- stack_size: タスクのスタックサイズ。
+- priority: タスクの優先度。
+
+戻り値は、タスクを開始できた場合 true です。
+
+### `int ring_buffer_flush(RingBuffer *buffer, TickType_t xTicksToWait)
+staging のデータがすべてファイルへ書き出されるのを待ち、永続モードではヘッダを書き込んでから、ファイルを fflush と fsync
+(メモリマップしている場合は msync も) でストレージに反映します。
+書き出しタスクを使っていない場合は、ファイルの反映だけを行います。
+
+- buffer: RingBuffer構造体のポインタ。
+- xTicksToWait: staging が空になるのを待つ時間（FreeRTOSのTick単位）。
+
+戻り値は、成功した場合 RING_BUFFER_OK、時間切れの場合 RING_BUFFER_TIMEOUT、
+キャンセルされた場合 RING_BUFFER_CANCELED、ファイルへの反映に失敗した場合 0 です。
+
+### `void ring_buffer_get_write_stats(RingBuffer *buffer, RingBufferWriteStats *stats)
+ファイルバッファへの書き込みの統計を取得します。accepted はファイルバッファが受け付けたバイト数、
+written は実際にファイルへ書き込んだバイト数、sector_writes は書き込みが触れたセクタ (sector_size 単位) の数です。
+sector_writes * sector_size / accepted が、フラッシュでの書き込み増幅の目安になります。
+
+- buffer: RingBuffer構造体のポインタ。
+- stats: 統計を格納する構造体のポインタ。
+
+### `void ring_buffer_get_compress_stats(RingBuffer *buffer, RingBufferCompressStats *stats)
+圧縮の統計を取得します。raw_bytes は圧縮したバイト数、stored_bytes は圧縮後にファイルへ書き込んだバイト数
+(フレームのヘッダを含む) の累計です。raw_bytes / stored_bytes が圧縮率の目安になります。
+壊れたフレームを見つけると、フレームには区切りの目印がないため、そのフレームから後ろをファイルから捨てて
+(チャンクに溜めているデータは残します) エラーログを出します。corrupt_frames はその回数、lost_bytes は
+そのために読めなくなったバイト数の累計です。圧縮していない場合はすべて 0 です。
+
+- buffer: RingBuffer構造体のポインタ。
+- stats: 統計を格納する構造体のポインタ。
+
+### `void ring_buffer_set_segment_limit(RingBuffer *buffer, size_t count)
+同時にファイルを置けるセグメントの数を設定します。ファイルバッファに積めるのは、先頭のセグメントから数えて
+count 個のセグメントに収まる分までになります。count は 1 からセグメントの数までに丸めます。
+既に積んであるデータは消さず、上限を超えている間は書き込めません。使い回すために残してあるファイルは、
+上限を超える分を削除します。セグメントに分けていない場合は何もしません。
+
+- buffer: RingBuffer構造体のポインタ。
+- count: セグメントの数。
+
+### `size_t ring_buffer_segment_files(RingBuffer *buffer)
+ディスク上にあるセグメントファイルの数 (使い回すために残してあるファイルを含む) を返します。
+
+- buffer: RingBuffer構造体のポインタ。
+
+### `RingBufferTier ring_buffer_memory_tier_init(RingBufferMemoryTier *tier, uint8_t *memory, size_t size)
+memory の size バイトをリングバッファとして使う階層を初期化して返します。戻り値を RingBufferConfig.tiers に
+渡すと、メモリバッファとファイルバッファの間の階層として使えます。PSRAM のような、内部 RAM より大きく
+フラッシュより速いメモリを想定しています。
+
+- tier: 階層の状態を格納する構造体のポインタ。階層を使う間は有効にしてください。
+- memory: 階層に使うメモリ。
+- size: memory のサイズ。
+
+### `bool ring_buffer_get_stats(RingBuffer *buffer, RingBufferStats *stats)
+実行時の統計を取得します。階層 (メモリ、ファイル、ステージング) ごとに積んだバイト数と取り出したバイト数、
+ファイルへのあふれとメモリへの補充の回数、memory_len と file_len の最大値、オーバーフローとキャンセルの回数、
+ミューテックスの待ち時間、読み書きの関数のレイテンシのヒストグラム (log2 マイクロ秒の区間) を含みます。
+統計は RING_BUFFER_STATS が 1 (menuconfig の CONFIG_RING_BUFFER_STATS) の場合だけ集めます。
+0 の場合は計測のコードが取り除かれ、この関数は stats をゼロで埋めて false を返します。
+
+- buffer: RingBuffer構造体のポインタ。
+- stats: 統計を格納する構造体のポインタ。
+
+### `void ring_buffer_reset_stats(RingBuffer *buffer)
+実行時の統計をリセットします。最大値は現在の memory_len と file_len から数え直します。
+
+- buffer: RingBuffer構造体のポインタ。
+
+### `size_t ring_buffer_occupied_size(RingBuffer *buffer)
+メモリ、ファイル、ステージングに積んであるデータの合計バイト数を返します。
+
+- buffer: RingBuffer構造体のポインタ。
 
 ### `void ring_buffer_finish_write(RingBuffer *buffer)
 リングバッファへの書き込みを終了します。書き込み終了後は、ring_buffer_write 関数は RING_BUFFER_FINISHED を返します。
+データを待っている ring_buffer_read は、その時点までに読み込んだデータを返します。
 
 buffer: RingBuffer構造体のポインタ。
 
@@ -67,44 +538,484 @@ RING_BUFFER_CANCELED を返します。
 
 ### `void ring_buffer_free(RingBuffer *buffer)
 リングバッファを解放します。使用していたリソースを解放します。
+永続モードでは、解放の前にヘッダを書き込みます。
 
 - buffer: RingBuffer構造体のポインタ。
 */
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
 #include <freertos/queue.h>
 #include <freertos/semphr.h>
 #include <freertos/task.h>
 
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// リングバッファ上の連続領域
+typedef struct {
+  uint8_t *data;
+  size_t size;
+} RingBufferSpan;
+
+// ring_buffer_drain にデータを渡されるコールバック
+// data の先頭から受け付けたバイト数を返す。size より小さい値を返すと、残りはバッファに残る
+typedef size_t (*RingBufferSink)(void *ctx, const uint8_t *data, size_t size);
+
+// ring_buffer_writev / ring_buffer_readv に渡すデータの断片
+typedef struct {
+  void *data;
+  size_t size;
+} RingBufferVec;
+
+// 書き込みの集約で、書き込み側が書き込みを公開するスロット
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  int result;             // 書き込めたバイト数、または RING_BUFFER_FINISHED / RING_BUFFER_CANCELED
+  uint32_t state;         // RING_BUFFER_SLOT_*
+  SemaphoreHandle_t done; // 反映されると与えられる
+} RingBufferCombiningSlot;
+
+// 書き込みの集約に使うスロットの数
+#ifndef RING_BUFFER_COMBINING_SLOTS
+#define RING_BUFFER_COMBINING_SLOTS 8
+#endif
+
+// 読み込みカーソルの最大数
+#ifndef RING_BUFFER_READERS_MAX
+#define RING_BUFFER_READERS_MAX 4
+#endif
+
+// 遅れている読み込みカーソルのために書き込む空きがないときの扱い
+typedef enum {
+  RING_BUFFER_READER_BLOCK,  // 読み込むまでデータを残す。書き込み側は空きを待つかオーバーフローする
+  RING_BUFFER_READER_SKIP,   // 古いデータを読み飛ばして空きを作る
+  RING_BUFFER_READER_DETACH, // カーソルを切り離して空きを作る
+} RingBufferReaderPolicy;
+
+// 読み込みカーソル
+typedef struct {
+  bool attached;                 // 登録されている
+  bool detached;                 // 遅れたために切り離された
+  RingBufferReaderPolicy policy; // 遅れた場合の扱い
+  uint64_t position;             // 次に読む位置 (stream_head と同じ起点からのバイト数)
+  uint64_t skipped;              // 読み飛ばしたバイト数
+} RingBufferReader;
+
+// メモリとファイルがいっぱいのときの書き込みの扱い
+typedef enum {
+  RING_BUFFER_OVERFLOW_PARTIAL,     // 入る分だけ書き込んで RING_BUFFER_OVERFLOW を返す
+  RING_BUFFER_OVERFLOW_REJECT,      // 全体が入らなければ何も書き込まずに RING_BUFFER_OVERFLOW を返す
+  RING_BUFFER_OVERFLOW_DROP_OLDEST, // いちばん古いデータを捨てて空きを作る
+  RING_BUFFER_OVERFLOW_BLOCK,       // 全体が入るまで待つ。時間切れなら何も書き込まずに RING_BUFFER_TIMEOUT を返す
+} RingBufferOverflowPolicy;
+
+// 1回の書き込みの結果
+typedef struct {
+  size_t accepted; // 書き込めたバイト数
+  size_t dropped;  // 空きを作るために捨てたバイト数 (RING_BUFFER_OVERFLOW_DROP_OLDEST)
+} RingBufferWriteReport;
+
+// 書き込みの受け付けの統計 (ring_buffer_write / ring_buffer_write_timeout / ring_buffer_write_report の累計)
+typedef struct {
+  uint64_t accepted; // 書き込めたバイト数
+  uint64_t dropped;  // 空きを作るために捨てたバイト数
+  uint64_t rejected; // オーバーフローや時間切れで書き込めなかったバイト数
+} RingBufferOverflowStats;
+
+// セグメントの最大数と、セグメントファイル名の接頭辞の最大長
+#ifndef RING_BUFFER_SEGMENTS_MAX
+#define RING_BUFFER_SEGMENTS_MAX 16
+#endif
+#ifndef RING_BUFFER_SEGMENT_NAME_MAX
+#define RING_BUFFER_SEGMENT_NAME_MAX 64
+#endif
+
+// セグメントファイル
+typedef struct {
+  FILE *file;  // 開いているファイル (ない場合は NULL)
+  size_t pos;  // ストリームの現在位置 (不明な場合は RING_BUFFER_FILE_POS_UNKNOWN)
+  int last_op; // 直前のファイル操作 (RING_BUFFER_FILE_OP_*)
+  uint32_t id; // ファイル名の番号
+} RingBufferSegment;
+
+// メモリとファイルの間に積める階層の最大数
+#ifndef RING_BUFFER_TIERS_MAX
+#define RING_BUFFER_TIERS_MAX 4
+#endif
+
+// 階層のバックエンドの操作
+// 先入れ先出しのバイト列として振る舞うこと。ctx には RingBufferTier.ctx が渡される
+// 呼び出しはすべて RingBuffer のミューテックスを保持した状態で行う
+typedef struct {
+  size_t (*write)(void *ctx, const uint8_t *data, size_t size);         // 末尾に書き込み、書き込めたバイト数を返す
+  size_t (*peek)(void *ctx, size_t offset, uint8_t *data, size_t size); // 先頭から offset バイト目以降を読み込む
+  void (*consume)(void *ctx, size_t size);                              // 先頭から size バイトを捨てる
+  size_t (*usage)(void *ctx);                                           // 積んであるバイト数
+  size_t (*space)(void *ctx);                                           // 書き込める残りのバイト数
+} RingBufferTierOps;
+
+// 階層
+typedef struct {
+  const RingBufferTierOps *ops;
+  void *ctx;
+} RingBufferTier;
+
+// RAM のリングバッファを使う階層 (PSRAM など)
+typedef struct {
+  uint8_t *memory;
+  size_t size;
+  size_t head;
+  size_t len;
+} RingBufferMemoryTier;
+
+// ファイルの事前確保の方法
+typedef enum {
+  RING_BUFFER_PREALLOCATE_LAZY,      // 確保しない。書き込み位置が進むのに合わせてファイルが伸びる
+  RING_BUFFER_PREALLOCATE_ZERO_FILL, // ゼロページを繰り返し書き込んで確保する
+  RING_BUFFER_PREALLOCATE_TRUNCATE,  // fallocate / ftruncate で確保する (未対応ならゼロ埋め)
+} RingBufferPreallocate;
+
+// RING_BUFFER_DEFINE で静的に確保する領域
+typedef struct {
+  uint8_t *memory;           // メモリバッファ
+  size_t memory_size;        // メモリバッファのサイズ (2のべき乗)
+  size_t file_size;          // ファイルバッファのサイズ
+  size_t buffer_size;        // 定義した翻訳単位での sizeof(RingBuffer) (レイアウトのマクロが揃っているかの確認用)
+  StaticSemaphore_t mutex;   // ミューテックスの領域
+  StaticEventGroup_t events; // イベントグループの領域
+} RingBufferStatic;
+
+// C と C++ のどちらからでも使えるコンパイル時の検査
+#ifdef __cplusplus
+#define RING_BUFFER_STATIC_ASSERT static_assert
+#else
+#define RING_BUFFER_STATIC_ASSERT _Static_assert
+#endif
+
+// ヒープを使わないリングバッファを定義する
+// name という RingBuffer と、メモリバッファ、ミューテックスとイベントグループの領域を静的に確保する
+// mem_size はコンパイル時に2のべき乗であることを確かめる (マスクは実行時の値で、書き込みの経路は ring_buffer_init と同じ)
+// 使う前に RING_BUFFER_INIT_STATIC で初期化する
+#define RING_BUFFER_DEFINE(name, mem_size, file_sz)                                                                    \
+  RING_BUFFER_STATIC_ASSERT((mem_size) > 0 && ((mem_size) & ((mem_size) - 1)) == 0,                                    \
+                            #name ": mem_size must be a power of two");                                                \
+  static uint8_t name##_memory[(mem_size)];                                                                            \
+  static RingBufferStatic name##_static = {                                                                            \
+      .memory = name##_memory,                                                                                         \
+      .memory_size = (mem_size),                                                                                       \
+      .file_size = (file_sz),                                                                                          \
+      .buffer_size = sizeof(RingBuffer)};                                                                              \
+  static RingBuffer name
+
+// RING_BUFFER_DEFINE で定義したリングバッファを初期化する (config が NULL なら初期値を使う)
+#define RING_BUFFER_INIT_STATIC(name, file_name, config)                                                               \
+  ring_buffer_init_static(&(name), &name##_static, (file_name), (config))
+
+// ring_buffer_init_with_config に渡す設定
+typedef struct {
+  bool persistent;                   // ファイルの内容を再起動後に引き継ぐ
+  size_t checkpoint_interval;        // 永続モードで、ファイルのデータがこのバイト数変化するごとにヘッダを書き込む
+  RingBufferPreallocate preallocate; // 初期化時のファイルの確保方法
+  void *compress_work;               // 圧縮モードの作業領域 (RING_BUFFER_COMPRESS_WORK_SIZE バイト、NULL なら圧縮しない)
+  uint8_t *sector_buffer;            // セクタ単位で書き込むためのバッファ (sector_size バイト、NULL なら使わない)
+  size_t sector_size;                // フラッシュのセクタサイズ
+  size_t segment_size;               // ファイルを分けるセグメントのバイト数 (0 なら1つのファイルを使う)
+  bool segment_recycle;              // 読み終えたセグメントファイルを消さずに、次のセグメントに使い回す
+  const RingBufferTier *tiers;       // メモリとファイルの間に積む階層 (メモリに近い順)
+  size_t tier_count;                 // tiers の数 (最大 RING_BUFFER_TIERS_MAX)
+} RingBufferConfig;
+
+// 実行時の統計を集める場合は 1 (menuconfig の CONFIG_RING_BUFFER_STATS で有効にする)
+// 0 の場合は計測のコードがすべて取り除かれ、RingBuffer にも統計の領域を持たない
+// RingBuffer の大きさが変わるので、翻訳単位ごとに変えられないよう sdkconfig だけで決める
+#ifdef RING_BUFFER_STATS
+#error "RING_BUFFER_STATS is derived from CONFIG_RING_BUFFER_STATS; set it in menuconfig instead"
+#endif
+#ifdef CONFIG_RING_BUFFER_STATS
+#define RING_BUFFER_STATS 1
+#else
+#define RING_BUFFER_STATS 0
+#endif
+
+// レイテンシのヒストグラムの区間の数
+// 区間 i は 2^(i-1) 以上 2^i 未満マイクロ秒 (区間 0 は 1 マイクロ秒未満、最後の区間はそれ以上すべて)
+#define RING_BUFFER_LATENCY_BUCKETS 16
+
+// 実行時の統計
+typedef struct {
+  uint64_t memory_in;        // メモリに積んだバイト数
+  uint64_t memory_out;       // メモリから取り出したバイト数
+  uint64_t file_in;          // ファイルに積んだバイト数
+  uint64_t file_out;         // ファイルから取り出したバイト数
+  uint64_t staging_in;       // ステージングに積んだバイト数
+  uint64_t staging_out;      // ステージングから取り出したバイト数
+  uint32_t spill_count;      // メモリに入りきらず、ファイルかステージングへ書き込んだ回数
+  uint32_t promotion_count;  // ファイルかステージングからメモリへ補充した回数
+  size_t memory_high_water;  // memory_len の最大値
+  size_t file_high_water;    // file_len の最大値
+  uint32_t overflow_count;   // 書き込みが RING_BUFFER_OVERFLOW で終わった回数
+  uint32_t canceled_count;   // 読み書きが RING_BUFFER_CANCELED で終わった回数
+  uint32_t lock_count;       // ミューテックスを取得した回数
+  uint64_t lock_wait_us;     // ミューテックスの取得を待った合計時間 (マイクロ秒)
+  uint32_t lock_wait_max_us; // ミューテックスの取得を待った最大時間 (マイクロ秒)
+
+  uint32_t write_latency[RING_BUFFER_LATENCY_BUCKETS]; // 書き込み関数の呼び出しにかかった時間の分布
+  uint32_t read_latency[RING_BUFFER_LATENCY_BUCKETS];  // 読み込み関数の呼び出しにかかった時間の分布
+} RingBufferStats;
+
+// ファイルへの書き込みの統計
+typedef struct {
+  uint64_t accepted;      // ファイルバッファが受け付けたバイト数
+  uint64_t written;       // ファイルへ書き込んだバイト数
+  uint64_t sector_writes; // 書き込みが触れたセクタの数 (一部だけの書き込みも1と数える)
+} RingBufferWriteStats;
+
+// 圧縮の統計
+typedef struct {
+  uint64_t raw_bytes;      // 圧縮したバイト数の累計
+  uint64_t stored_bytes;   // 圧縮後にファイルへ書き込んだバイト数の累計 (フレームのヘッダを含む)
+  uint64_t lost_bytes;     // 壊れたフレームのために読めずに捨てたバイト数 (展開後のバイト数)
+  uint32_t corrupt_frames; // 壊れたフレームを見つけた回数
+} RingBufferCompressStats;
+
+// RingBufferConfig の初期値
+#define RING_BUFFER_CONFIG_DEFAULT                                                                                     \
+  {.persistent = false,                                                                                                \
+   .checkpoint_interval = RING_BUFFER_CHECKPOINT_INTERVAL,                                                             \
+   .preallocate = RING_BUFFER_PREALLOCATE_LAZY,                                                                        \
+   .compress_work = NULL,                                                                                              \
+   .sector_buffer = NULL,                                                                                              \
+   .sector_size = RING_BUFFER_SECTOR_SIZE,                                                                             \
+   .segment_size = 0,                                                                                                  \
+   .segment_recycle = false,                                                                                           \
+   .tiers = NULL,                                                                                                      \
+   .tier_count = 0}
+
 typedef struct {
   uint8_t *memory_buffer;
   size_t memory_size;
-  size_t memory_head;
-  size_t memory_len;
+  size_t memory_mask;    // memory_size が2のべき乗なら memory_size - 1、それ以外は 0
+  size_t memory_head;    // 読み込み側だけが更新する
+  size_t memory_tail;    // 書き込み側だけが更新する
+  size_t memory_len;     // アトミックに増減する
+  size_t write_reserved; // ring_buffer_write_reserve で予約中のバイト数
 
   FILE *file;
   size_t file_size;
   size_t file_head;
   size_t file_len;
+  size_t file_pos;  // ストリームの現在位置 (不明な場合は RING_BUFFER_FILE_POS_UNKNOWN)
+  int file_last_op; // 直前のファイル操作 (RING_BUFFER_FILE_OP_*)
+  uint8_t *file_map; // メモリマップしたファイル (マップしていない場合は NULL)
+  size_t file_offset; // ファイル内のデータ領域の開始位置 (永続モードではヘッダの後ろ)
+
+  bool persistent;            // ファイルの先頭のヘッダに file_head と file_len を保存する
+  size_t checkpoint_interval; // ファイルのデータがこのバイト数変化するごとにヘッダを書き込む
+  size_t checkpoint_pending;  // 直前のヘッダ書き込みから変化したバイト数
+  uint32_t header_sequence;   // 直前に書き込んだヘッダの sequence
+  int header_slot;            // 直前に書き込んだヘッダのスロット (0 または 1)
+
+  uint8_t *compress_work;         // 圧縮モードの作業領域 (圧縮しない場合は NULL)
+  size_t compress_open_len;       // 圧縮してファイルへ書き出す前のチャンクに溜めているバイト数
+  size_t compress_cache_pos;      // 展開してあるフレームのファイル上の位置 (ない場合は RING_BUFFER_FILE_POS_UNKNOWN)
+  size_t compress_cache_raw;      // 展開してあるフレームの元のサイズ
+  size_t compress_cache_stored;   // 展開してあるフレームの格納サイズ
+  size_t compress_seek_pos;       // 前回の peek で読み始めたフレームの位置 (ない場合は RING_BUFFER_FILE_POS_UNKNOWN)
+  size_t compress_seek_raw;       // file_head から compress_seek_pos までのフレームの展開後のバイト数
+  size_t compress_seek_used;      // file_head から compress_seek_pos までのファイル上のバイト数
+  RingBufferCompressStats compress_stats; // 圧縮の統計
+  size_t file_used;               // 圧縮モードで、フレームがファイル上で使っているバイト数
+  size_t file_skip;               // 圧縮モードで、先頭のフレームのうち読み終えたバイト数
+
+  uint8_t *sector_buffer; // 書き込み中のセクタ (セクタ単位で書き込まない場合は NULL)
+  size_t sector_size;
+  size_t sector_pos;  // sector_buffer に溜めているセクタのファイル上の位置
+  size_t sector_fill; // sector_buffer に溜めているバイト数
+  bool sector_dirty;  // sector_buffer にファイルへ書き込んでいないデータがある
+  RingBufferWriteStats write_stats;
+#if RING_BUFFER_STATS
+  RingBufferStats stats;
+#endif
+
+  size_t segment_size;                                        // セグメントのバイト数 (0 なら1つのファイルを使う)
+  size_t segment_count;                                       // file_size に収まるセグメントの数
+  size_t segment_limit;                                       // 同時にファイルを置けるセグメントの数
+  bool segment_recycle;                                       // 読み終えたセグメントファイルを次のセグメントに使い回す
+  RingBufferPreallocate segment_preallocate;                  // セグメントファイルを作るときの確保方法
+  RingBufferSegment segments[RING_BUFFER_SEGMENTS_MAX];       // file_size を segment_size ごとに分けた各区間のファイル
+  RingBufferSegment segment_spares[RING_BUFFER_SEGMENTS_MAX]; // 使い回すために残してあるファイル
+  size_t segment_spare_count;
+  char segment_name[RING_BUFFER_SEGMENT_NAME_MAX];            // セグメントファイル名の接頭辞
+
+  RingBufferTier tiers[RING_BUFFER_TIERS_MAX + 1]; // メモリより後ろの階層 (最後はファイル)
+  size_t tier_count;                               // tiers の数 (ファイルを含む)
+  size_t tier_len;                                 // ファイルより前の階層に積んであるバイト数。アトミックに増減する
+
+  uint8_t *staging_buffer;          // 書き出しタスクがファイルへ書き出すまでデータを置くRAM
+  size_t staging_size;
+  size_t staging_head;
+  size_t staging_len;               // アトミックに増減する
+  size_t staging_inflight;          // staging_head から書き出し中のバイト数
+  size_t staging_inflight_consumed; // 書き出し中に読み込み側が消費したバイト数
+  TaskHandle_t spill_task;
+  SemaphoreHandle_t spill_done;
+  SemaphoreHandle_t file_lock; // 書き出しタスクの動作中にファイルのストリームを守る
+  bool spill_stop;
+
+  size_t promotion_low;  // メモリ使用量がこの値を下回るとファイルから補充する
+  size_t promotion_high; // 補充はこの値まで行う
+  TaskHandle_t promotion_task;
+  SemaphoreHandle_t promotion_done;
+  bool promotion_stop;
+
+  bool combining;             // 複数の書き込みタスクの書き込みを、ロックを持つタスクがまとめて反映する
+  uint32_t combining_pending; // 公開されていて、反映を待っている書き込みの数
+  RingBufferCombiningSlot combining_slots[RING_BUFFER_COMBINING_SLOTS];
+
+  RingBufferReader readers[RING_BUFFER_READERS_MAX];
+  size_t reader_count;  // 登録されている読み込みカーソルの数
+  uint64_t stream_head; // 積んであるデータの先頭の位置
+
+  RingBufferOverflowPolicy overflow_policy; // メモリとファイルがいっぱいのときの書き込みの扱い
+  TickType_t overflow_block_ticks;          // RING_BUFFER_OVERFLOW_BLOCK で ring_buffer_write が待つ時間
+  RingBufferOverflowStats overflow_stats;   // アトミックに加算する
+
+  size_t read_threshold;            // 読み込みタスクを起こす積んであるデータのバイト数
+  TickType_t read_threshold_delay;  // 最初のデータからこの時間が経つと、しきい値に届かなくても起こす
+  size_t read_threshold_wake;       // 待機中のタスクを起こすバイト数。アトミックに読み書きする
+  TaskHandle_t read_threshold_task; // しきい値を待っているタスク。アトミックに読み書きする
+
+  bool spsc;              // 単一の書き込みタスクと単一の読み込みタスクだけが使う場合 true
+  uint32_t read_waiters;  // データを待っている読み込み側の数
+  uint32_t write_waiters; // 空きを待っている書き込み側の数
 
   bool write_finished;
   bool cancelled;
 
   SemaphoreHandle_t mutex;
+  EventGroupHandle_t events; // 待機中の読み書きを起こすためのイベント (RING_BUFFER_EVENT_*)
 } RingBuffer;
 
 #define RING_BUFFER_OK -1
 #define RING_BUFFER_FINISHED -2
 #define RING_BUFFER_CANCELED -3
+#define RING_BUFFER_TIMEOUT -4
+#define RING_BUFFER_MSG_TOO_LARGE -5
+#define RING_BUFFER_DETACHED -6
 #define RING_BUFFER_OVERFLOW 1
 
+// メッセージの長さのヘッダの最大バイト数と、メッセージの最大サイズ
+#define RING_BUFFER_MSG_HEADER_MAX 4
+#define RING_BUFFER_MSG_SIZE_MAX ((1UL << (7 * RING_BUFFER_MSG_HEADER_MAX)) - 1)
+
+// ring_buffer_drain が、メモリより後ろの階層から1回に読み込んで sink に渡す最大バイト数 (スタックに確保する)
+#ifndef RING_BUFFER_DRAIN_CHUNK
+#define RING_BUFFER_DRAIN_CHUNK 512
+#endif
+
+// ring_buffer_wait_read_threshold が使うタスク通知のインデックス
+// 通知の配列に2つ以上の要素がある場合は、アプリケーションが ulTaskNotifyTake で使う 0 番と重ならないよう最後の要素を使う
+// 1つしかない場合 (ESP-IDF の初期値) は定義せず、タスク通知の代わりにイベントグループのビットで待つ
+// 0 番を指定するとコンパイルエラーになる
+#if !defined(RING_BUFFER_THRESHOLD_NOTIFY_INDEX) && configTASK_NOTIFICATION_ARRAY_ENTRIES >= 2
+#define RING_BUFFER_THRESHOLD_NOTIFY_INDEX (configTASK_NOTIFICATION_ARRAY_ENTRIES - 1)
+#endif
+
+// 永続モードのヘッダ書き込み間隔の初期値 (バイト)
+#ifndef RING_BUFFER_CHECKPOINT_INTERVAL
+#define RING_BUFFER_CHECKPOINT_INTERVAL 4096
+#endif
+
+// フラッシュのセクタサイズの初期値
+#ifndef RING_BUFFER_SECTOR_SIZE
+#define RING_BUFFER_SECTOR_SIZE 4096
+#endif
+
+// 圧縮モードで、まとめて圧縮するチャンクのサイズと、圧縮に使うハッシュ表のビット数
+#ifndef RING_BUFFER_COMPRESS_CHUNK
+#define RING_BUFFER_COMPRESS_CHUNK 2048
+#endif
+#ifndef RING_BUFFER_COMPRESS_HASH_BITS
+#define RING_BUFFER_COMPRESS_HASH_BITS 10
+#endif
+// 圧縮モードの作業領域のバイト数 (先頭を揃えるための余裕を含む)
+#define RING_BUFFER_COMPRESS_WORK_SIZE (RING_BUFFER_COMPRESS_CHUNK * 3 + sizeof(uint32_t))
+
+// 補充タスクが1回のロックで移動する最大バイト数
+#ifndef RING_BUFFER_PROMOTION_CHUNK
+#define RING_BUFFER_PROMOTION_CHUNK 1024
+#endif
+
+// 書き出しタスクは、ステージングがこの割合 (1/n) 以上埋まるか、この間隔が経つとファイルへ書き出す
+#ifndef RING_BUFFER_SPILL_THRESHOLD_DIVISOR
+#define RING_BUFFER_SPILL_THRESHOLD_DIVISOR 2
+#endif
+#ifndef RING_BUFFER_SPILL_INTERVAL_MS
+#define RING_BUFFER_SPILL_INTERVAL_MS 100
+#endif
+
 void ring_buffer_init(RingBuffer *buffer, uint8_t *memory, size_t memory_size, const char *file_name, size_t file_size);
+void ring_buffer_init_with_config(RingBuffer *buffer, uint8_t *memory, size_t memory_size, const char *file_name,
+                                  size_t file_size, const RingBufferConfig *config);
+void ring_buffer_init_static(RingBuffer *buffer, RingBufferStatic *storage, const char *file_name,
+                             const RingBufferConfig *config);
 int ring_buffer_write(RingBuffer *buffer, const uint8_t *data, size_t size);
+int ring_buffer_write_timeout(RingBuffer *buffer, const uint8_t *data, size_t size, TickType_t xTicksToWait);
+int ring_buffer_write_report(RingBuffer *buffer, const uint8_t *data, size_t size, TickType_t xTicksToWait,
+                             RingBufferWriteReport *report);
+int ring_buffer_writev(RingBuffer *buffer, const RingBufferVec *vec, size_t count);
 int ring_buffer_read(RingBuffer *buffer, uint8_t *data, size_t size, TickType_t xTicksToWait);
+int ring_buffer_readv(RingBuffer *buffer, const RingBufferVec *vec, size_t count, TickType_t xTicksToWait);
+int ring_buffer_write_msg(RingBuffer *buffer, const void *data, size_t size);
+int ring_buffer_read_msg(RingBuffer *buffer, void *data, size_t size, TickType_t xTicksToWait);
+int ring_buffer_read_msgs(RingBuffer *buffer, void *data, size_t size, size_t *lengths, size_t max_msgs,
+                          TickType_t xTicksToWait);
+int ring_buffer_write_elements(RingBuffer *buffer, const void *data, size_t element_size, size_t count);
+int ring_buffer_read_elements(RingBuffer *buffer, void *data, size_t element_size, size_t max_count,
+                              TickType_t xTicksToWait);
+// SPSC モード以外では、予約できるとミューテックスを保持したまま戻る (ring_buffer_write_commit まで他の操作が止まる)
+int ring_buffer_write_reserve(RingBuffer *buffer, size_t size, RingBufferSpan spans[2]);
+int ring_buffer_write_commit(RingBuffer *buffer, size_t size);
+int ring_buffer_read_peek(RingBuffer *buffer, size_t size, RingBufferSpan spans[2]);
+int ring_buffer_read_consume(RingBuffer *buffer, size_t size);
+int ring_buffer_drain(RingBuffer *buffer, RingBufferSink sink, void *ctx, size_t max_bytes);
+int ring_buffer_add_reader(RingBuffer *buffer, RingBufferReaderPolicy policy);
+void ring_buffer_remove_reader(RingBuffer *buffer, int reader);
+int ring_buffer_reader_read(RingBuffer *buffer, int reader, uint8_t *data, size_t size, TickType_t xTicksToWait);
+uint64_t ring_buffer_reader_skipped(RingBuffer *buffer, int reader);
+void ring_buffer_set_spsc(RingBuffer *buffer, bool enable);
+void ring_buffer_set_overflow_policy(RingBuffer *buffer, RingBufferOverflowPolicy policy, TickType_t block_ticks);
+void ring_buffer_get_overflow_stats(RingBuffer *buffer, RingBufferOverflowStats *stats);
+bool ring_buffer_set_write_combining(RingBuffer *buffer, bool enable);
+void ring_buffer_set_promotion_watermarks(RingBuffer *buffer, size_t low, size_t high);
+bool ring_buffer_start_promotion_task(RingBuffer *buffer, uint32_t stack_size, UBaseType_t priority);
+void ring_buffer_set_read_threshold(RingBuffer *buffer, size_t bytes, TickType_t max_delay_ticks);
+int ring_buffer_wait_read_threshold(RingBuffer *buffer, TickType_t xTicksToWait);
+bool ring_buffer_start_spill_task(RingBuffer *buffer, uint8_t *staging, size_t staging_size, uint32_t stack_size,
+                                  UBaseType_t priority);
+int ring_buffer_flush(RingBuffer *buffer, TickType_t xTicksToWait);
+void ring_buffer_get_write_stats(RingBuffer *buffer, RingBufferWriteStats *stats);
+void ring_buffer_get_compress_stats(RingBuffer *buffer, RingBufferCompressStats *stats);
+void ring_buffer_set_segment_limit(RingBuffer *buffer, size_t count);
+size_t ring_buffer_segment_files(RingBuffer *buffer);
+RingBufferTier ring_buffer_memory_tier_init(RingBufferMemoryTier *tier, uint8_t *memory, size_t size);
+bool ring_buffer_get_stats(RingBuffer *buffer, RingBufferStats *stats);
+void ring_buffer_reset_stats(RingBuffer *buffer);
+size_t ring_buffer_occupied_size(RingBuffer *buffer);
 void ring_buffer_finish_write(RingBuffer *buffer);
 void ring_buffer_cancel(RingBuffer *buffer);
 void ring_buffer_free(RingBuffer *buffer);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,113 @@
+#pragma once
+/*
+# RingBuffer ライブラリの C++ ラッパー
+
+LICENSE: Apache-2.0 (https://www.apache.org/licenses/LICENSE-2.0)
+AUTHOR: Yuichiro Masui http://github.com/masuidrive
+
+ring_buffer.h の関数を C++ から使うためのヘッダだけのラッパーです。
+
+- UniqueRingBuffer: 初期化済みの RingBuffer を所有し、破棄するときに ring_buffer_free を呼びます。
+  std::span でバイト列を読み書きできます。
+- TypedRingBuffer<T>: トリビアルにコピーできる T を、要素単位で読み書きします。
+  ring_buffer_write_elements / ring_buffer_read_elements を使うので、要素が途中で切れることはなく、
+  範囲をまとめて読み書きするときもロックは1回だけです。
+
+戻り値は C の関数と同じです。
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+#include "ring_buffer.h"
+
+namespace masuidrive {
+
+// 初期化済みの RingBuffer を所有するクラス
+// RingBuffer 構造体とメモリバッファの領域は呼び出し側が確保し、このクラスより長く生かしておく
+class UniqueRingBuffer {
+public:
+  UniqueRingBuffer() = default;
+  explicit UniqueRingBuffer(RingBuffer *buffer) : buffer_(buffer) {}
+  ~UniqueRingBuffer() { reset(); }
+
+  UniqueRingBuffer(const UniqueRingBuffer &) = delete;
+  UniqueRingBuffer &operator=(const UniqueRingBuffer &) = delete;
+  UniqueRingBuffer(UniqueRingBuffer &&other) noexcept : buffer_(other.release()) {}
+  UniqueRingBuffer &operator=(UniqueRingBuffer &&other) noexcept {
+    if (this != &other) {
+      reset(other.release());
+    }
+    return *this;
+  }
+
+  RingBuffer *get() const { return buffer_; }
+  explicit operator bool() const { return buffer_ != nullptr; }
+
+  // 所有をやめて、RingBuffer を返す (ring_buffer_free は呼ばない)
+  RingBuffer *release() { return std::exchange(buffer_, nullptr); }
+
+  // 所有している RingBuffer を解放し、buffer を所有し直す
+  void reset(RingBuffer *buffer = nullptr) {
+    RingBuffer *old = std::exchange(buffer_, buffer);
+    if (old != nullptr) {
+      ring_buffer_free(old);
+    }
+  }
+
+  int write(std::span<const uint8_t> data) { return ring_buffer_write(buffer_, data.data(), data.size()); }
+  int write(std::span<const uint8_t> data, TickType_t xTicksToWait) {
+    return ring_buffer_write_timeout(buffer_, data.data(), data.size(), xTicksToWait);
+  }
+  int read(std::span<uint8_t> data, TickType_t xTicksToWait) {
+    return ring_buffer_read(buffer_, data.data(), data.size(), xTicksToWait);
+  }
+
+  size_t occupied_size() const { return ring_buffer_occupied_size(buffer_); }
+  void finish_write() { ring_buffer_finish_write(buffer_); }
+  void cancel() { ring_buffer_cancel(buffer_); }
+
+private:
+  RingBuffer *buffer_ = nullptr;
+};
+
+// T を要素単位で読み書きするクラス
+// RingBuffer は所有しないので、解放は UniqueRingBuffer などで行う
+template <typename T> class TypedRingBuffer {
+  static_assert(std::is_trivially_copyable_v<T>, "TypedRingBuffer requires a trivially copyable type");
+
+public:
+  explicit TypedRingBuffer(RingBuffer *buffer) : buffer_(buffer) {}
+  explicit TypedRingBuffer(const UniqueRingBuffer &buffer) : buffer_(buffer.get()) {}
+
+  RingBuffer *get() const { return buffer_; }
+
+  // 要素をひとつ書き込み、書き込めたかを返す
+  bool push(const T &value) { return ring_buffer_write_elements(buffer_, &value, sizeof(T), 1) == 1; }
+
+  // 1回のロックで入るだけの要素を書き込み、書き込んだ個数を返す
+  int push(std::span<const T> values) {
+    return ring_buffer_write_elements(buffer_, values.data(), sizeof(T), values.size());
+  }
+
+  // 要素をひとつ読み込み、読み込めた場合は 1 を返す
+  int pop(T &value, TickType_t xTicksToWait) {
+    return ring_buffer_read_elements(buffer_, &value, sizeof(T), 1, xTicksToWait);
+  }
+
+  // 1回のロックで揃っている要素を最大 values.size() 個読み込み、読み込んだ個数を返す
+  int pop(std::span<T> values, TickType_t xTicksToWait) {
+    return ring_buffer_read_elements(buffer_, values.data(), sizeof(T), values.size(), xTicksToWait);
+  }
+
+  // 揃っている要素の個数
+  size_t size() const { return ring_buffer_occupied_size(buffer_) / sizeof(T); }
+
+private:
+  RingBuffer *buffer_;
+};
+
+} // namespace masuidrive
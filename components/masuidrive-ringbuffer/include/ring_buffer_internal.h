@@ -1,11 +1,315 @@
 #pragma once
 
 #include "ring_buffer.h"
+#include "sdkconfig.h"
+#include <string.h>
+
+// Linux ターゲットでは、ファイルバッファをメモリマップして読み書きする
+#ifndef RING_BUFFER_USE_MMAP
+#if CONFIG_IDF_TARGET_LINUX
+#define RING_BUFFER_USE_MMAP 1
+#else
+#define RING_BUFFER_USE_MMAP 0
+#endif
+#endif
+
+#define RING_BUFFER_FILE_POS_UNKNOWN ((size_t)-1)
+#define RING_BUFFER_FILE_OP_NONE 0
+#define RING_BUFFER_FILE_OP_READ 1
+#define RING_BUFFER_FILE_OP_WRITE 2
+
+// ファイルの事前確保でゼロ埋めに使うページのサイズ
+#ifndef RING_BUFFER_ZERO_PAGE_SIZE
+#define RING_BUFFER_ZERO_PAGE_SIZE 4096
+#endif
+
+// 隣り合う階層の間でデータを移すときに使う一時バッファのサイズ
+#ifndef RING_BUFFER_TIER_COPY_CHUNK
+#define RING_BUFFER_TIER_COPY_CHUNK 256
+#endif
+
+// 永続モードのファイルヘッダ
+// ファイルの先頭に RING_BUFFER_HEADER_SLOT_SIZE バイトのスロットを2つ置き、交互に書き込む
+#define RING_BUFFER_HEADER_MAGIC 0x52425546 // "RBUF"
+#define RING_BUFFER_HEADER_SLOT_SIZE 32
+#define RING_BUFFER_HEADER_SIZE (RING_BUFFER_HEADER_SLOT_SIZE * 2)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t sequence; // 書き込むたびに増える。新しい方のスロットを選ぶのに使う
+  uint32_t data_size;
+  uint32_t head;
+  uint32_t len;
+  uint32_t skip;    // 圧縮モードで、先頭のフレームのうち読み終えたバイト数
+  uint32_t raw_len; // 圧縮モードで、展開後のバイト数 (file_len)。起動時にフレームをたどらずに復元する
+  uint32_t crc;     // ここまでの CRC32
+} RingBufferFileHeader;
+_Static_assert(sizeof(RingBufferFileHeader) <= RING_BUFFER_HEADER_SLOT_SIZE, "file header must fit in a slot");
+
+// 圧縮モードのフレームのヘッダのバイト数 (元のサイズと格納サイズ、各 16 ビット)
+#define RING_BUFFER_COMPRESS_FRAME_HEADER 4
+
+// RingBuffer.events のビット
+#define RING_BUFFER_EVENT_DATA (1 << 0)     // データが書き込まれた
+#define RING_BUFFER_EVENT_SPACE (1 << 1)    // データが読み出されて空きができた
+#define RING_BUFFER_EVENT_FINISHED (1 << 2) // 書き込みが終了した
+#define RING_BUFFER_EVENT_CANCELED (1 << 3) // キャンセルされた
+#define RING_BUFFER_EVENT_FLUSHED (1 << 4)  // ステージングが空になった
+#define RING_BUFFER_EVENT_THRESHOLD (1 << 5) // 読み込みのしきい値に届いた (タスク通知を使わない場合)
+#define RING_BUFFER_EVENT_READABLE (RING_BUFFER_EVENT_DATA | RING_BUFFER_EVENT_FINISHED | RING_BUFFER_EVENT_CANCELED)
+#define RING_BUFFER_EVENT_WRITABLE (RING_BUFFER_EVENT_SPACE | RING_BUFFER_EVENT_FINISHED | RING_BUFFER_EVENT_CANCELED)
+
+// RingBufferCombiningSlot.state
+#define RING_BUFFER_SLOT_FREE 0    // 空いている
+#define RING_BUFFER_SLOT_CLAIMED 1 // 書き込み側が確保した
+#define RING_BUFFER_SLOT_PENDING 2 // 書き込みが公開され、反映を待っている
+#define RING_BUFFER_SLOT_DONE 3    // 反映され、結果が result に入っている
+
+// 実行時の統計の計測
+// RING_BUFFER_STATS が 0 の場合はすべて空に展開され、計測のコストはかからない
+#if RING_BUFFER_STATS
+#include "esp_timer.h"
+
+// 統計の値を、他の統計との順序を問わずに加算する (SPSC モードではロックなしで呼ばれる)
+#define RING_BUFFER_STAT_ADD(buffer, field, n) __atomic_fetch_add(&(buffer)->stats.field, (n), __ATOMIC_RELAXED)
+#define RING_BUFFER_STAT_MAX(buffer, field, value) _ring_buffer_stat_max(&(buffer)->stats.field, (value))
+#define RING_BUFFER_STAT_START(start) int64_t start = esp_timer_get_time()
+#define RING_BUFFER_STAT_LATENCY(buffer, histogram, start)                                                             \
+  _ring_buffer_stat_latency((buffer)->stats.histogram, esp_timer_get_time() - (start))
+#define RING_BUFFER_STAT_RESULT(buffer, result) _ring_buffer_stat_result((buffer), (result))
+
+// 最大値を更新する
+static inline void _ring_buffer_stat_max(size_t *field, size_t value) {
+  size_t current = __atomic_load_n(field, __ATOMIC_RELAXED);
+  while (value > current &&
+         !__atomic_compare_exchange_n(field, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// 経過時間 (マイクロ秒) をヒストグラムの log2 の区間に数える
+static inline void _ring_buffer_stat_latency(uint32_t histogram[RING_BUFFER_LATENCY_BUCKETS], int64_t elapsed) {
+  int bucket = elapsed > 0 ? 64 - __builtin_clzll((uint64_t)elapsed) : 0;
+  if (bucket >= RING_BUFFER_LATENCY_BUCKETS) {
+    bucket = RING_BUFFER_LATENCY_BUCKETS - 1;
+  }
+  __atomic_fetch_add(&histogram[bucket], 1, __ATOMIC_RELAXED);
+}
+
+// 読み書きの関数の戻り値から、オーバーフローとキャンセルを数える
+static inline void _ring_buffer_stat_result(RingBuffer *buffer, int result) {
+  if (result == RING_BUFFER_OVERFLOW) {
+    RING_BUFFER_STAT_ADD(buffer, overflow_count, 1);
+  } else if (result == RING_BUFFER_CANCELED) {
+    RING_BUFFER_STAT_ADD(buffer, canceled_count, 1);
+  }
+}
+#else
+#define RING_BUFFER_STAT_ADD(buffer, field, n) ((void)0)
+#define RING_BUFFER_STAT_MAX(buffer, field, value) ((void)0)
+#define RING_BUFFER_STAT_START(start) ((void)0)
+#define RING_BUFFER_STAT_LATENCY(buffer, histogram, start) ((void)0)
+#define RING_BUFFER_STAT_RESULT(buffer, result) ((void)0)
+#endif
+
+// ミューテックスの取得
+// 解放は _ring_buffer_unlock で行う
+// 統計を集める場合は、待たずに取れなかったときだけ待ち時間を計る
+static inline void _ring_buffer_lock(RingBuffer *buffer) {
+#if RING_BUFFER_STATS
+  RING_BUFFER_STAT_ADD(buffer, lock_count, 1);
+  if (xSemaphoreTake(buffer->mutex, 0) == pdTRUE) {
+    return;
+  }
+  int64_t start = esp_timer_get_time();
+  xSemaphoreTake(buffer->mutex, portMAX_DELAY);
+  uint32_t waited = (uint32_t)(esp_timer_get_time() - start);
+  // ロックを保持しているので、待ち時間は通常の加算で更新できる
+  buffer->stats.lock_wait_us += waited;
+  if (waited > buffer->stats.lock_wait_max_us) {
+    buffer->stats.lock_wait_max_us = waited;
+  }
+#else
+  xSemaphoreTake(buffer->mutex, portMAX_DELAY);
+#endif
+}
+
+// 待たずにミューテックスの取得を試みる
+// 取れた場合は _ring_buffer_lock と同じく取得回数に数える (待っていないので待ち時間は加えない)
+static inline bool _ring_buffer_try_lock(RingBuffer *buffer) {
+  if (xSemaphoreTake(buffer->mutex, 0) != pdTRUE) {
+    return false;
+  }
+  RING_BUFFER_STAT_ADD(buffer, lock_count, 1);
+  return true;
+}
+
+void _ring_buffer_combining_unlock(RingBuffer *buffer);
+
+// ミューテックスの解放
+// 書き込みの集約が有効な場合だけ、解放する前にスロットに公開されている書き込みを反映する
+// 無効な場合 (既定) は、どの経路でもセマフォを返すだけにする
+static inline void _ring_buffer_unlock(RingBuffer *buffer) {
+  if (buffer->combining) {
+    _ring_buffer_combining_unlock(buffer);
+    return;
+  }
+  xSemaphoreGive(buffer->mutex);
+}
+
+// 折り返し位置を計算する (pos は 2 * size 未満であること)
+// mask が 0 でなければ size は2のべき乗で、マスク演算で折り返す
+static inline size_t _ring_buffer_wrap(size_t pos, size_t size, size_t mask) {
+  if (mask) {
+    return pos & mask;
+  }
+  return pos >= size ? pos - size : pos;
+}
+
+// size が2のべき乗ならマスク値を、そうでなければ 0 を返す
+static inline size_t _ring_buffer_mask_for(size_t size) {
+  return (size != 0 && (size & (size - 1)) == 0) ? size - 1 : 0;
+}
+
+// リング上の pos から連続領域にコピーする (折り返し時は最大2回の memcpy)
+static inline void _ring_buffer_copy_in(uint8_t *ring, size_t ring_size, size_t pos, const uint8_t *data,
+                                        size_t size) {
+  size_t first = ring_size - pos;
+  if (first > size) {
+    first = size;
+  }
+  memcpy(ring + pos, data, first);
+  memcpy(ring, data + first, size - first);
+}
+
+// リング上の pos から連続領域へ取り出す (折り返し時は最大2回の memcpy)
+static inline void _ring_buffer_copy_out(const uint8_t *ring, size_t ring_size, size_t pos, uint8_t *data,
+                                         size_t size) {
+  size_t first = ring_size - pos;
+  if (first > size) {
+    first = size;
+  }
+  memcpy(data, ring + pos, first);
+  memcpy(data + first, ring, size - first);
+}
+
+// リング上の pos から size バイトの領域を、折り返し位置で分けた最大2つの連続領域として返す
+static inline size_t _ring_buffer_spans(uint8_t *ring, size_t ring_size, size_t pos, size_t size,
+                                        RingBufferSpan spans[2]) {
+  size_t first = ring_size - pos;
+  if (first > size) {
+    first = size;
+  }
+  spans[0].data = ring + pos;
+  spans[0].size = first;
+  spans[1].data = ring;
+  spans[1].size = size - first;
+  return size;
+}
+
+// SPSC モードで、読み込み側がロックを取らずにメモリを読めるかを返す
+// DROP_OLDEST では書き込み側がロックを取って memory_head を進めるので、読み込み側もロックを取る
+static inline bool _ring_buffer_spsc_reader(RingBuffer *buffer) {
+  return buffer->spsc && buffer->overflow_policy != RING_BUFFER_OVERFLOW_DROP_OLDEST;
+}
+
+// メモリより後ろ (途中の階層、ファイル、ステージング) に積まれているバイト数
+// データは前の階層を確定してから後ろの階層を減らして移すため、ステージング、ファイル、途中の階層の順に読む
+static inline size_t _ring_buffer_spilled(RingBuffer *buffer) {
+  size_t staging_len = __atomic_load_n(&buffer->staging_len, __ATOMIC_ACQUIRE);
+  size_t file_len = __atomic_load_n(&buffer->file_len, __ATOMIC_ACQUIRE);
+  return staging_len + file_len + __atomic_load_n(&buffer->tier_len, __ATOMIC_ACQUIRE);
+}
+
+// メモリとステージングの間の階層 (ファイルを含む) に積まれているバイト数
+static inline size_t _ring_buffer_tiered(RingBuffer *buffer) {
+  size_t file_len = __atomic_load_n(&buffer->file_len, __ATOMIC_ACQUIRE);
+  return file_len + __atomic_load_n(&buffer->tier_len, __ATOMIC_ACQUIRE);
+}
+
+// ファイルの階層があるかを返す (1つのファイル、またはセグメントファイル)
+static inline bool _ring_buffer_has_file(RingBuffer *buffer) {
+  return buffer->file != NULL || buffer->segment_size > 0;
+}
+
+// ロックを保持した状態で、積んであるデータのバイト数を返す
+static inline size_t _ring_buffer_stored(RingBuffer *buffer) {
+  return __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE) + buffer->tier_len + buffer->file_len +
+         buffer->staging_len;
+}
 
 int _ring_buffer_mem_write(RingBuffer *buffer, const uint8_t *data, size_t size);
+size_t _ring_buffer_mem_free_spans(RingBuffer *buffer, size_t size, RingBufferSpan spans[2]);
+void _ring_buffer_mem_commit(RingBuffer *buffer, size_t size);
 int _ring_buffer_mem_read(RingBuffer *buffer, uint8_t *data, size_t size);
+size_t _ring_buffer_mem_peek(RingBuffer *buffer, size_t offset, uint8_t *data, size_t size);
+size_t _ring_buffer_mem_data_spans(RingBuffer *buffer, size_t size, RingBufferSpan spans[2]);
+void _ring_buffer_mem_consume(RingBuffer *buffer, size_t size);
 size_t _ring_buffer_mem_usage(RingBuffer *buffer);
 int _ring_buffer_file_write(RingBuffer *buffer, const uint8_t *data, size_t size);
 int _ring_buffer_file_read(RingBuffer *buffer, uint8_t *data, size_t size);
+size_t _ring_buffer_file_write_at(RingBuffer *buffer, size_t pos, const uint8_t *data, size_t size);
+void _ring_buffer_file_commit(RingBuffer *buffer, size_t size);
+size_t _ring_buffer_file_peek(RingBuffer *buffer, size_t offset, uint8_t *data, size_t size);
+void _ring_buffer_file_consume(RingBuffer *buffer, size_t size);
 size_t _ring_buffer_file_usage(RingBuffer *buffer);
-void _ring_buffer_create_file(FILE *file, size_t file_size);
\ No newline at end of file
+size_t _ring_buffer_file_space(RingBuffer *buffer);
+size_t _ring_buffer_file_read_at(RingBuffer *buffer, size_t pos, uint8_t *data, size_t size);
+int _ring_buffer_file_sync(RingBuffer *buffer);
+void _ring_buffer_file_map(RingBuffer *buffer);
+void _ring_buffer_file_recover(RingBuffer *buffer);
+int _ring_buffer_file_checkpoint(RingBuffer *buffer);
+void _ring_buffer_file_unmap(RingBuffer *buffer);
+void _ring_buffer_file_preallocate(RingBuffer *buffer, RingBufferPreallocate mode);
+bool _ring_buffer_file_extend(FILE *file, size_t current_size, size_t size, RingBufferPreallocate mode);
+size_t _ring_buffer_file_capacity(RingBuffer *buffer);
+void _ring_buffer_file_lock(RingBuffer *buffer);
+void _ring_buffer_file_unlock(RingBuffer *buffer);
+void _ring_buffer_segment_init(RingBuffer *buffer, const char *file_name, size_t file_size,
+                               const RingBufferConfig *config);
+size_t _ring_buffer_segment_pwrite(RingBuffer *buffer, size_t pos, const uint8_t *data, size_t size);
+size_t _ring_buffer_segment_pread(RingBuffer *buffer, size_t pos, uint8_t *data, size_t size);
+void _ring_buffer_segment_release(RingBuffer *buffer, size_t head, size_t size);
+size_t _ring_buffer_segment_space(RingBuffer *buffer);
+bool _ring_buffer_segment_flush(RingBuffer *buffer, bool sync);
+void _ring_buffer_segment_close(RingBuffer *buffer);
+extern const RingBufferTierOps _ring_buffer_file_tier_ops;
+void _ring_buffer_tiers_init(RingBuffer *buffer, const RingBufferConfig *config);
+size_t _ring_buffer_tier_usage(RingBuffer *buffer, size_t i);
+size_t _ring_buffer_tier_peek(RingBuffer *buffer, size_t i, size_t offset, uint8_t *data, size_t size);
+void _ring_buffer_tier_consume(RingBuffer *buffer, size_t i, size_t size);
+size_t _ring_buffer_tiers_write(RingBuffer *buffer, const uint8_t *data, size_t size);
+size_t _ring_buffer_tiers_space(RingBuffer *buffer);
+size_t _ring_buffer_tiers_stranded(RingBuffer *buffer);
+size_t _ring_buffer_tiers_capacity(RingBuffer *buffer);
+void _ring_buffer_tiers_cascade(RingBuffer *buffer, size_t size);
+void _ring_buffer_compress_init(RingBuffer *buffer, void *work);
+size_t _ring_buffer_compress_space(RingBuffer *buffer);
+size_t _ring_buffer_compress_write(RingBuffer *buffer, const uint8_t *data, size_t size);
+size_t _ring_buffer_compress_peek(RingBuffer *buffer, size_t offset, uint8_t *data, size_t size);
+void _ring_buffer_compress_consume(RingBuffer *buffer, size_t size);
+bool _ring_buffer_compress_seal(RingBuffer *buffer);
+size_t _ring_buffer_staging_write(RingBuffer *buffer, const uint8_t *data, size_t size);
+size_t _ring_buffer_staging_read(RingBuffer *buffer, uint8_t *data, size_t size);
+size_t _ring_buffer_staging_peek(RingBuffer *buffer, size_t offset, uint8_t *data, size_t size);
+void _ring_buffer_staging_consume(RingBuffer *buffer, size_t size);
+size_t _ring_buffer_staging_promote(RingBuffer *buffer, size_t size);
+size_t _ring_buffer_staging_space(RingBuffer *buffer);
+void _ring_buffer_stop_spill_task(RingBuffer *buffer);
+
+bool _ring_buffer_write_combined(RingBuffer *buffer, const uint8_t *data, size_t size, int *result);
+void _ring_buffer_free_combining(RingBuffer *buffer);
+size_t _ring_buffer_write_locked(RingBuffer *buffer, const uint8_t *data, size_t size);
+size_t _ring_buffer_free_space(RingBuffer *buffer);
+size_t _ring_buffer_writable_space(RingBuffer *buffer);
+void _ring_buffer_readers_make_room(RingBuffer *buffer, size_t size);
+void _ring_buffer_readers_drop(RingBuffer *buffer, size_t size);
+int _ring_buffer_write_whole(RingBuffer *buffer, const uint8_t *data, size_t size, TickType_t xTicksToWait,
+                             RingBufferWriteReport *report);
+int _ring_buffer_write_drop_oldest(RingBuffer *buffer, const uint8_t *data, size_t size, RingBufferWriteReport *report);
+size_t _ring_buffer_peek(RingBuffer *buffer, size_t offset, uint8_t *data, size_t size);
+void _ring_buffer_discard(RingBuffer *buffer, size_t size);
+size_t _ring_buffer_promote(RingBuffer *buffer, size_t size);
+void _ring_buffer_refill(RingBuffer *buffer);
+void _ring_buffer_notify_readers(RingBuffer *buffer);
+void _ring_buffer_notify_writers(RingBuffer *buffer);
+void _ring_buffer_notify_threshold(RingBuffer *buffer, bool force);
@@ -6,114 +6,813 @@
 // 初期化関数
 void ring_buffer_init(RingBuffer *buffer, uint8_t *memory, size_t memory_size, const char *file_name,
                       size_t file_size) {
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  ring_buffer_init_with_config(buffer, memory, memory_size, file_name, file_size, &config);
+}
+
+// 初期化の本体
+// storage を渡した場合は、ミューテックスとイベントグループもヒープを使わずに storage の中に作る
+static void _ring_buffer_init(RingBuffer *buffer, uint8_t *memory, size_t memory_size, const char *file_name,
+                              size_t file_size, const RingBufferConfig *config, RingBufferStatic *storage) {
   buffer->memory_buffer = memory;
   buffer->memory_size = memory_size;
+  buffer->memory_mask = _ring_buffer_mask_for(memory_size);
   buffer->memory_head = 0;
+  buffer->memory_tail = 0;
   buffer->memory_len = 0;
-  buffer->file = fopen(file_name, "w+b");
-  buffer->file_size = file_size;
+  buffer->write_reserved = 0;
+  // セグメントに分ける場合は、1つのファイルは開かずにセグメントごとのファイルを使う
+  _ring_buffer_segment_init(buffer, file_name, file_size, config);
+  // 永続モードでは既存のファイルを切り詰めずに開く
+  buffer->persistent = config->persistent && buffer->segment_size == 0;
+  buffer->file = buffer->persistent ? fopen(file_name, "r+b") : NULL;
+  if (buffer->file == NULL && buffer->segment_size == 0) {
+    buffer->file = fopen(file_name, "w+b");
+  }
+  buffer->file_size = buffer->segment_size > 0 ? buffer->segment_count * buffer->segment_size : file_size;
   buffer->file_head = 0;
   buffer->file_len = 0;
+  buffer->file_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+  buffer->file_last_op = RING_BUFFER_FILE_OP_NONE;
+  buffer->sector_buffer = config->sector_size > 0 ? config->sector_buffer : NULL;
+  buffer->sector_size = config->sector_size > 0 ? config->sector_size : RING_BUFFER_SECTOR_SIZE;
+  buffer->sector_pos = 0;
+  buffer->sector_fill = 0;
+  buffer->sector_dirty = false;
+  buffer->write_stats = (RingBufferWriteStats){0};
+#if RING_BUFFER_STATS
+  buffer->stats = (RingBufferStats){0};
+#endif
+  // セクタ単位で書き込む場合は、ヘッダの書き込みがデータのセクタに触れないようにセクタ1つを空ける
+  buffer->file_offset = !buffer->persistent ? 0 : buffer->sector_buffer != NULL ? buffer->sector_size
+                                                                                : RING_BUFFER_HEADER_SIZE;
+  buffer->checkpoint_interval = config->checkpoint_interval;
+  buffer->checkpoint_pending = 0;
+  buffer->header_sequence = 0;
+  buffer->header_slot = 1;
+  _ring_buffer_compress_init(buffer, buffer->file != NULL ? config->compress_work : NULL);
+  _ring_buffer_file_preallocate(buffer, config->preallocate);
+  _ring_buffer_file_map(buffer);
+  if (buffer->persistent && buffer->file != NULL) {
+    _ring_buffer_file_recover(buffer);
+  }
+  _ring_buffer_tiers_init(buffer, config);
+  buffer->staging_buffer = NULL;
+  buffer->staging_size = 0;
+  buffer->staging_head = 0;
+  buffer->staging_len = 0;
+  buffer->staging_inflight = 0;
+  buffer->staging_inflight_consumed = 0;
+  buffer->spill_task = NULL;
+  buffer->spill_done = NULL;
+  buffer->file_lock = NULL;
+  buffer->spill_stop = false;
+  buffer->promotion_low = memory_size;
+  buffer->promotion_high = memory_size;
+  buffer->promotion_task = NULL;
+  buffer->promotion_done = NULL;
+  buffer->promotion_stop = false;
+  buffer->combining = false;
+  buffer->combining_pending = 0;
+  for (int i = 0; i < RING_BUFFER_COMBINING_SLOTS; i++) {
+    buffer->combining_slots[i].state = RING_BUFFER_SLOT_FREE;
+    buffer->combining_slots[i].done = NULL;
+  }
+  for (int i = 0; i < RING_BUFFER_READERS_MAX; i++) {
+    buffer->readers[i].attached = false;
+  }
+  buffer->reader_count = 0;
+  buffer->stream_head = 0;
+  buffer->overflow_policy = RING_BUFFER_OVERFLOW_PARTIAL;
+  buffer->overflow_block_ticks = 0;
+  buffer->overflow_stats = (RingBufferOverflowStats){0};
+  buffer->read_threshold = 1;
+  buffer->read_threshold_delay = portMAX_DELAY;
+  buffer->read_threshold_wake = 1;
+  buffer->read_threshold_task = NULL;
+  buffer->spsc = false;
+  buffer->read_waiters = 0;
+  buffer->write_waiters = 0;
   buffer->write_finished = false;
   buffer->cancelled = false;
-  buffer->mutex = xSemaphoreCreateMutex();
+  if (storage != NULL) {
+    buffer->mutex = xSemaphoreCreateMutexStatic(&storage->mutex);
+    buffer->events = xEventGroupCreateStatic(&storage->events);
+  } else {
+    buffer->mutex = xSemaphoreCreateMutex();
+    buffer->events = xEventGroupCreate();
+  }
+}
+
+// 設定を指定する初期化関数
+void ring_buffer_init_with_config(RingBuffer *buffer, uint8_t *memory, size_t memory_size, const char *file_name,
+                                  size_t file_size, const RingBufferConfig *config) {
+  _ring_buffer_init(buffer, memory, memory_size, file_name, file_size, config, NULL);
+}
+
+// RING_BUFFER_DEFINE で静的に確保した領域を使う初期化関数
+void ring_buffer_init_static(RingBuffer *buffer, RingBufferStatic *storage, const char *file_name,
+                             const RingBufferConfig *config) {
+  // レイアウトのマクロが翻訳単位ごとに違うと、定義した側と RingBuffer の大きさが合わない
+  configASSERT(storage->buffer_size == sizeof(RingBuffer));
+  RingBufferConfig default_config = RING_BUFFER_CONFIG_DEFAULT;
+  _ring_buffer_init(buffer, storage->memory, storage->memory_size, file_name, storage->file_size,
+                    config != NULL ? config : &default_config, storage);
 }
 
 // バッファに積んであるデータサイズを取得する関数
 size_t ring_buffer_occupied_size(RingBuffer *buffer) {
-  xSemaphoreTake(buffer->mutex, portMAX_DELAY);
-  size_t occupied_size = buffer->memory_len + buffer->file_len;
-  xSemaphoreGive(buffer->mutex);
+  _ring_buffer_lock(buffer);
+  size_t occupied_size = _ring_buffer_stored(buffer);
+  _ring_buffer_unlock(buffer);
   return occupied_size;
 }
 
-// データの書き込み関数
-int ring_buffer_write(RingBuffer *buffer, const uint8_t *data, size_t size) {
-  xSemaphoreTake(buffer->mutex, portMAX_DELAY);
+// 実行時の統計を取得する関数
+// 統計を集めない構成では false を返す
+bool ring_buffer_get_stats(RingBuffer *buffer, RingBufferStats *stats) {
+#if RING_BUFFER_STATS
+  _ring_buffer_lock(buffer);
+  *stats = buffer->stats;
+  _ring_buffer_unlock(buffer);
+  return true;
+#else
+  (void)buffer;
+  *stats = (RingBufferStats){0};
+  return false;
+#endif
+}
+
+// 実行時の統計をリセットする関数
+// 最大値は現在の使用量から数え直す
+void ring_buffer_reset_stats(RingBuffer *buffer) {
+#if RING_BUFFER_STATS
+  _ring_buffer_lock(buffer);
+  buffer->stats = (RingBufferStats){0};
+  buffer->stats.memory_high_water = buffer->memory_len;
+  buffer->stats.file_high_water = buffer->file_len;
+  _ring_buffer_unlock(buffer);
+#else
+  (void)buffer;
+#endif
+}
+
+// ロックを保持した状態で、先頭から offset バイト目以降を消費せずに読み込む関数
+// メモリ、途中の階層、ファイル、ステージングの順にまたいで読み込み、読み込めたバイト数を返す
+size_t _ring_buffer_peek(RingBuffer *buffer, size_t offset, uint8_t *data, size_t size) {
+  size_t memory_len = __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE);
+  size_t copied = 0;
+  if (offset < memory_len) {
+    copied = _ring_buffer_mem_peek(buffer, offset, data, size);
+    offset = 0;
+  } else {
+    offset -= memory_len;
+  }
+
+  for (size_t i = 0; i < buffer->tier_count && copied < size; i++) {
+    size_t len = _ring_buffer_tier_usage(buffer, i);
+    if (offset >= len) {
+      offset -= len;
+      continue;
+    }
+    size_t count = _ring_buffer_tier_peek(buffer, i, offset, data + copied, size - copied);
+    copied += count;
+    if (copied < size && offset + count < len) {
+      return copied; // 読み込みエラー
+    }
+    offset = 0;
+  }
+
+  if (copied < size) {
+    copied += _ring_buffer_staging_peek(buffer, offset, data + copied, size - copied);
+  }
+  return copied;
+}
+
+// ロックを保持した状態で、先頭から size バイトを読み込まずに捨てる関数
+void _ring_buffer_discard(RingBuffer *buffer, size_t size) {
+  size_t memory_len = __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE);
+  size_t count = size < memory_len ? size : memory_len;
+  _ring_buffer_mem_consume(buffer, count);
+  size -= count;
+
+  for (size_t i = 0; i < buffer->tier_count; i++) {
+    size_t len = _ring_buffer_tier_usage(buffer, i);
+    count = size < len ? size : len;
+    _ring_buffer_tier_consume(buffer, i, count);
+    size -= count;
+  }
+
+  count = size < buffer->staging_len ? size : buffer->staging_len;
+  _ring_buffer_staging_consume(buffer, count);
+}
 
+// 途中の階層とファイルからメモリへ最大 size バイトを移動する関数
+// メモリの空き領域へ直接読み込むため、一時バッファを使わず階層ごとに最大2回の読み込みで済む
+// SPSC モードの書き込み側はメモリより後ろが空になるとメモリへ直接書き込むため、
+// メモリ側を確定してから階層側を消費する
+// 階層をすべて空にした後は、続けてステージングから移動する
+// 途中の階層がある場合は、隣り合う階層の間でもまとめて繰り上げる
+size_t _ring_buffer_promote(RingBuffer *buffer, size_t size) {
   if (buffer->cancelled) {
-    xSemaphoreGive(buffer->mutex);
-    return RING_BUFFER_CANCELED;
+    return 0;
   }
 
-  if (buffer->write_finished) {
-    xSemaphoreGive(buffer->mutex);
-    return RING_BUFFER_FINISHED;
+  size_t moved = 0;
+  for (size_t i = 0; i < buffer->tier_count && moved < size; i++) {
+    size_t len = _ring_buffer_tier_usage(buffer, i);
+    if (len == 0) {
+      continue;
+    }
+    RingBufferSpan spans[2];
+    size_t count = _ring_buffer_mem_free_spans(buffer, size - moved < len ? size - moved : len, spans);
+    size_t promoted = 0;
+    if (count > 0) {
+      promoted = _ring_buffer_tier_peek(buffer, i, 0, spans[0].data, spans[0].size);
+      if (promoted == spans[0].size && spans[1].size > 0) {
+        promoted += _ring_buffer_tier_peek(buffer, i, promoted, spans[1].data, spans[1].size);
+      }
+      _ring_buffer_mem_commit(buffer, promoted);
+      _ring_buffer_tier_consume(buffer, i, promoted);
+      moved += promoted;
+    }
+    if (promoted < len) {
+      break; // メモリがいっぱい、または読み込みエラー
+    }
   }
+  if (moved < size) {
+    moved += _ring_buffer_staging_promote(buffer, size - moved);
+  }
+  if (buffer->tier_count > 1) {
+    _ring_buffer_tiers_cascade(buffer, size);
+  }
+  if (moved > 0) {
+    RING_BUFFER_STAT_ADD(buffer, promotion_count, 1);
+  }
+  return moved;
+}
 
-  int result = _ring_buffer_mem_write(buffer, data, size);
-  if (result == RING_BUFFER_OK) {
-    xSemaphoreGive(buffer->mutex);
-    return RING_BUFFER_OK;
+// メモリが低水位を下回っていれば、高水位までファイルとステージングから補充する
+// 補充タスクが動いている場合はタスクに通知するだけで、呼び出し元ではファイルを読まない
+void _ring_buffer_refill(RingBuffer *buffer) {
+  if (_ring_buffer_spilled(buffer) == 0 || buffer->memory_len >= buffer->promotion_low) {
+    return;
   }
+  if (buffer->promotion_task != NULL) {
+    xTaskNotifyGive(buffer->promotion_task);
+    return;
+  }
+  _ring_buffer_promote(buffer, buffer->promotion_high - buffer->memory_len);
+}
 
-  // メモリオーバーフロー時、ファイルに書き込む
-  result = _ring_buffer_file_write(buffer, data + result, size - result);
+// ロックを保持した状態で書き込み、書き込めたバイト数を返す
+size_t _ring_buffer_write_locked(RingBuffer *buffer, const uint8_t *data, size_t size) {
+  // 読み込みカーソルがある場合は、遅れているカーソルの方針に従って空きを作る
+  if (buffer->reader_count > 0) {
+    _ring_buffer_readers_make_room(buffer, size);
+  }
+
+  // ファイルやステージングにデータが残っている間は、順序を保つためにメモリへは書き込まない
+  size_t written = 0;
+  if (_ring_buffer_spilled(buffer) == 0) {
+    int result = _ring_buffer_mem_write(buffer, data, size);
+    if (result == RING_BUFFER_OK) {
+      return size;
+    }
+    written = result;
+  }
+
+  // メモリオーバーフロー時は途中の階層に書き込み、入りきらない分は
+  // 書き出しタスクがあればステージングに、なければファイルに書き込む
+  RING_BUFFER_STAT_ADD(buffer, spill_count, 1);
+  written += _ring_buffer_tiers_write(buffer, data + written, size - written);
+  if (written == size) {
+    return size;
+  }
+  if (buffer->spill_task != NULL) {
+    if (buffer->write_finished || buffer->cancelled) {
+      return written;
+    }
+    return written + _ring_buffer_staging_write(buffer, data + written, size - written);
+  }
+  int result = _ring_buffer_file_write(buffer, data + written, size - written);
   if (result == RING_BUFFER_OK) {
-    xSemaphoreGive(buffer->mutex);
+    return size;
+  }
+  return written + result;
+}
+
+// ロックを保持した状態で読み込み、読み込めたバイト数を返す
+// 補充は行わないので、呼び出し側で読み込み後に _ring_buffer_refill を呼ぶ
+static size_t _ring_buffer_read_locked(RingBuffer *buffer, uint8_t *data, size_t size) {
+  // メモリから読み込んで、足りなければ途中の階層、ファイル、ステージングの順に直接読み込む
+  size_t read_count = _ring_buffer_mem_read(buffer, data, size);
+  for (size_t i = 0; i < buffer->tier_count && read_count < size; i++) {
+    size_t len = _ring_buffer_tier_usage(buffer, i);
+    if (len == 0) {
+      continue;
+    }
+    // 読み込みエラー時は読み込めた分だけ進める
+    size_t count = _ring_buffer_tier_peek(buffer, i, 0, data + read_count, size - read_count);
+    _ring_buffer_tier_consume(buffer, i, count);
+    read_count += count;
+    if (read_count < size && count < len) {
+      return read_count;
+    }
+  }
+  if (read_count < size && buffer->staging_len > 0) {
+    read_count += _ring_buffer_staging_read(buffer, data + read_count, size - read_count);
+  }
+  return read_count;
+}
+
+// ロックを保持した状態で、ベクタ全体の offset バイト目以降へ読み込み、読み込めたバイト数を返す
+static size_t _ring_buffer_readv_locked(RingBuffer *buffer, const RingBufferVec *vec, size_t count, size_t offset) {
+  size_t read_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (offset >= vec[i].size) {
+      offset -= vec[i].size;
+      continue;
+    }
+    size_t size = vec[i].size - offset;
+    size_t n = _ring_buffer_read_locked(buffer, (uint8_t *)vec[i].data + offset, size);
+    read_count += n;
+    offset = 0;
+    if (n < size) {
+      break;
+    }
+  }
+  return read_count;
+}
+
+// ロックを保持した状態で、書き込める残りのバイト数を返す
+// 後ろの階層やステージングにデータがある間は前の階層へ書き込まないので、その空きは数えない
+size_t _ring_buffer_free_space(RingBuffer *buffer) {
+  size_t space = _ring_buffer_tiers_space(buffer) + _ring_buffer_file_space(buffer) - buffer->staging_len;
+  if (_ring_buffer_spilled(buffer) == 0) {
+    space += buffer->memory_size - buffer->memory_len;
+  }
+  return space;
+}
+
+// ロックを保持した状態で、待たずに書き込める残りのバイト数を返す
+// 書き出しタスクがある場合、ファイルの空きのうちステージングに入る分だけを数える
+size_t _ring_buffer_writable_space(RingBuffer *buffer) {
+  if (buffer->spill_task == NULL) {
+    return _ring_buffer_free_space(buffer);
+  }
+  size_t space = _ring_buffer_tiers_space(buffer) + _ring_buffer_staging_space(buffer);
+  if (_ring_buffer_spilled(buffer) == 0) {
+    space += buffer->memory_size - buffer->memory_len;
+  }
+  return space;
+}
+
+// ベクタの合計サイズを返す
+static size_t _ring_buffer_vec_size(const RingBufferVec *vec, size_t count) {
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++) {
+    size += vec[i].size;
+  }
+  return size;
+}
+
+// 待機中の読み込み側がいればデータの到着を通知する
+// 待機側は waiters を増やしてからイベントをクリアし、データを確認するので、取りこぼしは起きない
+void _ring_buffer_notify_readers(RingBuffer *buffer) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&buffer->read_waiters, __ATOMIC_RELAXED) > 0) {
+    xEventGroupSetBits(buffer->events, RING_BUFFER_EVENT_DATA);
+  }
+  if (__atomic_load_n(&buffer->read_threshold_task, __ATOMIC_RELAXED) != NULL) {
+    _ring_buffer_notify_threshold(buffer, false);
+  }
+}
+
+// 待機中の書き込み側がいれば空きができたことを通知する
+void _ring_buffer_notify_writers(RingBuffer *buffer) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&buffer->write_waiters, __ATOMIC_RELAXED) > 0) {
+    xEventGroupSetBits(buffer->events, RING_BUFFER_EVENT_SPACE);
+  }
+}
+
+// SPSC モードで、ロックを取らずにメモリへ size バイト書き込めるかを返す
+// ファイルが関わる場合や、全体が入りきらない場合は false を返し、通常の経路に任せる
+static bool _ring_buffer_spsc_writable(RingBuffer *buffer, size_t size) {
+  return buffer->spsc && !__atomic_load_n(&buffer->cancelled, __ATOMIC_RELAXED) &&
+         !__atomic_load_n(&buffer->write_finished, __ATOMIC_RELAXED) &&
+         _ring_buffer_spilled(buffer) == 0 &&
+         buffer->memory_size - __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE) >= size;
+}
+
+// SPSC モードで、ロックを取らずにメモリから size バイト読み込めるかを返す
+// ファイルやステージングにデータがある場合や、メモリに size バイトない場合は false を返し、通常の経路に任せる
+static bool _ring_buffer_spsc_readable(RingBuffer *buffer, size_t size) {
+  return _ring_buffer_spsc_reader(buffer) && !__atomic_load_n(&buffer->cancelled, __ATOMIC_RELAXED) &&
+         _ring_buffer_spilled(buffer) == 0 &&
+         __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE) >= size;
+}
+
+// データの書き込み関数
+// 書き込みの集約が有効な場合はスロットに公開し、書き込みきれなかった残りだけを通常の経路で書き込む
+// RING_BUFFER_OVERFLOW_PARTIAL 以外の方針では、書き込み全体の扱いを決める必要があるので集約しない
+int ring_buffer_write(RingBuffer *buffer, const uint8_t *data, size_t size) {
+  if (buffer->overflow_policy != RING_BUFFER_OVERFLOW_PARTIAL) {
+    TickType_t ticks = buffer->overflow_policy == RING_BUFFER_OVERFLOW_BLOCK ? buffer->overflow_block_ticks : 0;
+    return ring_buffer_write_report(buffer, data, size, ticks, NULL);
+  }
+
+  int result;
+  if (buffer->combining && !_ring_buffer_spsc_writable(buffer, size)) {
+    RING_BUFFER_STAT_START(start);
+    if (_ring_buffer_write_combined(buffer, data, size, &result)) {
+      if (result > 0) {
+        __atomic_fetch_add(&buffer->overflow_stats.accepted, result, __ATOMIC_RELAXED);
+      }
+      if (result < 0 || (size_t)result == size) {
+        RING_BUFFER_STAT_LATENCY(buffer, write_latency, start);
+        RING_BUFFER_STAT_RESULT(buffer, result);
+        return result < 0 ? result : RING_BUFFER_OK;
+      }
+      data += result;
+      size -= result;
+    }
+  }
+  return ring_buffer_write_timeout(buffer, data, size, 0);
+}
+
+// 空きを待つデータの書き込み関数
+int ring_buffer_write_timeout(RingBuffer *buffer, const uint8_t *data, size_t size, TickType_t xTicksToWait) {
+  return ring_buffer_write_report(buffer, data, size, xTicksToWait, NULL);
+}
+
+// 入る分だけ書き込む (RING_BUFFER_OVERFLOW_PARTIAL)
+// 時間内に全体を書き込めなければ、書き込めた分を残して RING_BUFFER_OVERFLOW を返す
+static int _ring_buffer_write_partial(RingBuffer *buffer, const uint8_t *data, size_t size, TickType_t xTicksToWait,
+                                      RingBufferWriteReport *report) {
+  // 書き出しタスクがある場合は、ステージングが空くのを待つことがある
+  bool wait = xTicksToWait != 0 || buffer->spill_task != NULL;
+  TimeOut_t timeout;
+  vTaskSetTimeOutState(&timeout);
+  _ring_buffer_lock(buffer);
+  if (wait) {
+    __atomic_add_fetch(&buffer->write_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+  int result;
+  size_t written = 0;
+  while (true) {
+    if (buffer->cancelled) {
+      result = RING_BUFFER_CANCELED;
+      break;
+    }
+
+    if (buffer->write_finished) {
+      result = RING_BUFFER_FINISHED;
+      break;
+    }
+
+    if (wait) {
+      xEventGroupClearBits(buffer->events, RING_BUFFER_EVENT_SPACE);
+    }
+    size_t count = _ring_buffer_write_locked(buffer, data + written, size - written);
+    if (count > 0) {
+      _ring_buffer_notify_readers(buffer);
+    }
+    written += count;
+    if (written == size) {
+      result = RING_BUFFER_OK;
+      break;
+    }
+
+    // ファイルに空きがあるのにステージングがいっぱいの場合は、書き出しタスクを待つ (バックプレッシャー)
+    bool spilling = _ring_buffer_free_space(buffer) > 0 && buffer->spill_task != NULL;
+    if (!spilling && xTaskCheckForTimeOut(&timeout, &xTicksToWait) == pdTRUE) {
+      result = RING_BUFFER_OVERFLOW; // 両方オーバーフロー
+      break;
+    }
+
+    // 読み込み側か書き出しタスクが空きを作るまで待つ
+    _ring_buffer_unlock(buffer);
+    xEventGroupWaitBits(buffer->events, RING_BUFFER_EVENT_WRITABLE, pdFALSE, pdFALSE,
+                        spilling ? portMAX_DELAY : xTicksToWait);
+    _ring_buffer_lock(buffer);
+  }
+
+  if (wait) {
+    __atomic_sub_fetch(&buffer->write_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  _ring_buffer_unlock(buffer);
+  report->accepted = written;
+  return result;
+}
+
+// 書き込めたバイト数と捨てたバイト数を返すデータの書き込み関数
+// オーバーフロー時の扱いは ring_buffer_set_overflow_policy で設定した方針に従う
+int ring_buffer_write_report(RingBuffer *buffer, const uint8_t *data, size_t size, TickType_t xTicksToWait,
+                             RingBufferWriteReport *report) {
+  RingBufferWriteReport ignored;
+  if (report == NULL) {
+    report = &ignored;
+  }
+  *report = (RingBufferWriteReport){0};
+
+  RING_BUFFER_STAT_START(start);
+  int result;
+  if (_ring_buffer_spsc_writable(buffer, size)) {
+    _ring_buffer_mem_write(buffer, data, size);
+    _ring_buffer_notify_readers(buffer);
+    report->accepted = size;
+    result = RING_BUFFER_OK;
+  } else if (buffer->overflow_policy == RING_BUFFER_OVERFLOW_DROP_OLDEST) {
+    result = _ring_buffer_write_drop_oldest(buffer, data, size, report);
+  } else if (buffer->overflow_policy != RING_BUFFER_OVERFLOW_PARTIAL) {
+    result = _ring_buffer_write_whole(buffer, data, size, xTicksToWait, report);
+  } else {
+    result = _ring_buffer_write_partial(buffer, data, size, xTicksToWait, report);
+  }
+
+  // SPSC モードではロックなしで呼ばれるので、アトミックに加算する
+  RingBufferOverflowStats *stats = &buffer->overflow_stats;
+  __atomic_fetch_add(&stats->accepted, report->accepted, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->dropped, report->dropped, __ATOMIC_RELAXED);
+  if (result == RING_BUFFER_OVERFLOW || result == RING_BUFFER_TIMEOUT) {
+    __atomic_fetch_add(&stats->rejected, size - report->accepted, __ATOMIC_RELAXED);
+  }
+  RING_BUFFER_STAT_LATENCY(buffer, write_latency, start);
+  RING_BUFFER_STAT_RESULT(buffer, result);
+  return result;
+}
+
+// 複数のデータをまとめて書き込む関数
+// 全体が入りきる場合だけ、1回のロックで続けて書き込む
+int ring_buffer_writev(RingBuffer *buffer, const RingBufferVec *vec, size_t count) {
+  size_t size = _ring_buffer_vec_size(vec, count);
+
+  RING_BUFFER_STAT_START(start);
+  if (_ring_buffer_spsc_writable(buffer, size)) {
+    for (size_t i = 0; i < count; i++) {
+      _ring_buffer_mem_write(buffer, (const uint8_t *)vec[i].data, vec[i].size);
+    }
+    _ring_buffer_notify_readers(buffer);
+    RING_BUFFER_STAT_LATENCY(buffer, write_latency, start);
     return RING_BUFFER_OK;
   }
 
-  xSemaphoreGive(buffer->mutex);
-  return RING_BUFFER_OVERFLOW; // 両方オーバーフロー
+  _ring_buffer_lock(buffer);
+  bool wait = buffer->spill_task != NULL;
+  if (wait) {
+    __atomic_add_fetch(&buffer->write_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+  int result;
+  while (true) {
+    if (buffer->cancelled) {
+      result = RING_BUFFER_CANCELED;
+      break;
+    }
+
+    if (buffer->write_finished) {
+      result = RING_BUFFER_FINISHED;
+      break;
+    }
+
+    if (buffer->reader_count > 0) {
+      _ring_buffer_readers_make_room(buffer, size);
+    }
+    if (_ring_buffer_free_space(buffer) < size) {
+      result = RING_BUFFER_OVERFLOW;
+      break;
+    }
+
+    if (wait) {
+      xEventGroupClearBits(buffer->events, RING_BUFFER_EVENT_SPACE);
+    }
+    if (_ring_buffer_writable_space(buffer) >= size) {
+      size_t written = 0;
+      for (size_t i = 0; i < count; i++) {
+        written += _ring_buffer_write_locked(buffer, (const uint8_t *)vec[i].data, vec[i].size);
+      }
+      if (written > 0) {
+        _ring_buffer_notify_readers(buffer);
+      }
+      result = written == size ? RING_BUFFER_OK : RING_BUFFER_OVERFLOW;
+      break;
+    }
+
+    // 全体は入るがステージングに入りきらない場合は、書き出しタスクが空きを作るまで待つ
+    xTaskNotifyGive(buffer->spill_task);
+    _ring_buffer_unlock(buffer);
+    xEventGroupWaitBits(buffer->events, RING_BUFFER_EVENT_WRITABLE, pdFALSE, pdFALSE, portMAX_DELAY);
+    _ring_buffer_lock(buffer);
+  }
+
+  if (wait) {
+    __atomic_sub_fetch(&buffer->write_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  _ring_buffer_unlock(buffer);
+  RING_BUFFER_STAT_LATENCY(buffer, write_latency, start);
+  RING_BUFFER_STAT_RESULT(buffer, result);
+  return result;
 }
 
 // データの読み込み関数
 int ring_buffer_read(RingBuffer *buffer, uint8_t *data, size_t size, TickType_t xTicksToWait) {
-  xSemaphoreTake(buffer->mutex, portMAX_DELAY);
+  RingBufferVec vec = {.data = data, .size = size};
+  return ring_buffer_readv(buffer, &vec, 1, xTicksToWait);
+}
 
-  if (buffer->cancelled) {
-    xSemaphoreGive(buffer->mutex);
-    return RING_BUFFER_CANCELED;
+// 複数のバッファへまとめて読み込む関数
+int ring_buffer_readv(RingBuffer *buffer, const RingBufferVec *vec, size_t count, TickType_t xTicksToWait) {
+  size_t size = _ring_buffer_vec_size(vec, count);
+
+  RING_BUFFER_STAT_START(start);
+  if (_ring_buffer_spsc_readable(buffer, size)) {
+    for (size_t i = 0; i < count; i++) {
+      _ring_buffer_mem_read(buffer, (uint8_t *)vec[i].data, vec[i].size);
+    }
+    _ring_buffer_notify_writers(buffer);
+    RING_BUFFER_STAT_LATENCY(buffer, read_latency, start);
+    return size;
   }
 
-  if (buffer->write_finished) {
-    xSemaphoreGive(buffer->mutex);
-    return RING_BUFFER_FINISHED;
+  bool wait = xTicksToWait != 0;
+  TimeOut_t timeout;
+  vTaskSetTimeOutState(&timeout);
+  _ring_buffer_lock(buffer);
+  if (wait) {
+    __atomic_add_fetch(&buffer->read_waiters, 1, __ATOMIC_SEQ_CST);
   }
 
+  int result;
   size_t read_count = 0;
-  if (size <= buffer->memory_size) {
-    // メモリから読み込む
-    read_count = _ring_buffer_mem_read(buffer, data, size);
-  } else {
-    // メモリから読み込んで、足りなければファイルから読み込む
-    read_count = _ring_buffer_mem_read(buffer, data, buffer->memory_size);
-    if (read_count < buffer->memory_size) {
-      xSemaphoreGive(buffer->mutex);
-      return read_count;
+  while (true) {
+    if (buffer->cancelled) {
+      result = RING_BUFFER_CANCELED;
+      break;
     }
-    read_count += _ring_buffer_file_read(buffer, data + buffer->memory_size, size - buffer->memory_size);
+
+    // 読み込む前にクリアしておくことで、ロックを取らない書き込みの通知も取りこぼさない
+    if (wait) {
+      xEventGroupClearBits(buffer->events, RING_BUFFER_EVENT_DATA);
+    }
+    read_count += _ring_buffer_readv_locked(buffer, vec, count, read_count);
+    // メモリに空きがあり、ファイルにデータがある場合、ファイルからメモリに移動
+    _ring_buffer_refill(buffer);
+    result = read_count;
+    if (read_count == size) {
+      break;
+    }
+
+    // 書き込みが終了していれば、残りのデータを返して終わる
+    if (buffer->write_finished) {
+      if (read_count == 0) {
+        result = RING_BUFFER_FINISHED;
+      }
+      break;
+    }
+
+    if (xTaskCheckForTimeOut(&timeout, &xTicksToWait) == pdTRUE) {
+      break;
+    }
+
+    // 書き込み側がデータを積むまで待つ
+    _ring_buffer_unlock(buffer);
+    xEventGroupWaitBits(buffer->events, RING_BUFFER_EVENT_READABLE, pdFALSE, pdFALSE, xTicksToWait);
+    _ring_buffer_lock(buffer);
   }
 
-  // メモリに空きがあり、ファイルにデータがある場合、ファイルからメモリに移動
-  while (buffer->memory_len < buffer->memory_size && buffer->file_len > 0) {
-    uint8_t temp;
-    if (_ring_buffer_file_read(buffer, &temp, 1) > 0) {
-      _ring_buffer_mem_write(buffer, &temp, 1);
+  if (wait) {
+    __atomic_sub_fetch(&buffer->read_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  if (read_count > 0) {
+    _ring_buffer_notify_writers(buffer);
+  }
+  _ring_buffer_unlock(buffer);
+  RING_BUFFER_STAT_LATENCY(buffer, read_latency, start);
+  RING_BUFFER_STAT_RESULT(buffer, result);
+  return result;
+}
+
+// SPSC モードの設定関数
+void ring_buffer_set_spsc(RingBuffer *buffer, bool enable) {
+  _ring_buffer_lock(buffer);
+  buffer->spsc = enable;
+  _ring_buffer_unlock(buffer);
+}
+
+// 補充の水位を設定する関数
+void ring_buffer_set_promotion_watermarks(RingBuffer *buffer, size_t low, size_t high) {
+  _ring_buffer_lock(buffer);
+  if (high > buffer->memory_size) {
+    high = buffer->memory_size;
+  }
+  if (low > high) {
+    low = high;
+  }
+  buffer->promotion_low = low;
+  buffer->promotion_high = high;
+  _ring_buffer_unlock(buffer);
+}
+
+// 補充タスク
+// 通知を受けると、チャンクごとにミューテックスを手放しながら高水位まで補充する
+static void _ring_buffer_promotion_task(void *arg) {
+  RingBuffer *buffer = (RingBuffer *)arg;
+
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    if (buffer->promotion_stop) {
+      break;
     }
+
+    size_t moved;
+    do {
+      _ring_buffer_lock(buffer);
+      moved = 0;
+      if (!buffer->promotion_stop && buffer->memory_len < buffer->promotion_high) {
+        size_t size = buffer->promotion_high - buffer->memory_len;
+        moved = _ring_buffer_promote(buffer, size < RING_BUFFER_PROMOTION_CHUNK ? size : RING_BUFFER_PROMOTION_CHUNK);
+      }
+      _ring_buffer_unlock(buffer);
+    } while (moved > 0);
   }
 
-  xSemaphoreGive(buffer->mutex);
-  return read_count;
+  xSemaphoreGive(buffer->promotion_done);
+  vTaskDelete(NULL);
+}
+
+// 補充タスクの開始関数
+bool ring_buffer_start_promotion_task(RingBuffer *buffer, uint32_t stack_size, UBaseType_t priority) {
+  if (buffer->promotion_task != NULL) {
+    return false;
+  }
+  buffer->promotion_done = xSemaphoreCreateBinary();
+  if (buffer->promotion_done == NULL) {
+    return false;
+  }
+  buffer->promotion_stop = false;
+
+  TaskHandle_t task;
+  if (xTaskCreate(_ring_buffer_promotion_task, "rb_promote", stack_size, buffer, priority, &task) != pdPASS) {
+    vSemaphoreDelete(buffer->promotion_done);
+    buffer->promotion_done = NULL;
+    return false;
+  }
+
+  _ring_buffer_lock(buffer);
+  buffer->promotion_task = task;
+  _ring_buffer_refill(buffer);
+  _ring_buffer_unlock(buffer);
+  return true;
+}
+
+// 補充タスクの停止関数
+static void _ring_buffer_stop_promotion_task(RingBuffer *buffer) {
+  _ring_buffer_lock(buffer);
+  TaskHandle_t task = buffer->promotion_task;
+  buffer->promotion_task = NULL;
+  buffer->promotion_stop = true;
+  _ring_buffer_unlock(buffer);
+
+  if (task != NULL) {
+    xTaskNotifyGive(task);
+    xSemaphoreTake(buffer->promotion_done, portMAX_DELAY);
+    vSemaphoreDelete(buffer->promotion_done);
+    buffer->promotion_done = NULL;
+  }
 }
 
 // 書き込み終了関数
 void ring_buffer_finish_write(RingBuffer *buffer) {
-  xSemaphoreTake(buffer->mutex, portMAX_DELAY);
-  buffer->write_finished = true;
-  xSemaphoreGive(buffer->mutex);
+  _ring_buffer_lock(buffer);
+  __atomic_store_n(&buffer->write_finished, true, __ATOMIC_RELEASE);
+  xEventGroupSetBits(buffer->events, RING_BUFFER_EVENT_FINISHED);
+  _ring_buffer_unlock(buffer);
+  _ring_buffer_notify_threshold(buffer, true);
 }
 
 // キャンセル関数
 void ring_buffer_cancel(RingBuffer *buffer) {
-  xSemaphoreTake(buffer->mutex, portMAX_DELAY);
-  buffer->cancelled = true;
-  xSemaphoreGive(buffer->mutex);
+  _ring_buffer_lock(buffer);
+  __atomic_store_n(&buffer->cancelled, true, __ATOMIC_RELEASE);
+  xEventGroupSetBits(buffer->events, RING_BUFFER_EVENT_CANCELED);
+  _ring_buffer_unlock(buffer);
+  _ring_buffer_notify_threshold(buffer, true);
 }
 
 // 解放関数
 void ring_buffer_free(RingBuffer *buffer) {
-  fclose(buffer->file);
+  _ring_buffer_stop_spill_task(buffer);
+  _ring_buffer_stop_promotion_task(buffer);
+  _ring_buffer_file_checkpoint(buffer);
+  _ring_buffer_file_unmap(buffer);
+  if (buffer->file != NULL) {
+    fclose(buffer->file);
+  }
+  _ring_buffer_segment_close(buffer);
+  _ring_buffer_free_combining(buffer);
   vSemaphoreDelete(buffer->mutex);
+  vEventGroupDelete(buffer->events);
 }
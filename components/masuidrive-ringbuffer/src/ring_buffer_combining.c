@@ -0,0 +1,138 @@
+#include "ring_buffer.h"
+#include "ring_buffer_internal.h"
+
+// 公開されている書き込みがあるかを返す
+static bool _ring_buffer_combining_pending(RingBuffer *buffer) {
+  return __atomic_load_n(&buffer->combining_pending, __ATOMIC_SEQ_CST) > 0;
+}
+
+// ロックを保持した状態で 1 件の書き込みを行い、書き込めたバイト数またはエラーを返す
+static int _ring_buffer_combine_write(RingBuffer *buffer, const uint8_t *data, size_t size) {
+  if (buffer->cancelled) {
+    return RING_BUFFER_CANCELED;
+  }
+  if (buffer->write_finished) {
+    return RING_BUFFER_FINISHED;
+  }
+  return (int)_ring_buffer_write_locked(buffer, data, size);
+}
+
+// ロックを保持した状態で、スロットに公開されている書き込みをまとめて反映する
+static void _ring_buffer_combine_locked(RingBuffer *buffer) {
+  if (!_ring_buffer_combining_pending(buffer)) {
+    return;
+  }
+
+  bool written = false;
+  for (int i = 0; i < RING_BUFFER_COMBINING_SLOTS; i++) {
+    RingBufferCombiningSlot *slot = &buffer->combining_slots[i];
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != RING_BUFFER_SLOT_PENDING) {
+      continue;
+    }
+
+    slot->result = _ring_buffer_combine_write(buffer, slot->data, slot->size);
+    written |= slot->result > 0;
+    __atomic_store_n(&slot->state, RING_BUFFER_SLOT_DONE, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&buffer->combining_pending, 1, __ATOMIC_SEQ_CST);
+    xSemaphoreGive(slot->done);
+  }
+  if (written) {
+    _ring_buffer_notify_readers(buffer);
+  }
+}
+
+// 書き込みの集約が有効な場合のミューテックスの解放
+// 解放する前に、スロットに公開されている書き込みを反映する
+// 解放した後に公開された書き込みは、ロックを取り直せた場合に反映する
+// (取り直せなければ、ロックを持っている別のタスクが解放時に反映する)
+// 公開したタスクは、ロックを持っているのが読み込み側でも反映を待つので、集約が有効な間はどの経路の解放でも反映する
+void _ring_buffer_combining_unlock(RingBuffer *buffer) {
+  while (true) {
+    _ring_buffer_combine_locked(buffer);
+    xSemaphoreGive(buffer->mutex);
+    if (!_ring_buffer_combining_pending(buffer) || !_ring_buffer_try_lock(buffer)) {
+      return;
+    }
+  }
+}
+
+// スロットに書き込みを公開し、ロックを持っているタスクに反映してもらう
+// 空いているスロットがなければ、false を返して通常の経路に任せる
+bool _ring_buffer_write_combined(RingBuffer *buffer, const uint8_t *data, size_t size, int *result) {
+  RingBufferCombiningSlot *slot = NULL;
+  for (int i = 0; i < RING_BUFFER_COMBINING_SLOTS; i++) {
+    uint32_t expected = RING_BUFFER_SLOT_FREE;
+    if (__atomic_compare_exchange_n(&buffer->combining_slots[i].state, &expected, RING_BUFFER_SLOT_CLAIMED, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      slot = &buffer->combining_slots[i];
+      break;
+    }
+  }
+  if (slot == NULL) {
+    return false;
+  }
+
+  slot->data = data;
+  slot->size = size;
+  __atomic_store_n(&slot->state, RING_BUFFER_SLOT_PENDING, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&buffer->combining_pending, 1, __ATOMIC_SEQ_CST);
+
+  // ロックが空いていれば自分で書き込み、ほかのスロットの書き込みも解放時に反映する
+  // 空いていなければ、ロックを持っているタスクに任せて反映を待つ
+  if (_ring_buffer_try_lock(buffer)) {
+    uint32_t expected = RING_BUFFER_SLOT_PENDING;
+    if (__atomic_compare_exchange_n(&slot->state, &expected, RING_BUFFER_SLOT_CLAIMED, false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      // ロックを取る前に反映されていなければ、スロットを取り下げる (done は与えられない)
+      __atomic_sub_fetch(&buffer->combining_pending, 1, __ATOMIC_SEQ_CST);
+      *result = _ring_buffer_combine_write(buffer, data, size);
+      if (*result > 0) {
+        _ring_buffer_notify_readers(buffer);
+      }
+      _ring_buffer_unlock(buffer);
+      __atomic_store_n(&slot->state, RING_BUFFER_SLOT_FREE, __ATOMIC_RELEASE);
+      return true;
+    }
+    _ring_buffer_unlock(buffer);
+  }
+  xSemaphoreTake(slot->done, portMAX_DELAY);
+
+  *result = slot->result;
+  __atomic_store_n(&slot->state, RING_BUFFER_SLOT_FREE, __ATOMIC_RELEASE);
+  return true;
+}
+
+// 書き込みの集約の設定関数
+bool ring_buffer_set_write_combining(RingBuffer *buffer, bool enable) {
+  _ring_buffer_lock(buffer);
+  bool ok = true;
+  if (enable && !buffer->combining) {
+    for (int i = 0; i < RING_BUFFER_COMBINING_SLOTS; i++) {
+      RingBufferCombiningSlot *slot = &buffer->combining_slots[i];
+      slot->state = RING_BUFFER_SLOT_FREE;
+      if (slot->done == NULL) {
+        slot->done = xSemaphoreCreateBinary();
+      }
+      ok = ok && slot->done != NULL;
+    }
+  }
+  // 無効にする場合も、公開済みの書き込みは反映してから解放する
+  bool was_combining = buffer->combining;
+  buffer->combining = enable && ok;
+  if (was_combining) {
+    _ring_buffer_combining_unlock(buffer);
+  } else {
+    _ring_buffer_unlock(buffer);
+  }
+  return ok;
+}
+
+// スロットのセマフォを解放する関数
+void _ring_buffer_free_combining(RingBuffer *buffer) {
+  for (int i = 0; i < RING_BUFFER_COMBINING_SLOTS; i++) {
+    if (buffer->combining_slots[i].done != NULL) {
+      vSemaphoreDelete(buffer->combining_slots[i].done);
+      buffer->combining_slots[i].done = NULL;
+    }
+  }
+}
@@ -0,0 +1,430 @@
+#include "ring_buffer.h"
+#include "ring_buffer_internal.h"
+
+#include <esp_log.h>
+#include <stdint.h>
+
+// 圧縮モードのファイルバッファ
+// 書き込まれたデータを RING_BUFFER_COMPRESS_CHUNK バイトずつ RAM に溜め、LZ 形式で圧縮したフレームとしてファイルへ書く
+// フレームは 4 バイトのヘッダ (元のサイズ、格納サイズ) と本体からなり、圧縮しても小さくならない場合はそのまま格納する
+// file_len は展開後のバイト数で、ファイル上で使っているバイト数は file_used で管理する
+
+// 作業領域の配置
+// [溜めているチャンク][圧縮したフレーム][展開したフレーム / 圧縮用のハッシュ表]
+// 圧縮は書き込み時、展開は読み込み時にしか使わないので、ハッシュ表と展開したフレームは領域を共有する
+_Static_assert((sizeof(uint16_t) << RING_BUFFER_COMPRESS_HASH_BITS) <= RING_BUFFER_COMPRESS_CHUNK,
+               "compression hash table must fit in a chunk");
+_Static_assert(RING_BUFFER_COMPRESS_CHUNK <= UINT16_MAX, "chunk size must fit in a frame header");
+
+#define RING_BUFFER_COMPRESS_MIN_MATCH 4
+
+static const char *TAG = "ring_buffer";
+
+static uint8_t *_ring_buffer_compress_open(RingBuffer *buffer) { return buffer->compress_work; }
+
+static uint8_t *_ring_buffer_compress_frame(RingBuffer *buffer) {
+  return buffer->compress_work + RING_BUFFER_COMPRESS_CHUNK;
+}
+
+static uint8_t *_ring_buffer_compress_cache(RingBuffer *buffer) {
+  return buffer->compress_work + RING_BUFFER_COMPRESS_CHUNK * 2;
+}
+
+static uint32_t _ring_buffer_lz_read32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t _ring_buffer_lz_hash(uint32_t value) {
+  return (value * 2654435761U) >> (32 - RING_BUFFER_COMPRESS_HASH_BITS);
+}
+
+// 15 以上の長さの残りを 255 区切りで書き込む
+static bool _ring_buffer_lz_put_length(uint8_t *dst, size_t cap, size_t *op, size_t length) {
+  for (length -= 15; length >= 255; length -= 255) {
+    if (*op >= cap) {
+      return false;
+    }
+    dst[(*op)++] = 255;
+  }
+  if (*op >= cap) {
+    return false;
+  }
+  dst[(*op)++] = (uint8_t)length;
+  return true;
+}
+
+// リテラルと一致を1組書き込む (match_length が 0 なら最後のリテラルだけ)
+static bool _ring_buffer_lz_put_sequence(uint8_t *dst, size_t cap, size_t *op, const uint8_t *literals,
+                                         size_t literal_length, size_t offset, size_t match_length) {
+  if (*op >= cap) {
+    return false;
+  }
+  size_t match_code = match_length > 0 ? match_length - RING_BUFFER_COMPRESS_MIN_MATCH : 0;
+  dst[(*op)++] = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4 | (match_code < 15 ? match_code : 15));
+  if (literal_length >= 15 && !_ring_buffer_lz_put_length(dst, cap, op, literal_length)) {
+    return false;
+  }
+  if (cap - *op < literal_length) {
+    return false;
+  }
+  memcpy(dst + *op, literals, literal_length);
+  *op += literal_length;
+  if (match_length == 0) {
+    return true;
+  }
+
+  if (cap - *op < 2) {
+    return false;
+  }
+  dst[(*op)++] = (uint8_t)offset;
+  dst[(*op)++] = (uint8_t)(offset >> 8);
+  return match_code < 15 || _ring_buffer_lz_put_length(dst, cap, op, match_code);
+}
+
+// src を圧縮して dst に書き込み、圧縮後のバイト数を返す
+// cap バイトに収まらない場合は 0 を返す
+static size_t _ring_buffer_lz_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t cap, uint16_t *table) {
+  memset(table, 0, sizeof(uint16_t) << RING_BUFFER_COMPRESS_HASH_BITS);
+  size_t ip = 0;
+  size_t anchor = 0;
+  size_t op = 0;
+  while (ip + RING_BUFFER_COMPRESS_MIN_MATCH <= size) {
+    uint32_t sequence = _ring_buffer_lz_read32(src + ip);
+    uint32_t hash = _ring_buffer_lz_hash(sequence);
+    size_t ref = table[hash];
+    table[hash] = (uint16_t)ip;
+    if (ref >= ip || _ring_buffer_lz_read32(src + ref) != sequence) {
+      ip++;
+      continue;
+    }
+
+    size_t length = RING_BUFFER_COMPRESS_MIN_MATCH;
+    while (ip + length < size && src[ref + length] == src[ip + length]) {
+      length++;
+    }
+    if (!_ring_buffer_lz_put_sequence(dst, cap, &op, src + anchor, ip - anchor, ip - ref, length)) {
+      return 0;
+    }
+    ip += length;
+    anchor = ip;
+  }
+  if (!_ring_buffer_lz_put_sequence(dst, cap, &op, src + anchor, size - anchor, 0, 0)) {
+    return 0;
+  }
+  return op;
+}
+
+// 255 区切りの長さを読み込む
+static bool _ring_buffer_lz_get_length(const uint8_t *src, size_t size, size_t *ip, size_t *length) {
+  uint8_t byte;
+  do {
+    if (*ip >= size) {
+      return false;
+    }
+    byte = src[(*ip)++];
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// src を展開して dst にちょうど raw_size バイト書き込めた場合 true を返す
+// ファイルの内容が壊れていても dst の外には書き込まない
+static bool _ring_buffer_lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size) {
+  size_t ip = 0;
+  size_t op = 0;
+  while (ip < size) {
+    uint8_t token = src[ip++];
+    size_t literal_length = token >> 4;
+    if (literal_length == 15 && !_ring_buffer_lz_get_length(src, size, &ip, &literal_length)) {
+      return false;
+    }
+    if (size - ip < literal_length || raw_size - op < literal_length) {
+      return false;
+    }
+    memcpy(dst + op, src + ip, literal_length);
+    ip += literal_length;
+    op += literal_length;
+    if (ip == size) {
+      break;
+    }
+
+    if (size - ip < 2) {
+      return false;
+    }
+    size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+    ip += 2;
+    size_t match_length = token & 0x0F;
+    if (match_length == 15 && !_ring_buffer_lz_get_length(src, size, &ip, &match_length)) {
+      return false;
+    }
+    match_length += RING_BUFFER_COMPRESS_MIN_MATCH;
+    if (offset == 0 || offset > op || raw_size - op < match_length) {
+      return false;
+    }
+    // 重なる場合があるので 1 バイトずつコピーする
+    for (size_t i = 0; i < match_length; i++, op++) {
+      dst[op] = dst[op - offset];
+    }
+  }
+  return op == raw_size;
+}
+
+// ファイル上の pos にあるフレームのヘッダを読み込む
+// ヘッダが壊れている場合は false を返す
+static bool _ring_buffer_compress_header(RingBuffer *buffer, size_t pos, size_t used, size_t *raw_size,
+                                         size_t *stored_size) {
+  if (buffer->compress_cache_pos == pos) {
+    *raw_size = buffer->compress_cache_raw;
+    *stored_size = buffer->compress_cache_stored;
+    return true;
+  }
+  uint8_t header[RING_BUFFER_COMPRESS_FRAME_HEADER];
+  if (used < sizeof(header) || _ring_buffer_file_read_at(buffer, pos, header, sizeof(header)) != sizeof(header)) {
+    return false;
+  }
+  *raw_size = header[0] | (size_t)header[1] << 8;
+  *stored_size = header[2] | (size_t)header[3] << 8;
+  return *raw_size > 0 && *raw_size <= RING_BUFFER_COMPRESS_CHUNK && *stored_size <= *raw_size &&
+         *stored_size <= used - sizeof(header);
+}
+
+// ファイル上の pos にあるフレームを展開したキャッシュを用意する
+static bool _ring_buffer_compress_load(RingBuffer *buffer, size_t pos, size_t raw_size, size_t stored_size) {
+  if (buffer->compress_cache_pos == pos) {
+    return true;
+  }
+  size_t data_pos = _ring_buffer_wrap(pos + RING_BUFFER_COMPRESS_FRAME_HEADER, buffer->file_size, 0);
+  uint8_t *cache = _ring_buffer_compress_cache(buffer);
+  if (stored_size == raw_size) {
+    if (_ring_buffer_file_read_at(buffer, data_pos, cache, raw_size) != raw_size) {
+      return false;
+    }
+  } else {
+    uint8_t *frame = _ring_buffer_compress_frame(buffer);
+    if (_ring_buffer_file_read_at(buffer, data_pos, frame, stored_size) != stored_size ||
+        !_ring_buffer_lz_decompress(frame, stored_size, cache, raw_size)) {
+      return false;
+    }
+  }
+  buffer->compress_cache_pos = pos;
+  buffer->compress_cache_raw = raw_size;
+  buffer->compress_cache_stored = stored_size;
+  return true;
+}
+
+// pos にある壊れたフレームから後ろのフレームを捨てる関数
+// フレームには区切りの目印がないので、壊れたヘッダの後ろにある次のフレームは探せない
+// distance は file_head から pos までのファイル上のバイト数、raw はその間のフレームの展開後のバイト数
+// 捨てた範囲のうち file_skip で既に読み飛ばしていた分を file_skip から引き、その差を返す
+static size_t _ring_buffer_compress_truncate(RingBuffer *buffer, size_t pos, size_t distance, size_t raw) {
+  size_t frames_raw = buffer->file_len + buffer->file_skip - buffer->compress_open_len;
+  size_t lost = frames_raw - raw;
+  size_t skipped = 0;
+  if (buffer->file_skip > raw) {
+    skipped = buffer->file_skip - raw < lost ? buffer->file_skip - raw : lost;
+  }
+  ESP_LOGE(TAG, "corrupt compressed frame at %u, dropping %u bytes", (unsigned)pos, (unsigned)(lost - skipped));
+  buffer->file_skip -= skipped;
+  buffer->file_used = distance;
+  buffer->compress_cache_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+  if (buffer->compress_seek_pos != RING_BUFFER_FILE_POS_UNKNOWN && buffer->compress_seek_used >= distance) {
+    buffer->compress_seek_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+  }
+  buffer->compress_stats.lost_bytes += lost - skipped;
+  buffer->compress_stats.corrupt_frames++;
+  __atomic_store_n(&buffer->file_len, buffer->file_len - (lost - skipped), __ATOMIC_RELEASE);
+  return skipped;
+}
+
+// 作業領域を割り当てる関数
+void _ring_buffer_compress_init(RingBuffer *buffer, void *work) {
+  // ハッシュ表を uint16_t として使うため、作業領域の先頭を揃える
+  uintptr_t aligned = ((uintptr_t)work + sizeof(uint32_t) - 1) & ~(uintptr_t)(sizeof(uint32_t) - 1);
+  buffer->compress_work = work != NULL ? (uint8_t *)aligned : NULL;
+  buffer->compress_open_len = 0;
+  buffer->compress_cache_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+  buffer->compress_seek_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+  buffer->compress_stats = (RingBufferCompressStats){0};
+  buffer->file_used = 0;
+  buffer->file_skip = 0;
+}
+
+// 溜めているチャンクを圧縮してフレームとしてファイルへ書き込む関数
+// 空きは _ring_buffer_compress_space で予約してあるので、書き込みエラー以外では失敗しない
+bool _ring_buffer_compress_seal(RingBuffer *buffer) {
+  size_t raw_size = buffer->compress_open_len;
+  if (raw_size == 0) {
+    return true;
+  }
+
+  // ハッシュ表が展開したフレームを上書きする
+  buffer->compress_cache_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+  uint8_t *open = _ring_buffer_compress_open(buffer);
+  uint8_t *frame = _ring_buffer_compress_frame(buffer);
+  size_t stored_size = _ring_buffer_lz_compress(open, raw_size, frame, raw_size - 1,
+                                                (uint16_t *)_ring_buffer_compress_cache(buffer));
+  const uint8_t *payload = frame;
+  if (stored_size == 0) {
+    stored_size = raw_size;
+    payload = open;
+  }
+
+  uint8_t header[RING_BUFFER_COMPRESS_FRAME_HEADER] = {(uint8_t)raw_size, (uint8_t)(raw_size >> 8),
+                                                       (uint8_t)stored_size, (uint8_t)(stored_size >> 8)};
+  size_t tail = _ring_buffer_wrap(buffer->file_head + buffer->file_used, buffer->file_size, 0);
+  size_t data_pos = _ring_buffer_wrap(tail + sizeof(header), buffer->file_size, 0);
+  if (_ring_buffer_file_write_at(buffer, tail, header, sizeof(header)) != sizeof(header) ||
+      _ring_buffer_file_write_at(buffer, data_pos, payload, stored_size) != stored_size) {
+    return false;
+  }
+
+  buffer->file_used += sizeof(header) + stored_size;
+  buffer->compress_open_len = 0;
+  buffer->compress_stats.raw_bytes += raw_size;
+  buffer->compress_stats.stored_bytes += sizeof(header) + stored_size;
+  return true;
+}
+
+// 書き込める残りのバイト数を返す関数
+// これから書き込むデータがまったく縮まなかった場合でも、ファイルに収まるバイト数を返す
+size_t _ring_buffer_compress_space(RingBuffer *buffer) {
+  const size_t frame_max = RING_BUFFER_COMPRESS_FRAME_HEADER + RING_BUFFER_COMPRESS_CHUNK;
+  size_t free_size = buffer->file_size - buffer->file_used;
+  size_t rest = free_size % frame_max;
+  size_t capacity = free_size / frame_max * RING_BUFFER_COMPRESS_CHUNK +
+                    (rest > RING_BUFFER_COMPRESS_FRAME_HEADER ? rest - RING_BUFFER_COMPRESS_FRAME_HEADER : 0);
+  return capacity > buffer->compress_open_len ? capacity - buffer->compress_open_len : 0;
+}
+
+// データをチャンクに溜め、いっぱいになったら圧縮して書き出す関数
+// size は _ring_buffer_compress_space 以下であること。書き込めたバイト数を返す
+size_t _ring_buffer_compress_write(RingBuffer *buffer, const uint8_t *data, size_t size) {
+  uint8_t *open = _ring_buffer_compress_open(buffer);
+  size_t written = 0;
+  while (written < size) {
+    size_t count = RING_BUFFER_COMPRESS_CHUNK - buffer->compress_open_len;
+    if (count == 0) {
+      break; // 直前の書き出しに失敗している
+    }
+    if (count > size - written) {
+      count = size - written;
+    }
+    memcpy(open + buffer->compress_open_len, data + written, count);
+    buffer->compress_open_len += count;
+    written += count;
+    if (buffer->compress_open_len == RING_BUFFER_COMPRESS_CHUNK) {
+      _ring_buffer_compress_seal(buffer);
+    }
+  }
+  __atomic_store_n(&buffer->file_len, buffer->file_len + written, __ATOMIC_RELEASE);
+  return written;
+}
+
+// 先頭から offset バイト目以降を、消費せずに最大 size バイト読み込む関数
+// フレームを順にたどり、必要なフレームだけを展開する
+// 読み始めたフレームを覚えておき、次にそれより後ろを読むときはそこからたどるので、
+// 先頭から順に読み進める場合にフレームのヘッダを何度も読み直すことはない
+size_t _ring_buffer_compress_peek(RingBuffer *buffer, size_t offset, uint8_t *data, size_t size) {
+  size_t copied = 0;
+  size_t pos = buffer->file_head;
+  size_t used = buffer->file_used;
+  size_t raw = 0; // pos のフレームより前のフレームの展開後のバイト数
+  offset += buffer->file_skip;
+  if (buffer->compress_seek_pos != RING_BUFFER_FILE_POS_UNKNOWN && buffer->compress_seek_raw <= offset) {
+    pos = buffer->compress_seek_pos;
+    used -= buffer->compress_seek_used;
+    raw = buffer->compress_seek_raw;
+    offset -= raw;
+  }
+  while (used > 0 && copied < size) {
+    size_t raw_size, stored_size;
+    bool valid = _ring_buffer_compress_header(buffer, pos, used, &raw_size, &stored_size);
+    if (valid && offset < raw_size) {
+      valid = _ring_buffer_compress_load(buffer, pos, raw_size, stored_size);
+    }
+    if (!valid) {
+      // 壊れたフレームから後ろを捨て、consume と同じ内容をチャンクから読み続ける
+      offset -= _ring_buffer_compress_truncate(buffer, pos, buffer->file_used - used, raw);
+      break;
+    }
+    if (offset < raw_size) {
+      if (copied == 0) {
+        buffer->compress_seek_pos = pos;
+        buffer->compress_seek_raw = raw;
+        buffer->compress_seek_used = buffer->file_used - used;
+      }
+      size_t count = raw_size - offset < size - copied ? raw_size - offset : size - copied;
+      memcpy(data + copied, _ring_buffer_compress_cache(buffer) + offset, count);
+      copied += count;
+      offset = 0;
+    } else {
+      offset -= raw_size;
+    }
+    raw += raw_size;
+    size_t frame_size = RING_BUFFER_COMPRESS_FRAME_HEADER + stored_size;
+    pos = _ring_buffer_wrap(pos + frame_size, buffer->file_size, 0);
+    used -= frame_size;
+  }
+
+  // フレームの後ろは、まだ書き出していないチャンク
+  if (copied < size && offset < buffer->compress_open_len) {
+    size_t count = buffer->compress_open_len - offset;
+    if (count > size - copied) {
+      count = size - copied;
+    }
+    memcpy(data + copied, _ring_buffer_compress_open(buffer) + offset, count);
+    copied += count;
+  }
+  return copied;
+}
+
+// 先頭から size バイトを捨てる関数
+// 読み終えたフレームだけをファイルから外し、途中まで読んだフレームは file_skip で読み飛ばす
+void _ring_buffer_compress_consume(RingBuffer *buffer, size_t size) {
+  __atomic_store_n(&buffer->file_len, buffer->file_len - size, __ATOMIC_RELEASE);
+  buffer->file_skip += size;
+  while (buffer->file_used > 0) {
+    size_t raw_size, stored_size;
+    if (!_ring_buffer_compress_header(buffer, buffer->file_head, buffer->file_used, &raw_size, &stored_size)) {
+      _ring_buffer_compress_truncate(buffer, buffer->file_head, 0, 0);
+      break;
+    }
+    if (buffer->file_skip < raw_size) {
+      return;
+    }
+    if (buffer->compress_cache_pos == buffer->file_head) {
+      buffer->compress_cache_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+    }
+    size_t frame_size = RING_BUFFER_COMPRESS_FRAME_HEADER + stored_size;
+    // 覚えているフレームの位置を、新しい先頭からの値に直す
+    if (buffer->compress_seek_pos == buffer->file_head) {
+      buffer->compress_seek_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+    } else if (buffer->compress_seek_pos != RING_BUFFER_FILE_POS_UNKNOWN) {
+      buffer->compress_seek_raw -= raw_size;
+      buffer->compress_seek_used -= frame_size;
+    }
+    buffer->file_head = _ring_buffer_wrap(buffer->file_head + frame_size, buffer->file_size, 0);
+    buffer->file_used -= frame_size;
+    buffer->file_skip -= raw_size;
+  }
+
+  // フレームをすべて読み終えていれば、残りはチャンクから捨てる
+  size_t skip = buffer->file_skip < buffer->compress_open_len ? buffer->file_skip : buffer->compress_open_len;
+  if (skip > 0) {
+    uint8_t *open = _ring_buffer_compress_open(buffer);
+    memmove(open, open + skip, buffer->compress_open_len - skip);
+    buffer->compress_open_len -= skip;
+  }
+  buffer->file_skip = 0;
+}
+
+// 圧縮の統計を取得する関数
+void ring_buffer_get_compress_stats(RingBuffer *buffer, RingBufferCompressStats *stats) {
+  _ring_buffer_lock(buffer);
+  _ring_buffer_file_lock(buffer);
+  *stats = buffer->compress_stats;
+  _ring_buffer_file_unlock(buffer);
+  _ring_buffer_unlock(buffer);
+}
@@ -0,0 +1,91 @@
+#include "ring_buffer.h"
+#include "ring_buffer_internal.h"
+
+// 読み込み先のバッファを使わずに、データを sink へ直接渡す
+// メモリのデータは memory_buffer の連続領域をそのまま渡し、メモリより後ろの階層とステージングのデータは
+// RING_BUFFER_DRAIN_CHUNK バイトずつまとめて読み込んで渡す。メモリへの補充は行わない
+
+// data を sink に渡し、受け付けたバイト数を返す
+static size_t _ring_buffer_drain_span(RingBufferSink sink, void *ctx, const uint8_t *data, size_t size) {
+  size_t accepted = sink(ctx, data, size);
+  return accepted < size ? accepted : size;
+}
+
+// ロックを保持した状態で、メモリのデータを最大 size バイト sink に渡し、受け付けたバイト数を返す
+static size_t _ring_buffer_drain_memory(RingBuffer *buffer, RingBufferSink sink, void *ctx, size_t size) {
+  RingBufferSpan spans[2];
+  _ring_buffer_mem_data_spans(buffer, size, spans);
+  size_t drained = 0;
+  for (int i = 0; i < 2 && spans[i].size > 0; i++) {
+    size_t accepted = _ring_buffer_drain_span(sink, ctx, spans[i].data, spans[i].size);
+    _ring_buffer_mem_consume(buffer, accepted);
+    drained += accepted;
+    if (accepted < spans[i].size) {
+      break;
+    }
+  }
+  return drained;
+}
+
+// ロックを保持した状態で、メモリより後ろのデータを最大 size バイト sink に渡し、受け付けたバイト数を返す
+// sink が途中までしか受け付けなかった場合や、読み込みに失敗した場合はそこで止める
+static size_t _ring_buffer_drain_spilled(RingBuffer *buffer, RingBufferSink sink, void *ctx, size_t size) {
+  uint8_t chunk[RING_BUFFER_DRAIN_CHUNK];
+  size_t drained = 0;
+  for (size_t i = 0; i < buffer->tier_count && drained < size; i++) {
+    while (drained < size) {
+      size_t len = _ring_buffer_tier_usage(buffer, i);
+      if (len == 0) {
+        break;
+      }
+      size_t count = size - drained < len ? size - drained : len;
+      count = _ring_buffer_tier_peek(buffer, i, 0, chunk, count < sizeof(chunk) ? count : sizeof(chunk));
+      size_t accepted = count > 0 ? _ring_buffer_drain_span(sink, ctx, chunk, count) : 0;
+      _ring_buffer_tier_consume(buffer, i, accepted);
+      drained += accepted;
+      if (count == 0 || accepted < count) {
+        return drained;
+      }
+    }
+  }
+
+  while (drained < size && buffer->staging_len > 0) {
+    size_t count = size - drained < sizeof(chunk) ? size - drained : sizeof(chunk);
+    count = _ring_buffer_staging_peek(buffer, 0, chunk, count);
+    size_t accepted = count > 0 ? _ring_buffer_drain_span(sink, ctx, chunk, count) : 0;
+    _ring_buffer_staging_consume(buffer, accepted);
+    drained += accepted;
+    if (count == 0 || accepted < count) {
+      break;
+    }
+  }
+  return drained;
+}
+
+// 積んであるデータを最大 max_bytes バイト sink に渡す関数
+// sink が受け付けた分だけを消費し、受け付けた合計のバイト数を返す
+int ring_buffer_drain(RingBuffer *buffer, RingBufferSink sink, void *ctx, size_t max_bytes) {
+  RING_BUFFER_STAT_START(start);
+  _ring_buffer_lock(buffer);
+  if (buffer->cancelled) {
+    _ring_buffer_unlock(buffer);
+    return RING_BUFFER_CANCELED;
+  }
+
+  // メモリのデータを読み終えるまでは、後ろの階層には進まない
+  size_t memory_len = __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE);
+  size_t drained = _ring_buffer_drain_memory(buffer, sink, ctx, max_bytes);
+  if (drained == memory_len && drained < max_bytes) {
+    drained += _ring_buffer_drain_spilled(buffer, sink, ctx, max_bytes - drained);
+  }
+
+  int result = (int)drained;
+  if (drained > 0) {
+    _ring_buffer_notify_writers(buffer);
+  } else if (buffer->write_finished && _ring_buffer_stored(buffer) == 0) {
+    result = RING_BUFFER_FINISHED;
+  }
+  _ring_buffer_unlock(buffer);
+  RING_BUFFER_STAT_LATENCY(buffer, read_latency, start);
+  return result;
+}
@@ -0,0 +1,144 @@
+#include "ring_buffer.h"
+#include "ring_buffer_internal.h"
+
+#include <freertos/task.h>
+
+// 固定長の要素の読み書き
+// 要素は必ず element_size バイト単位で書き込み、読み込むので、途中で切れた要素を書き込んだり読み込んだりすることはない
+
+// 要素をまとめて書き込む関数
+// 1回のロックで、入るだけの要素を最大 count 個書き込み、書き込んだ個数を返す
+int ring_buffer_write_elements(RingBuffer *buffer, const void *data, size_t element_size, size_t count) {
+  if (element_size == 0) {
+    return 0;
+  }
+
+  RING_BUFFER_STAT_START(start);
+  _ring_buffer_lock(buffer);
+  bool wait = buffer->spill_task != NULL;
+  if (wait) {
+    __atomic_add_fetch(&buffer->write_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+  int result;
+  while (true) {
+    if (buffer->cancelled) {
+      result = RING_BUFFER_CANCELED;
+      break;
+    }
+
+    if (buffer->write_finished) {
+      result = RING_BUFFER_FINISHED;
+      break;
+    }
+
+    if (buffer->reader_count > 0) {
+      _ring_buffer_readers_make_room(buffer, element_size * count);
+    }
+
+    if (wait) {
+      xEventGroupClearBits(buffer->events, RING_BUFFER_EVENT_SPACE);
+    }
+    size_t fit = _ring_buffer_writable_space(buffer) / element_size;
+    fit = fit < count ? fit : count;
+    if (fit > 0) {
+      size_t written = _ring_buffer_write_locked(buffer, (const uint8_t *)data, element_size * fit);
+      _ring_buffer_notify_readers(buffer);
+      result = (int)(written / element_size);
+      break;
+    }
+
+    // ひとつも入らない場合は、ファイルにも空きがなければ諦める
+    if (!wait || _ring_buffer_free_space(buffer) < element_size) {
+      result = 0;
+      break;
+    }
+
+    // ファイルには入るがステージングに入りきらない場合は、書き出しタスクが空きを作るまで待つ
+    xTaskNotifyGive(buffer->spill_task);
+    _ring_buffer_unlock(buffer);
+    xEventGroupWaitBits(buffer->events, RING_BUFFER_EVENT_WRITABLE, pdFALSE, pdFALSE, portMAX_DELAY);
+    _ring_buffer_lock(buffer);
+  }
+
+  if (wait) {
+    __atomic_sub_fetch(&buffer->write_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  _ring_buffer_unlock(buffer);
+
+  // 戻り値は個数なので、入りきらなかった要素があればオーバーフローとして数える
+  RingBufferOverflowStats *stats = &buffer->overflow_stats;
+  if (result >= 0) {
+    __atomic_fetch_add(&stats->accepted, element_size * result, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->rejected, element_size * (count - result), __ATOMIC_RELAXED);
+  }
+  RING_BUFFER_STAT_LATENCY(buffer, write_latency, start);
+  RING_BUFFER_STAT_RESULT(buffer, result >= 0 && (size_t)result < count ? RING_BUFFER_OVERFLOW : result);
+  return result;
+}
+
+// 要素をまとめて読み込む関数
+// 1回のロックで、揃っている要素を最大 max_count 個読み込み、読み込んだ個数を返す
+int ring_buffer_read_elements(RingBuffer *buffer, void *data, size_t element_size, size_t max_count,
+                              TickType_t xTicksToWait) {
+  if (element_size == 0 || max_count == 0) {
+    return 0;
+  }
+
+  RING_BUFFER_STAT_START(start);
+  bool wait = xTicksToWait != 0;
+  TimeOut_t timeout;
+  vTaskSetTimeOutState(&timeout);
+  _ring_buffer_lock(buffer);
+  if (wait) {
+    __atomic_add_fetch(&buffer->read_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+  int result;
+  while (true) {
+    if (buffer->cancelled) {
+      result = RING_BUFFER_CANCELED;
+      break;
+    }
+
+    if (wait) {
+      xEventGroupClearBits(buffer->events, RING_BUFFER_EVENT_DATA);
+    }
+    size_t count = _ring_buffer_stored(buffer) / element_size;
+    count = count < max_count ? count : max_count;
+    if (count > 0) {
+      size_t size = _ring_buffer_peek(buffer, 0, (uint8_t *)data, element_size * count) / element_size * element_size;
+      _ring_buffer_discard(buffer, size);
+      result = (int)(size / element_size);
+      break;
+    }
+
+    // 書き込みが終了していれば、要素に満たない残りがあっても終わる
+    if (buffer->write_finished) {
+      result = RING_BUFFER_FINISHED;
+      break;
+    }
+
+    if (xTaskCheckForTimeOut(&timeout, &xTicksToWait) == pdTRUE) {
+      result = RING_BUFFER_TIMEOUT;
+      break;
+    }
+
+    // 書き込み側が要素を積むまで待つ
+    _ring_buffer_unlock(buffer);
+    xEventGroupWaitBits(buffer->events, RING_BUFFER_EVENT_READABLE, pdFALSE, pdFALSE, xTicksToWait);
+    _ring_buffer_lock(buffer);
+  }
+
+  if (wait) {
+    __atomic_sub_fetch(&buffer->read_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  if (result > 0) {
+    _ring_buffer_refill(buffer);
+    _ring_buffer_notify_writers(buffer);
+  }
+  _ring_buffer_unlock(buffer);
+  RING_BUFFER_STAT_LATENCY(buffer, read_latency, start);
+  RING_BUFFER_STAT_RESULT(buffer, result > 0 ? RING_BUFFER_OK : result);
+  return result;
+}
@@ -1,18 +1,489 @@
 #include "ring_buffer.h"
+#include "ring_buffer_internal.h"
 #include <memory.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
 
-void _ring_buffer_create_file(FILE *file, size_t file_size) {
-  // ファイルサイズを確認し、必要に応じて0で埋める
-  fseek(file, 0, SEEK_END);
-  size_t current_size = ftell(file);
-  if (current_size < file_size) {
-    uint8_t zero = 0;
-    for (size_t i = current_size; i < file_size; i++) {
-      fwrite(&zero, 1, 1, file);
+#if RING_BUFFER_USE_MMAP
+#include <sys/mman.h>
+#endif
+
+// ゼロ埋めに使う書き込み元 (書き換えないので RAM を使わない)
+static const uint8_t _ring_buffer_zero_page[RING_BUFFER_ZERO_PAGE_SIZE];
+
+// ファイルを size バイトまでゼロで埋める
+// 1バイトずつではなく、ゼロページ単位でまとめて書き込む
+static bool _ring_buffer_file_zero_fill(FILE *file, size_t current_size, size_t size) {
+  if (fseek(file, current_size, SEEK_SET) != 0) {
+    return false;
+  }
+  for (size_t pos = current_size; pos < size; pos += RING_BUFFER_ZERO_PAGE_SIZE) {
+    size_t chunk = size - pos < RING_BUFFER_ZERO_PAGE_SIZE ? size - pos : RING_BUFFER_ZERO_PAGE_SIZE;
+    if (fwrite(_ring_buffer_zero_page, 1, chunk, file) != chunk) {
+      return false;
+    }
+  }
+  return fflush(file) == 0;
+}
+
+// ファイルの領域をまとめて確保する
+// posix_fallocate (Linux) か ftruncate で伸ばし、VFS が対応していなければ false を返す
+static bool _ring_buffer_file_truncate(FILE *file, size_t size) {
+  if (fflush(file) != 0) {
+    return false;
+  }
+  int fd = fileno(file);
+#if CONFIG_IDF_TARGET_LINUX
+  if (posix_fallocate(fd, 0, size) == 0) {
+    return true;
+  }
+#endif
+  return ftruncate(fd, size) == 0;
+}
+
+// current_size バイトのファイルを size バイトまで、mode の方法で伸ばす関数
+bool _ring_buffer_file_extend(FILE *file, size_t current_size, size_t size, RingBufferPreallocate mode) {
+  if (mode == RING_BUFFER_PREALLOCATE_LAZY || current_size >= size) {
+    return true;
+  }
+  if (mode == RING_BUFFER_PREALLOCATE_TRUNCATE && _ring_buffer_file_truncate(file, size)) {
+    return true;
+  }
+  return _ring_buffer_file_zero_fill(file, current_size, size);
+}
+
+// ファイルをデータ領域の末尾まで事前に確保する関数
+// 既にあるデータは書き換えず、足りない部分だけを伸ばす
+// RING_BUFFER_PREALLOCATE_LAZY では何もせず、書き込み位置が進むのに合わせてファイルが伸びる
+// セグメントファイルは、作るときに1つずつ確保する
+void _ring_buffer_file_preallocate(RingBuffer *buffer, RingBufferPreallocate mode) {
+  if (buffer->file == NULL || mode == RING_BUFFER_PREALLOCATE_LAZY) {
+    return;
+  }
+
+  if (fseek(buffer->file, 0, SEEK_END) != 0) {
+    return;
+  }
+  long current_size = ftell(buffer->file);
+  buffer->file_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+  if (current_size < 0) {
+    return;
+  }
+  _ring_buffer_file_extend(buffer->file, current_size, buffer->file_offset + buffer->file_size, mode);
+}
+
+// ストリームの排他
+// 書き出しタスクはメインのミューテックスを持たずにファイルへ書き込むため、
+// 書き出しタスクの動作中はストリームと file_pos をこのロックで守る
+void _ring_buffer_file_lock(RingBuffer *buffer) {
+  if (buffer->file_lock != NULL) {
+    xSemaphoreTake(buffer->file_lock, portMAX_DELAY);
+  }
+}
+
+void _ring_buffer_file_unlock(RingBuffer *buffer) {
+  if (buffer->file_lock != NULL) {
+    xSemaphoreGive(buffer->file_lock);
+  }
+}
+
+// ストリーム位置を pos に合わせる
+// 読み書きの向きが変わらず位置も一致していれば fseek を省略する
+// (stdio では読み書きの切り替え時に fseek が必要なため、向きが変わる場合は必ずシークする)
+static bool _ring_buffer_file_seek(RingBuffer *buffer, size_t pos, int op) {
+  if (buffer->file_pos == pos && buffer->file_last_op == op) {
+    return true;
+  }
+  if (fseek(buffer->file, buffer->file_offset + pos, SEEK_SET) != 0) {
+    buffer->file_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+    return false;
+  }
+  buffer->file_pos = pos;
+  buffer->file_last_op = op;
+  return true;
+}
+
+// ファイルへの書き込みを統計に数える
+// 一部だけを書き換えるセクタも、フラッシュでは消去と書き込みが必要なので1つと数える
+static void _ring_buffer_file_count_write(RingBuffer *buffer, size_t pos, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  buffer->write_stats.written += size;
+  buffer->write_stats.sector_writes += (pos + size - 1) / buffer->sector_size - pos / buffer->sector_size + 1;
+}
+
+// ファイル上の pos から連続領域を書き込み、書き込めたバイト数を返す
+// セグメントに分ける場合は、pos を含むセグメントファイルへ書き込む
+static size_t _ring_buffer_file_pwrite(RingBuffer *buffer, size_t pos, const uint8_t *data, size_t size) {
+  size_t written;
+  if (buffer->segment_size > 0) {
+    written = _ring_buffer_segment_pwrite(buffer, pos, data, size);
+  } else {
+    if (size == 0 || !_ring_buffer_file_seek(buffer, pos, RING_BUFFER_FILE_OP_WRITE)) {
+      return 0;
+    }
+    written = fwrite(data, 1, size, buffer->file);
+    buffer->file_pos = written == size ? pos + written : RING_BUFFER_FILE_POS_UNKNOWN;
+  }
+  _ring_buffer_file_count_write(buffer, pos, written);
+  return written;
+}
+
+// ファイル上の pos から連続領域を読み込み、読み込めたバイト数を返す
+static size_t _ring_buffer_file_pread(RingBuffer *buffer, size_t pos, uint8_t *data, size_t size) {
+  if (buffer->segment_size > 0) {
+    return _ring_buffer_segment_pread(buffer, pos, data, size);
+  }
+  if (size == 0 || !_ring_buffer_file_seek(buffer, pos, RING_BUFFER_FILE_OP_READ)) {
+    return 0;
+  }
+  size_t read_count = fread(data, 1, size, buffer->file);
+  buffer->file_pos = read_count == size ? pos + read_count : RING_BUFFER_FILE_POS_UNKNOWN;
+  return read_count;
+}
+
+// セクタ単位の書き込み
+// 末尾のセクタを sector_buffer に溜め、セクタが埋まったときだけ揃った位置へセクタ全体を書き込む
+// sector_buffer には、ファイル上の [sector_pos, sector_pos + sector_fill) のデータが入っている
+// 状態はファイルのストリームと同じく _ring_buffer_file_lock で守る
+
+// セクタの終わりの位置 (ファイルの末尾で切れる)
+static size_t _ring_buffer_file_sector_end(RingBuffer *buffer) {
+  size_t end = buffer->sector_pos + buffer->sector_size;
+  return end < buffer->file_size ? end : buffer->file_size;
+}
+
+// 溜めているセクタのうち、まだファイルにない部分を書き込む
+static bool _ring_buffer_file_sector_flush(RingBuffer *buffer) {
+  if (buffer->sector_buffer == NULL || !buffer->sector_dirty) {
+    return true;
+  }
+  if (_ring_buffer_file_pwrite(buffer, buffer->sector_pos, buffer->sector_buffer, buffer->sector_fill) !=
+      buffer->sector_fill) {
+    return false;
+  }
+  buffer->sector_dirty = false;
+  return true;
+}
+
+// 書き込み位置 pos を含むセクタを溜め直す
+// pos より前のデータはファイルから読み込み、セクタ全体を書き込むときに同じ内容で書き戻す
+static bool _ring_buffer_file_sector_seek(RingBuffer *buffer, size_t pos) {
+  if (!_ring_buffer_file_sector_flush(buffer)) {
+    return false;
+  }
+  buffer->sector_pos = pos - pos % buffer->sector_size;
+  buffer->sector_fill = pos - buffer->sector_pos;
+  size_t read_count = _ring_buffer_file_pread(buffer, buffer->sector_pos, buffer->sector_buffer, buffer->sector_fill);
+  memset(buffer->sector_buffer + read_count, 0, buffer->sector_fill - read_count);
+  return true;
+}
+
+// 連続領域を溜め、埋まったセクタを書き込み、受け付けたバイト数を返す
+static size_t _ring_buffer_file_sector_write(RingBuffer *buffer, size_t pos, const uint8_t *data, size_t size) {
+  if (pos != buffer->sector_pos + buffer->sector_fill && !_ring_buffer_file_sector_seek(buffer, pos)) {
+    return 0;
+  }
+
+  size_t written = 0;
+  while (written < size) {
+    size_t end = _ring_buffer_file_sector_end(buffer);
+    size_t count = end - buffer->sector_pos - buffer->sector_fill;
+    if (count > size - written) {
+      count = size - written;
+    }
+    memcpy(buffer->sector_buffer + buffer->sector_fill, data + written, count);
+    buffer->sector_fill += count;
+    buffer->sector_dirty = true;
+    if (buffer->sector_pos + buffer->sector_fill == end) {
+      if (_ring_buffer_file_pwrite(buffer, buffer->sector_pos, buffer->sector_buffer, buffer->sector_fill) !=
+          buffer->sector_fill) {
+        // 書き込めなかった分は受け付けない
+        buffer->sector_fill -= count;
+        break;
+      }
+      buffer->sector_pos = end == buffer->file_size ? 0 : end;
+      buffer->sector_fill = 0;
+      buffer->sector_dirty = false;
+    }
+    written += count;
+  }
+  return written;
+}
+
+// 連続領域を読み込み、読み込めたバイト数を返す
+// 溜めているセクタに含まれる部分は sector_buffer からコピーする
+static size_t _ring_buffer_file_sector_read(RingBuffer *buffer, size_t pos, uint8_t *data, size_t size) {
+  size_t sector_end = buffer->sector_pos + buffer->sector_fill;
+  if (buffer->sector_fill == 0 || pos >= sector_end || pos + size <= buffer->sector_pos) {
+    return _ring_buffer_file_pread(buffer, pos, data, size);
+  }
+
+  size_t read_count = 0;
+  if (pos < buffer->sector_pos) {
+    read_count = _ring_buffer_file_pread(buffer, pos, data, buffer->sector_pos - pos);
+    if (read_count < buffer->sector_pos - pos) {
+      return read_count;
+    }
+  }
+  size_t offset = pos + read_count - buffer->sector_pos;
+  size_t count = size - read_count < buffer->sector_fill - offset ? size - read_count : buffer->sector_fill - offset;
+  memcpy(data + read_count, buffer->sector_buffer + offset, count);
+  read_count += count;
+  if (read_count < size) {
+    read_count += _ring_buffer_file_pread(buffer, pos + read_count, data + read_count, size - read_count);
+  }
+  return read_count;
+}
+
+// stdio のバッファとメモリマップをファイルへ書き出す
+static bool _ring_buffer_file_flush_data(RingBuffer *buffer) {
+  if (buffer->segment_size > 0) {
+    return _ring_buffer_file_sector_flush(buffer) && _ring_buffer_segment_flush(buffer, false);
+  }
+  bool flushed = _ring_buffer_file_sector_flush(buffer) && fflush(buffer->file) == 0;
+#if RING_BUFFER_USE_MMAP
+  if (buffer->file_map != NULL) {
+    flushed = flushed && msync(buffer->file_map - buffer->file_offset, buffer->file_offset + buffer->file_size,
+                               MS_SYNC) == 0;
+  }
+#endif
+  return flushed;
+}
+
+// stdio のバッファとメモリマップを書き出し、fsync でストレージへの反映を待つ
+// ESP-IDF の FatFs や SPIFFS では fflush だけではフラッシュに残らないので、順序を守りたい箇所ではこちらを使う
+static bool _ring_buffer_file_flush_durable(RingBuffer *buffer) {
+  return _ring_buffer_file_flush_data(buffer) && fsync(fileno(buffer->file)) == 0;
+}
+
+// ファイルをメモリマップする関数
+// マップできればメモリバッファと同じコピー処理で読み書きし、できなければ stdio のまま使う
+void _ring_buffer_file_map(RingBuffer *buffer) {
+  buffer->file_map = NULL;
+#if RING_BUFFER_USE_MMAP
+  // セクタ単位で書き込む場合は、書き込みの単位を自分で決めるためにマップしない
+  if (buffer->file == NULL || buffer->file_size == 0 || buffer->sector_buffer != NULL) {
+    return;
+  }
+  // 永続モードではヘッダ領域も含めてマップし、file_map はデータ領域の先頭を指す
+  int fd = fileno(buffer->file);
+  size_t map_size = buffer->file_offset + buffer->file_size;
+  if (fflush(buffer->file) != 0 || ftruncate(fd, map_size) != 0) {
+    return;
+  }
+  void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map != MAP_FAILED) {
+    buffer->file_map = (uint8_t *)map + buffer->file_offset;
+  }
+#endif
+}
+
+// メモリマップを解除する関数
+// 以降は stdio で読み書きする
+void _ring_buffer_file_unmap(RingBuffer *buffer) {
+#if RING_BUFFER_USE_MMAP
+  if (buffer->file_map != NULL) {
+    munmap(buffer->file_map - buffer->file_offset, buffer->file_offset + buffer->file_size);
+    buffer->file_map = NULL;
+    buffer->file_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+  }
+#else
+  (void)buffer;
+#endif
+}
+
+// ヘッダの CRC32 (IEEE 802.3)
+static uint32_t _ring_buffer_crc32(const uint8_t *data, size_t size) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
     }
-    fflush(file);
   }
-  fseek(file, 0, SEEK_SET); // ファイルポインタを先頭に戻す
+  return ~crc;
+}
+
+// ヘッダのスロット slot をファイルの先頭領域から読み書きする
+// データ領域のストリーム位置は変わるため、file_pos は不明にする
+static bool _ring_buffer_file_header_io(RingBuffer *buffer, int slot, RingBufferFileHeader *header, bool write) {
+  size_t pos = slot * RING_BUFFER_HEADER_SLOT_SIZE;
+  if (buffer->file_map != NULL) {
+    uint8_t *base = buffer->file_map - buffer->file_offset;
+    if (write) {
+      memcpy(base + pos, header, sizeof(*header));
+    } else {
+      memcpy(header, base + pos, sizeof(*header));
+    }
+    return true;
+  }
+
+  buffer->file_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+  if (fseek(buffer->file, pos, SEEK_SET) != 0) {
+    return false;
+  }
+  if (write) {
+    return fwrite(header, sizeof(*header), 1, buffer->file) == 1;
+  }
+  return fread(header, sizeof(*header), 1, buffer->file) == 1;
+}
+
+// 永続モードで、ヘッダから file_head と file_len を復元する関数
+// 2つのスロットのうち、正しく書き込まれていて sequence が新しい方を使うので、スキャンは不要
+void _ring_buffer_file_recover(RingBuffer *buffer) {
+  RingBufferFileHeader headers[2];
+  int latest = -1;
+  for (int slot = 0; slot < 2; slot++) {
+    RingBufferFileHeader *header = &headers[slot];
+    if (!_ring_buffer_file_header_io(buffer, slot, header, false) || header->magic != RING_BUFFER_HEADER_MAGIC ||
+        header->crc != _ring_buffer_crc32((const uint8_t *)header, offsetof(RingBufferFileHeader, crc)) ||
+        header->data_size != buffer->file_size || header->head >= buffer->file_size ||
+        header->len > buffer->file_size) {
+      continue;
+    }
+    if (latest < 0 || (int32_t)(header->sequence - headers[latest].sequence) > 0) {
+      latest = slot;
+    }
+  }
+
+  if (latest >= 0) {
+    buffer->file_head = headers[latest].head;
+    buffer->file_len = headers[latest].len;
+    buffer->header_sequence = headers[latest].sequence;
+    buffer->header_slot = latest;
+    // 圧縮モードでは len はファイル上のバイト数なので、展開後のバイト数はヘッダの raw_len から戻す
+    if (buffer->compress_work != NULL) {
+      buffer->file_used = headers[latest].len;
+      buffer->file_skip = headers[latest].skip;
+      buffer->file_len = headers[latest].raw_len;
+    }
+  }
+}
+
+// 永続モードで、現在の file_head と file_len をヘッダに書き込む関数
+// データを先に fsync でストレージへ出してから、古い方のスロットにヘッダを書いて fsync するので、
+// 書き込み中に電源が落ちても、もう一方のスロットから直前のチェックポイントに戻れる
+int _ring_buffer_file_checkpoint(RingBuffer *buffer) {
+  if (!buffer->persistent || buffer->file == NULL) {
+    return RING_BUFFER_OK;
+  }
+  // 圧縮モードでは、溜めているチャンクもフレームとして書き出してから記録する
+  bool compressed = buffer->compress_work != NULL;
+  if (compressed && !_ring_buffer_compress_seal(buffer)) {
+    return 0;
+  }
+
+  RingBufferFileHeader header = {
+      .magic = RING_BUFFER_HEADER_MAGIC,
+      .sequence = buffer->header_sequence + 1,
+      .data_size = buffer->file_size,
+      .head = buffer->file_head,
+      .len = compressed ? buffer->file_used : buffer->file_len,
+      .skip = compressed ? buffer->file_skip : 0,
+      .raw_len = compressed ? buffer->file_len : 0,
+  };
+  header.crc = _ring_buffer_crc32((const uint8_t *)&header, offsetof(RingBufferFileHeader, crc));
+  int slot = buffer->header_slot ^ 1;
+
+  _ring_buffer_file_lock(buffer);
+  bool written = _ring_buffer_file_flush_durable(buffer) &&
+                 _ring_buffer_file_header_io(buffer, slot, &header, true) && _ring_buffer_file_flush_durable(buffer);
+  _ring_buffer_file_unlock(buffer);
+  if (!written) {
+    return 0;
+  }
+  buffer->header_sequence = header.sequence;
+  buffer->header_slot = slot;
+  buffer->checkpoint_pending = 0;
+  return RING_BUFFER_OK;
+}
+
+// ファイルのデータが size バイト変化したことを記録し、間隔を超えたらチェックポイントを書く
+static void _ring_buffer_file_touch(RingBuffer *buffer, size_t size) {
+  if (!buffer->persistent || size == 0) {
+    return;
+  }
+  buffer->checkpoint_pending += size;
+  if (buffer->checkpoint_pending >= buffer->checkpoint_interval) {
+    _ring_buffer_file_checkpoint(buffer);
+  }
+}
+
+// ファイル上の絶対位置 pos から size バイトを読み込み、読み込めたバイト数を返す関数
+// 読み込みは折り返し位置でのみ分割し、最大2回の fread で行う
+size_t _ring_buffer_file_read_at(RingBuffer *buffer, size_t pos, uint8_t *data, size_t size) {
+  if (buffer->file_map != NULL) {
+    _ring_buffer_copy_out(buffer->file_map, buffer->file_size, pos, data, size);
+    return size;
+  }
+
+  size_t first = buffer->file_size - pos;
+  if (first > size) {
+    first = size;
+  }
+  _ring_buffer_file_lock(buffer);
+  size_t read_count = _ring_buffer_file_sector_read(buffer, pos, data, first);
+  if (read_count == first && size > first) {
+    read_count += _ring_buffer_file_sector_read(buffer, 0, data + first, size - first);
+  }
+  _ring_buffer_file_unlock(buffer);
+  return read_count;
+}
+
+// ファイル上の絶対位置 pos から size バイトを書き込み、書き込めたバイト数を返す関数
+// 書き込みは折り返し位置でのみ分割し、最大2回の fwrite で行う
+// file_len は更新しないため、確定は _ring_buffer_file_commit で行う
+size_t _ring_buffer_file_write_at(RingBuffer *buffer, size_t pos, const uint8_t *data, size_t size) {
+  if (!_ring_buffer_has_file(buffer) || size == 0) {
+    return 0;
+  }
+  if (buffer->file_map != NULL) {
+    _ring_buffer_copy_in(buffer->file_map, buffer->file_size, pos, data, size);
+    buffer->write_stats.accepted += size;
+    size_t first = buffer->file_size - pos < size ? buffer->file_size - pos : size;
+    _ring_buffer_file_count_write(buffer, pos, first);
+    _ring_buffer_file_count_write(buffer, 0, size - first);
+    return size;
+  }
+
+  _ring_buffer_file_lock(buffer);
+  size_t written;
+  if (buffer->sector_buffer != NULL) {
+    written = _ring_buffer_file_sector_write(buffer, pos, data, size);
+  } else {
+    size_t first = buffer->file_size - pos;
+    if (first > size) {
+      first = size;
+    }
+    written = _ring_buffer_file_pwrite(buffer, pos, data, first);
+    if (written == first && size > first) {
+      written += _ring_buffer_file_pwrite(buffer, 0, data + first, size - first);
+    }
+  }
+  buffer->write_stats.accepted += written;
+  _ring_buffer_file_unlock(buffer);
+  return written;
+}
+
+// ファイルへの書き込みの統計を取得する関数
+void ring_buffer_get_write_stats(RingBuffer *buffer, RingBufferWriteStats *stats) {
+  _ring_buffer_lock(buffer);
+  _ring_buffer_file_lock(buffer);
+  *stats = buffer->write_stats;
+  _ring_buffer_file_unlock(buffer);
+  _ring_buffer_unlock(buffer);
+}
+
+// ファイル末尾に書き込み済みの size バイトをデータとして確定する関数
+// file_len はロックなしで参照されるため、解放順序で更新する
+void _ring_buffer_file_commit(RingBuffer *buffer, size_t size) {
+  __atomic_store_n(&buffer->file_len, buffer->file_len + size, __ATOMIC_RELEASE);
+  _ring_buffer_file_touch(buffer, size);
+  RING_BUFFER_STAT_ADD(buffer, file_in, size);
+  RING_BUFFER_STAT_MAX(buffer, file_high_water, buffer->file_len);
 }
 
 // ファイルの書き込み関数
@@ -23,39 +494,154 @@ int _ring_buffer_file_write(RingBuffer *buffer, const uint8_t *data, size_t size
   if (buffer->cancelled) {
     return RING_BUFFER_CANCELED;
   }
+  if (!_ring_buffer_has_file(buffer)) {
+    return size == 0 ? RING_BUFFER_OK : 0;
+  }
 
   size_t written = 0;
-  for (size_t i = 0; i < size; ++i) {
-    if (buffer->file_len >= buffer->file_size) {
-      // メモリがいっぱいの場合
-      return written; // 書き込んだバイト数を返す
+  if (buffer->compress_work != NULL) {
+    // 圧縮して書き出すたびに空きが増えるので、空きがなくなるまで繰り返す
+    size_t count;
+    while (written < size && (count = _ring_buffer_file_space(buffer)) > 0) {
+      count = _ring_buffer_compress_write(buffer, data + written, count < size - written ? count : size - written);
+      if (count == 0) {
+        break;
+      }
+      written += count;
+      _ring_buffer_file_touch(buffer, count);
+      RING_BUFFER_STAT_ADD(buffer, file_in, count);
+      RING_BUFFER_STAT_MAX(buffer, file_high_water, buffer->file_len);
     }
-    size_t pos = (buffer->file_head + buffer->file_len) % buffer->file_size;
-    fseek(buffer->file, pos, SEEK_SET);
-    fwrite(&data[i], 1, 1, buffer->file);
-    buffer->file_len++;
-    written++;
+  } else {
+    size_t space = _ring_buffer_file_space(buffer);
+    size_t count = size < space ? size : space;
+    size_t tail = _ring_buffer_wrap(buffer->file_head + buffer->file_len, buffer->file_size, 0);
+    written = _ring_buffer_file_write_at(buffer, tail, data, count);
+    _ring_buffer_file_commit(buffer, written);
   }
 
+  if (written < size) {
+    // ファイルがいっぱい、または書き込みエラーの場合
+    return written; // 書き込んだバイト数を返す
+  }
   return RING_BUFFER_OK;
 }
 
+// ファイルの先頭から offset バイト目以降を、消費せずに読み込む関数
+size_t _ring_buffer_file_peek(RingBuffer *buffer, size_t offset, uint8_t *data, size_t size) {
+  if (!_ring_buffer_has_file(buffer) || offset >= buffer->file_len) {
+    return 0;
+  }
+
+  size_t count = buffer->file_len - offset;
+  if (count > size) {
+    count = size;
+  }
+  if (buffer->compress_work != NULL) {
+    return _ring_buffer_compress_peek(buffer, offset, data, count);
+  }
+  size_t pos = _ring_buffer_wrap(buffer->file_head + offset, buffer->file_size, 0);
+  return _ring_buffer_file_read_at(buffer, pos, data, count);
+}
+
+// ファイルの先頭から size バイトを捨てる関数
+// file_len はロックなしで参照されるため、解放順序で更新する
+void _ring_buffer_file_consume(RingBuffer *buffer, size_t size) {
+  RING_BUFFER_STAT_ADD(buffer, file_out, size);
+  if (buffer->compress_work != NULL) {
+    _ring_buffer_compress_consume(buffer, size);
+    _ring_buffer_file_touch(buffer, size);
+    return;
+  }
+  size_t head = buffer->file_head;
+  buffer->file_head = _ring_buffer_wrap(buffer->file_head + size, buffer->file_size, 0);
+  __atomic_store_n(&buffer->file_len, buffer->file_len - size, __ATOMIC_RELEASE);
+  _ring_buffer_file_touch(buffer, size);
+  // 読み終えたセグメントはファイルごと消すか、使い回すために残す
+  if (buffer->segment_size > 0) {
+    _ring_buffer_segment_release(buffer, head, size);
+  }
+}
+
 // ファイルの読み込み関数
 int _ring_buffer_file_read(RingBuffer *buffer, uint8_t *data, size_t size) {
   if (buffer->cancelled) {
     return RING_BUFFER_CANCELED;
   }
 
-  size_t read_count = 0;
-  while (read_count < size && buffer->file_len > 0) {
-    fseek(buffer->file, buffer->file_head, SEEK_SET);
-    size_t fread_size = fread(&data[read_count++], 1, 1, buffer->file);
-    if (fread_size != 1) {
-      return RING_BUFFER_CANCELED;
-    }
-    buffer->file_head = (buffer->file_head + 1) % buffer->file_size;
-    buffer->file_len--;
+  // 読み込みエラー時は読み込めた分だけ進める
+  size_t read_count = _ring_buffer_file_peek(buffer, 0, data, size);
+  _ring_buffer_file_consume(buffer, read_count);
+  return read_count;
+}
+
+// ファイルに積んであるデータサイズを取得する関数
+size_t _ring_buffer_file_usage(RingBuffer *buffer) { return buffer->file_len; }
+
+// ファイルに書き込める残りのバイト数を取得する関数
+size_t _ring_buffer_file_space(RingBuffer *buffer) {
+  if (buffer->segment_size > 0) {
+    return _ring_buffer_segment_space(buffer);
+  }
+  if (buffer->file == NULL) {
+    return 0;
+  }
+  if (buffer->compress_work != NULL) {
+    return _ring_buffer_compress_space(buffer);
   }
+  return buffer->file_size - buffer->file_len;
+}
 
-  return read_count;
+// ファイルに置けるデータの最大バイト数を取得する関数
+// セグメントに分ける場合は、同時にファイルを置けるセグメントの分まで
+size_t _ring_buffer_file_capacity(RingBuffer *buffer) {
+  if (buffer->segment_size > 0) {
+    return buffer->segment_limit * buffer->segment_size;
+  }
+  return buffer->file != NULL ? buffer->file_size : 0;
+}
+
+// stdio のバッファとメモリマップを書き出し、ストレージへの反映を待つ関数
+int _ring_buffer_file_sync(RingBuffer *buffer) {
+  if (buffer->segment_size > 0) {
+    _ring_buffer_file_lock(buffer);
+    bool synced = _ring_buffer_file_sector_flush(buffer) && _ring_buffer_segment_flush(buffer, true);
+    _ring_buffer_file_unlock(buffer);
+    return synced ? RING_BUFFER_OK : 0;
+  }
+  if (buffer->file == NULL) {
+    return RING_BUFFER_OK;
+  }
+
+  if (buffer->compress_work != NULL && !_ring_buffer_compress_seal(buffer)) {
+    return 0;
+  }
+  _ring_buffer_file_lock(buffer);
+  bool synced = _ring_buffer_file_flush_durable(buffer);
+  _ring_buffer_file_unlock(buffer);
+  return synced ? RING_BUFFER_OK : 0;
+}
+
+// ファイルを階層の最後に置くための操作 (ctx は RingBuffer)
+static size_t _ring_buffer_file_tier_write(void *ctx, const uint8_t *data, size_t size) {
+  int result = _ring_buffer_file_write((RingBuffer *)ctx, data, size);
+  return result == RING_BUFFER_OK ? size : result > 0 ? (size_t)result : 0;
+}
+
+static size_t _ring_buffer_file_tier_peek(void *ctx, size_t offset, uint8_t *data, size_t size) {
+  return _ring_buffer_file_peek((RingBuffer *)ctx, offset, data, size);
 }
+
+static void _ring_buffer_file_tier_consume(void *ctx, size_t size) { _ring_buffer_file_consume((RingBuffer *)ctx, size); }
+
+static size_t _ring_buffer_file_tier_usage(void *ctx) { return ((RingBuffer *)ctx)->file_len; }
+
+static size_t _ring_buffer_file_tier_space(void *ctx) { return _ring_buffer_file_space((RingBuffer *)ctx); }
+
+const RingBufferTierOps _ring_buffer_file_tier_ops = {
+    .write = _ring_buffer_file_tier_write,
+    .peek = _ring_buffer_file_tier_peek,
+    .consume = _ring_buffer_file_tier_consume,
+    .usage = _ring_buffer_file_tier_usage,
+    .space = _ring_buffer_file_tier_space,
+};
@@ -1,7 +1,10 @@
 #include "ring_buffer.h"
+#include "ring_buffer_internal.h"
 #include <memory.h>
 
 // メモリの書き込み関数
+// memory_tail は書き込み側、memory_head は読み込み側だけが更新し、memory_len はアトミックに増減する
+// そのため SPSC モードでは、書き込み側と読み込み側がロックなしで同時に呼び出せる
 int _ring_buffer_mem_write(RingBuffer *buffer, const uint8_t *data, size_t size) {
   if (buffer->write_finished) {
     return RING_BUFFER_FINISHED;
@@ -10,33 +13,129 @@ int _ring_buffer_mem_write(RingBuffer *buffer, const uint8_t *data, size_t size)
     return RING_BUFFER_CANCELED;
   }
 
-  size_t written = 0;
-  for (size_t i = 0; i < size; ++i) {
-    if (buffer->memory_len >= buffer->memory_size) {
-      // メモリがいっぱいの場合
-      return written; // 書き込んだバイト数を返す
-    }
-    size_t pos = (buffer->memory_head + buffer->memory_len) % buffer->memory_size;
-    buffer->memory_buffer[pos] = data[i];
-    buffer->memory_len++;
-    written++;
+  size_t space = buffer->memory_size - __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE);
+  size_t written = size < space ? size : space;
+  if (written > 0) {
+    _ring_buffer_copy_in(buffer->memory_buffer, buffer->memory_size, buffer->memory_tail, data, written);
+    _ring_buffer_mem_commit(buffer, written);
   }
 
+  if (written < size) {
+    // メモリがいっぱいの場合
+    return written; // 書き込んだバイト数を返す
+  }
   return RING_BUFFER_OK;
 }
 
+// memory_tail から始まる空き領域を最大 size バイト分、最大2つの連続領域として返す関数
+size_t _ring_buffer_mem_free_spans(RingBuffer *buffer, size_t size, RingBufferSpan spans[2]) {
+  size_t space = buffer->memory_size - __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE);
+  return _ring_buffer_spans(buffer->memory_buffer, buffer->memory_size, buffer->memory_tail,
+                            size < space ? size : space, spans);
+}
+
+// memory_tail に書き込み済みの size バイトをデータとして確定する関数
+void _ring_buffer_mem_commit(RingBuffer *buffer, size_t size) {
+  buffer->memory_tail = _ring_buffer_wrap(buffer->memory_tail + size, buffer->memory_size, buffer->memory_mask);
+  __atomic_fetch_add(&buffer->memory_len, size, __ATOMIC_RELEASE);
+  RING_BUFFER_STAT_ADD(buffer, memory_in, size);
+  RING_BUFFER_STAT_MAX(buffer, memory_high_water, __atomic_load_n(&buffer->memory_len, __ATOMIC_RELAXED));
+}
+
 // メモリの読み込み関数
 int _ring_buffer_mem_read(RingBuffer *buffer, uint8_t *data, size_t size) {
   if (buffer->cancelled) {
     return RING_BUFFER_CANCELED;
   }
 
-  size_t read_count = 0;
-  while (read_count < size && buffer->memory_len > 0) {
-    data[read_count++] = buffer->memory_buffer[buffer->memory_head];
-    buffer->memory_head = (buffer->memory_head + 1) % buffer->memory_size;
-    buffer->memory_len--;
+  size_t len = __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE);
+  size_t read_count = size < len ? size : len;
+  if (read_count > 0) {
+    _ring_buffer_copy_out(buffer->memory_buffer, buffer->memory_size, buffer->memory_head, data, read_count);
+    _ring_buffer_mem_consume(buffer, read_count);
   }
 
   return read_count;
 }
+
+// memory_head から offset バイト目以降を、消費せずに最大 size バイト読み込む関数
+size_t _ring_buffer_mem_peek(RingBuffer *buffer, size_t offset, uint8_t *data, size_t size) {
+  size_t len = __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE);
+  if (offset >= len) {
+    return 0;
+  }
+  size_t count = len - offset < size ? len - offset : size;
+  size_t pos = _ring_buffer_wrap(buffer->memory_head + offset, buffer->memory_size, buffer->memory_mask);
+  _ring_buffer_copy_out(buffer->memory_buffer, buffer->memory_size, pos, data, count);
+  return count;
+}
+
+// memory_head から始まるデータを最大 size バイト分、最大2つの連続領域として返す関数
+size_t _ring_buffer_mem_data_spans(RingBuffer *buffer, size_t size, RingBufferSpan spans[2]) {
+  size_t len = __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE);
+  return _ring_buffer_spans(buffer->memory_buffer, buffer->memory_size, buffer->memory_head, size < len ? size : len,
+                            spans);
+}
+
+// memory_head から size バイトを捨てる関数
+void _ring_buffer_mem_consume(RingBuffer *buffer, size_t size) {
+  buffer->memory_head = _ring_buffer_wrap(buffer->memory_head + size, buffer->memory_size, buffer->memory_mask);
+  __atomic_fetch_sub(&buffer->memory_len, size, __ATOMIC_RELEASE);
+  RING_BUFFER_STAT_ADD(buffer, memory_out, size);
+}
+
+// メモリに積んであるデータサイズを取得する関数
+size_t _ring_buffer_mem_usage(RingBuffer *buffer) {
+  return __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE);
+}
+
+// RAM のリングバッファを使う階層
+// メインのメモリバッファと同じコピー処理で読み書きする
+static size_t _ring_buffer_memory_tier_write(void *ctx, const uint8_t *data, size_t size) {
+  RingBufferMemoryTier *tier = (RingBufferMemoryTier *)ctx;
+  size_t count = tier->size - tier->len < size ? tier->size - tier->len : size;
+  if (count > 0) {
+    size_t tail = _ring_buffer_wrap(tier->head + tier->len, tier->size, 0);
+    _ring_buffer_copy_in(tier->memory, tier->size, tail, data, count);
+    tier->len += count;
+  }
+  return count;
+}
+
+static size_t _ring_buffer_memory_tier_peek(void *ctx, size_t offset, uint8_t *data, size_t size) {
+  RingBufferMemoryTier *tier = (RingBufferMemoryTier *)ctx;
+  if (offset >= tier->len) {
+    return 0;
+  }
+  size_t count = tier->len - offset < size ? tier->len - offset : size;
+  size_t pos = _ring_buffer_wrap(tier->head + offset, tier->size, 0);
+  _ring_buffer_copy_out(tier->memory, tier->size, pos, data, count);
+  return count;
+}
+
+static void _ring_buffer_memory_tier_consume(void *ctx, size_t size) {
+  RingBufferMemoryTier *tier = (RingBufferMemoryTier *)ctx;
+  tier->head = _ring_buffer_wrap(tier->head + size, tier->size, 0);
+  tier->len -= size;
+}
+
+static size_t _ring_buffer_memory_tier_usage(void *ctx) { return ((RingBufferMemoryTier *)ctx)->len; }
+
+static size_t _ring_buffer_memory_tier_space(void *ctx) {
+  RingBufferMemoryTier *tier = (RingBufferMemoryTier *)ctx;
+  return tier->size - tier->len;
+}
+
+static const RingBufferTierOps _ring_buffer_memory_tier_ops = {
+    .write = _ring_buffer_memory_tier_write,
+    .peek = _ring_buffer_memory_tier_peek,
+    .consume = _ring_buffer_memory_tier_consume,
+    .usage = _ring_buffer_memory_tier_usage,
+    .space = _ring_buffer_memory_tier_space,
+};
+
+// RAM のリングバッファを使う階層を初期化する関数
+RingBufferTier ring_buffer_memory_tier_init(RingBufferMemoryTier *tier, uint8_t *memory, size_t size) {
+  *tier = (RingBufferMemoryTier){.memory = memory, .size = size, .head = 0, .len = 0};
+  return (RingBufferTier){.ops = &_ring_buffer_memory_tier_ops, .ctx = tier};
+}
@@ -0,0 +1,136 @@
+#include "ring_buffer.h"
+#include "ring_buffer_internal.h"
+
+#include <freertos/task.h>
+
+// メッセージの長さを LEB128 形式の可変長整数で書き込み、バイト数を返す
+static size_t _ring_buffer_msg_encode(uint8_t header[RING_BUFFER_MSG_HEADER_MAX], size_t size) {
+  size_t count = 0;
+  while (size >= 0x80) {
+    header[count++] = (uint8_t)(size | 0x80);
+    size >>= 7;
+  }
+  header[count++] = (uint8_t)size;
+  return count;
+}
+
+// 先頭のメッセージのヘッダを読み、ヘッダのバイト数を返す
+// メッセージ全体がまだ揃っていない場合は 0 を、ヘッダが不正な場合は RING_BUFFER_MSG_TOO_LARGE を返す
+static int _ring_buffer_msg_decode(RingBuffer *buffer, size_t offset, size_t available, size_t *size) {
+  uint8_t header[RING_BUFFER_MSG_HEADER_MAX];
+  size_t count = _ring_buffer_peek(buffer, offset, header, sizeof(header));
+  size_t value = 0;
+  for (size_t i = 0; i < count; i++) {
+    value |= (size_t)(header[i] & 0x7F) << (7 * i);
+    if ((header[i] & 0x80) == 0) {
+      *size = value;
+      return available - i - 1 >= value ? (int)(i + 1) : 0;
+    }
+  }
+  return count == sizeof(header) ? RING_BUFFER_MSG_TOO_LARGE : 0;
+}
+
+// ロックを保持した状態で、まとまったメッセージを最大 max_msgs 個読み込み、読み込んだ個数を返す
+// data には、メッセージを先頭から詰めて格納し、各メッセージの長さを lengths に格納する
+static int _ring_buffer_read_msgs_locked(RingBuffer *buffer, uint8_t *data, size_t size, size_t *lengths,
+                                         size_t max_msgs) {
+  size_t available = _ring_buffer_mem_usage(buffer) + buffer->tier_len + buffer->file_len + buffer->staging_len;
+  size_t offset = 0;
+  size_t used = 0;
+  size_t count = 0;
+  int result = 0;
+  while (count < max_msgs) {
+    size_t length;
+    int header = _ring_buffer_msg_decode(buffer, offset, available - offset, &length);
+    if (header <= 0 || length > size - used) {
+      // 先頭のメッセージが入りきらない場合だけ、エラーとして返す
+      if (count == 0 && header != 0) {
+        result = RING_BUFFER_MSG_TOO_LARGE;
+      }
+      break;
+    }
+    if (_ring_buffer_peek(buffer, offset + header, data + used, length) != length) {
+      break;
+    }
+    lengths[count++] = length;
+    offset += header + length;
+    used += length;
+  }
+
+  _ring_buffer_discard(buffer, offset);
+  return count > 0 ? (int)count : result;
+}
+
+// メッセージの書き込み関数
+int ring_buffer_write_msg(RingBuffer *buffer, const void *data, size_t size) {
+  if (size > RING_BUFFER_MSG_SIZE_MAX) {
+    return RING_BUFFER_MSG_TOO_LARGE;
+  }
+  uint8_t header[RING_BUFFER_MSG_HEADER_MAX];
+  RingBufferVec vec[] = {{header, _ring_buffer_msg_encode(header, size)}, {(void *)data, size}};
+  return ring_buffer_writev(buffer, vec, 2);
+}
+
+// メッセージの読み込み関数
+int ring_buffer_read_msg(RingBuffer *buffer, void *data, size_t size, TickType_t xTicksToWait) {
+  size_t length;
+  int result = ring_buffer_read_msgs(buffer, data, size, &length, 1, xTicksToWait);
+  return result > 0 ? (int)length : result;
+}
+
+// 複数のメッセージをまとめて読み込む関数
+int ring_buffer_read_msgs(RingBuffer *buffer, void *data, size_t size, size_t *lengths, size_t max_msgs,
+                          TickType_t xTicksToWait) {
+  RING_BUFFER_STAT_START(start);
+  bool wait = xTicksToWait != 0;
+  TimeOut_t timeout;
+  vTaskSetTimeOutState(&timeout);
+  _ring_buffer_lock(buffer);
+  if (wait) {
+    __atomic_add_fetch(&buffer->read_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+  int result;
+  while (true) {
+    if (buffer->cancelled) {
+      result = RING_BUFFER_CANCELED;
+      break;
+    }
+
+    if (wait) {
+      xEventGroupClearBits(buffer->events, RING_BUFFER_EVENT_DATA);
+    }
+    result = _ring_buffer_read_msgs_locked(buffer, (uint8_t *)data, size, lengths, max_msgs);
+    if (result != 0) {
+      break;
+    }
+
+    // メッセージはまとめて書き込まれるので、書き込みが終了していれば残りはない
+    if (buffer->write_finished) {
+      result = RING_BUFFER_FINISHED;
+      break;
+    }
+
+    if (xTaskCheckForTimeOut(&timeout, &xTicksToWait) == pdTRUE) {
+      result = RING_BUFFER_TIMEOUT;
+      break;
+    }
+
+    // 書き込み側がメッセージを積むまで待つ
+    _ring_buffer_unlock(buffer);
+    xEventGroupWaitBits(buffer->events, RING_BUFFER_EVENT_READABLE, pdFALSE, pdFALSE, xTicksToWait);
+    _ring_buffer_lock(buffer);
+  }
+
+  if (wait) {
+    __atomic_sub_fetch(&buffer->read_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  if (result > 0) {
+    _ring_buffer_refill(buffer);
+    _ring_buffer_notify_writers(buffer);
+  }
+  _ring_buffer_unlock(buffer);
+  RING_BUFFER_STAT_LATENCY(buffer, read_latency, start);
+  RING_BUFFER_STAT_RESULT(buffer, result);
+  return result;
+}
@@ -0,0 +1,194 @@
+#include "ring_buffer.h"
+#include "ring_buffer_internal.h"
+
+#include <freertos/task.h>
+
+// ロックを保持した状態で、待っても全体が入りきらないかを返す
+// 圧縮モードではファイルに入るバイト数がデータ次第なので判断しない
+static bool _ring_buffer_exceeds_capacity(RingBuffer *buffer, size_t size) {
+  if (buffer->compress_work != NULL) {
+    return false;
+  }
+  size_t file_size = _ring_buffer_file_capacity(buffer);
+  // 書き出しタスクがある場合、ファイルへはステージングを経由するので、1回に書き込めるのはステージングの分まで
+  if (buffer->spill_task != NULL && buffer->staging_size < file_size) {
+    file_size = buffer->staging_size;
+  }
+  return size > buffer->memory_size + _ring_buffer_tiers_capacity(buffer) + file_size;
+}
+
+// 全体が入りきるまで待ってから書き込む (RING_BUFFER_OVERFLOW_REJECT / RING_BUFFER_OVERFLOW_BLOCK)
+// 時間内に入りきらなければ何も書き込まない
+int _ring_buffer_write_whole(RingBuffer *buffer, const uint8_t *data, size_t size, TickType_t xTicksToWait,
+                             RingBufferWriteReport *report) {
+  bool wait = xTicksToWait != 0 || buffer->spill_task != NULL;
+  TimeOut_t timeout;
+  vTaskSetTimeOutState(&timeout);
+  _ring_buffer_lock(buffer);
+  if (wait) {
+    __atomic_add_fetch(&buffer->write_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+  int result;
+  while (true) {
+    if (buffer->cancelled) {
+      result = RING_BUFFER_CANCELED;
+      break;
+    }
+
+    if (buffer->write_finished) {
+      result = RING_BUFFER_FINISHED;
+      break;
+    }
+
+    if (_ring_buffer_exceeds_capacity(buffer, size)) {
+      result = RING_BUFFER_OVERFLOW;
+      break;
+    }
+
+    if (buffer->reader_count > 0) {
+      _ring_buffer_readers_make_room(buffer, size);
+    }
+    if (wait) {
+      xEventGroupClearBits(buffer->events, RING_BUFFER_EVENT_SPACE);
+    }
+    if (_ring_buffer_writable_space(buffer) >= size) {
+      report->accepted = _ring_buffer_write_locked(buffer, data, size);
+      if (report->accepted > 0) {
+        _ring_buffer_notify_readers(buffer);
+      }
+      // 空きを確かめてから書き込むので、足りないのはファイルの書き込みエラーの場合だけ
+      result = report->accepted == size ? RING_BUFFER_OK : RING_BUFFER_OVERFLOW;
+      break;
+    }
+
+    // 全体はファイルに入るがステージングに入りきらない場合は、書き出しタスクが空きを作るまで待つ
+    bool spilling = _ring_buffer_free_space(buffer) >= size && buffer->spill_task != NULL;
+    if (spilling) {
+      xTaskNotifyGive(buffer->spill_task);
+    } else if (xTaskCheckForTimeOut(&timeout, &xTicksToWait) == pdTRUE) {
+      result = buffer->overflow_policy == RING_BUFFER_OVERFLOW_BLOCK ? RING_BUFFER_TIMEOUT : RING_BUFFER_OVERFLOW;
+      break;
+    }
+
+    // 読み込み側か書き出しタスクが空きを作るまで待つ
+    _ring_buffer_unlock(buffer);
+    xEventGroupWaitBits(buffer->events, RING_BUFFER_EVENT_WRITABLE, pdFALSE, pdFALSE,
+                        spilling ? portMAX_DELAY : xTicksToWait);
+    _ring_buffer_lock(buffer);
+  }
+
+  if (wait) {
+    __atomic_sub_fetch(&buffer->write_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  _ring_buffer_unlock(buffer);
+  return result;
+}
+
+// 書き込み先より前に積まれていて、捨てても書き込める空きが増えないバイト数を返す
+// 後ろの階層にデータがある間は、メモリと書き込みを始める階層より前の階層がこれにあたる
+static size_t _ring_buffer_stranded(RingBuffer *buffer) {
+  if (_ring_buffer_spilled(buffer) == 0) {
+    return 0;
+  }
+  return __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE) + _ring_buffer_tiers_stranded(buffer);
+}
+
+// いちばん古いデータを捨てて空きを作ってから書き込む (RING_BUFFER_OVERFLOW_DROP_OLDEST)
+// 捨てるときはデータを読まずに、メモリ、ファイル、ステージングの先頭を進めるだけにする
+// 捨てるのは、末尾に書き込める空き (_ring_buffer_free_space) に足りない分と、その前にある書き込み先でない階層の分
+// 後ろの階層にデータがある間はメモリや前の階層に書き込めないので、繰り上げはせず、それらも合わせて捨てる
+// 全体がバッファに入りきらない場合は、書き込むデータの末尾の入る分だけを残す
+int _ring_buffer_write_drop_oldest(RingBuffer *buffer, const uint8_t *data, size_t size,
+                                   RingBufferWriteReport *report) {
+  // 書き出しタスクがある場合は、ステージングが空くのを待つことがある
+  bool wait = buffer->spill_task != NULL;
+  _ring_buffer_lock(buffer);
+  if (wait) {
+    __atomic_add_fetch(&buffer->write_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+  int result;
+  size_t skip = 0;
+  size_t dropped = 0;
+  while (true) {
+    if (buffer->cancelled) {
+      result = RING_BUFFER_CANCELED;
+      break;
+    }
+
+    if (buffer->write_finished) {
+      result = RING_BUFFER_FINISHED;
+      break;
+    }
+
+    size_t remaining = size - skip - report->accepted;
+    size_t space;
+    size_t stored;
+    while ((space = _ring_buffer_free_space(buffer)) < remaining && (stored = _ring_buffer_stored(buffer)) > 0) {
+      size_t count = remaining - space + _ring_buffer_stranded(buffer);
+      if (count > stored) {
+        count = stored;
+      }
+      _ring_buffer_discard(buffer, count);
+      if (buffer->reader_count > 0) {
+        _ring_buffer_readers_drop(buffer, count);
+      }
+      dropped += count;
+    }
+    if (space < remaining) {
+      skip += remaining - space;
+      remaining = space;
+    }
+
+    if (wait) {
+      xEventGroupClearBits(buffer->events, RING_BUFFER_EVENT_SPACE);
+    }
+    size_t count = _ring_buffer_write_locked(buffer, data + skip + report->accepted, remaining);
+    report->accepted += count;
+    if (count > 0) {
+      _ring_buffer_notify_readers(buffer);
+    }
+    if (count == remaining) {
+      result = RING_BUFFER_OK;
+      break;
+    }
+
+    // 空きはあるのにステージングがいっぱいの場合は、捨てずに書き出しタスクが空きを作るのを待つ
+    if (!wait || _ring_buffer_free_space(buffer) == 0) {
+      result = RING_BUFFER_OVERFLOW; // ファイルの書き込みエラー
+      break;
+    }
+    xTaskNotifyGive(buffer->spill_task);
+    _ring_buffer_unlock(buffer);
+    xEventGroupWaitBits(buffer->events, RING_BUFFER_EVENT_WRITABLE, pdFALSE, pdFALSE, portMAX_DELAY);
+    _ring_buffer_lock(buffer);
+  }
+
+  if (dropped > 0) {
+    _ring_buffer_notify_writers(buffer);
+  }
+  if (wait) {
+    __atomic_sub_fetch(&buffer->write_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  _ring_buffer_unlock(buffer);
+  report->dropped += dropped + skip;
+  return result;
+}
+
+// オーバーフロー時の方針の設定関数
+void ring_buffer_set_overflow_policy(RingBuffer *buffer, RingBufferOverflowPolicy policy, TickType_t block_ticks) {
+  _ring_buffer_lock(buffer);
+  buffer->overflow_policy = policy;
+  buffer->overflow_block_ticks = block_ticks;
+  _ring_buffer_unlock(buffer);
+}
+
+// 書き込みの受け付けの統計を取得する関数
+void ring_buffer_get_overflow_stats(RingBuffer *buffer, RingBufferOverflowStats *stats) {
+  _ring_buffer_lock(buffer);
+  stats->accepted = __atomic_load_n(&buffer->overflow_stats.accepted, __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n(&buffer->overflow_stats.dropped, __ATOMIC_RELAXED);
+  stats->rejected = __atomic_load_n(&buffer->overflow_stats.rejected, __ATOMIC_RELAXED);
+  _ring_buffer_unlock(buffer);
+}
@@ -0,0 +1,195 @@
+#include "ring_buffer.h"
+#include "ring_buffer_internal.h"
+
+#include <freertos/task.h>
+
+// 読み込みカーソルが有効かを返す
+static bool _ring_buffer_reader_valid(RingBuffer *buffer, int reader) {
+  return reader >= 0 && reader < RING_BUFFER_READERS_MAX && buffer->readers[reader].attached;
+}
+
+// ロックを保持した状態で、いちばん遅いカーソルの位置までデータを捨てる
+// 切り離されたカーソルは数えない。捨てた場合は true を返す
+static bool _ring_buffer_readers_reclaim(RingBuffer *buffer) {
+  uint64_t slowest = buffer->stream_head + _ring_buffer_stored(buffer);
+  for (int i = 0; i < RING_BUFFER_READERS_MAX; i++) {
+    RingBufferReader *reader = &buffer->readers[i];
+    if (reader->attached && !reader->detached && reader->position < slowest) {
+      slowest = reader->position;
+    }
+  }
+  if (slowest == buffer->stream_head) {
+    return false;
+  }
+
+  _ring_buffer_discard(buffer, (size_t)(slowest - buffer->stream_head));
+  buffer->stream_head = slowest;
+  _ring_buffer_refill(buffer);
+  return true;
+}
+
+// ロックを保持した状態で、size バイト書き込めるように遅れているカーソルを方針に従って進める
+// RING_BUFFER_READER_BLOCK のカーソルが先頭にいる場合は空きを作らない
+void _ring_buffer_readers_make_room(RingBuffer *buffer, size_t size) {
+  size_t space = _ring_buffer_free_space(buffer);
+  while (space < size) {
+    size_t stored = _ring_buffer_stored(buffer);
+    size_t shortage = size - space < stored ? size - space : stored;
+    uint64_t target = buffer->stream_head + shortage;
+    for (int i = 0; i < RING_BUFFER_READERS_MAX; i++) {
+      RingBufferReader *reader = &buffer->readers[i];
+      if (!reader->attached || reader->detached || reader->position >= target) {
+        continue;
+      }
+      if (reader->policy == RING_BUFFER_READER_SKIP) {
+        reader->skipped += target - reader->position;
+        reader->position = target;
+      } else if (reader->policy == RING_BUFFER_READER_DETACH) {
+        reader->detached = true;
+      }
+    }
+    // 先頭が進まなければ、これ以上は空きを作れない
+    if (!_ring_buffer_readers_reclaim(buffer)) {
+      break;
+    }
+    space = _ring_buffer_free_space(buffer);
+  }
+}
+
+// ロックを保持した状態で、先頭から size バイトを捨てた分だけ起点とカーソルを進める
+// カーソルがまだ読んでいなかった分は、読み飛ばしたバイト数に数える
+void _ring_buffer_readers_drop(RingBuffer *buffer, size_t size) {
+  buffer->stream_head += size;
+  for (int i = 0; i < RING_BUFFER_READERS_MAX; i++) {
+    RingBufferReader *reader = &buffer->readers[i];
+    if (reader->attached && reader->position < buffer->stream_head) {
+      reader->skipped += buffer->stream_head - reader->position;
+      reader->position = buffer->stream_head;
+    }
+  }
+}
+
+// 読み込みカーソルの登録関数
+int ring_buffer_add_reader(RingBuffer *buffer, RingBufferReaderPolicy policy) {
+  _ring_buffer_lock(buffer);
+  // 最初のカーソルを登録する時点の先頭を、位置の起点にする
+  if (buffer->reader_count == 0) {
+    buffer->stream_head = 0;
+  }
+
+  int id = -1;
+  for (int i = 0; i < RING_BUFFER_READERS_MAX; i++) {
+    RingBufferReader *reader = &buffer->readers[i];
+    if (!reader->attached) {
+      reader->attached = true;
+      reader->detached = false;
+      reader->policy = policy;
+      reader->position = buffer->stream_head;
+      reader->skipped = 0;
+      buffer->reader_count++;
+      id = i;
+      break;
+    }
+  }
+  _ring_buffer_unlock(buffer);
+  return id;
+}
+
+// 読み込みカーソルの削除関数
+// 残りのカーソルがまだ読んでいないデータだけを残す
+void ring_buffer_remove_reader(RingBuffer *buffer, int reader) {
+  _ring_buffer_lock(buffer);
+  if (_ring_buffer_reader_valid(buffer, reader)) {
+    buffer->readers[reader].attached = false;
+    buffer->reader_count--;
+    if (buffer->reader_count > 0 && _ring_buffer_readers_reclaim(buffer)) {
+      _ring_buffer_notify_writers(buffer);
+    }
+  }
+  _ring_buffer_unlock(buffer);
+}
+
+// 読み込みカーソルが読み飛ばしたバイト数を返す関数
+uint64_t ring_buffer_reader_skipped(RingBuffer *buffer, int reader) {
+  _ring_buffer_lock(buffer);
+  uint64_t skipped = _ring_buffer_reader_valid(buffer, reader) ? buffer->readers[reader].skipped : 0;
+  _ring_buffer_unlock(buffer);
+  return skipped;
+}
+
+// 読み込みカーソルからの読み込み関数
+// データは捨てずに読み、すべてのカーソルが読み終えた分だけを捨てる
+int ring_buffer_reader_read(RingBuffer *buffer, int reader, uint8_t *data, size_t size, TickType_t xTicksToWait) {
+  RING_BUFFER_STAT_START(start);
+  bool wait = xTicksToWait != 0;
+  TimeOut_t timeout;
+  vTaskSetTimeOutState(&timeout);
+  _ring_buffer_lock(buffer);
+  if (!_ring_buffer_reader_valid(buffer, reader)) {
+    _ring_buffer_unlock(buffer);
+    return RING_BUFFER_DETACHED;
+  }
+  RingBufferReader *cursor = &buffer->readers[reader];
+  if (wait) {
+    __atomic_add_fetch(&buffer->read_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+  int result;
+  size_t read_count = 0;
+  bool reclaimed = false;
+  while (true) {
+    if (buffer->cancelled) {
+      result = RING_BUFFER_CANCELED;
+      break;
+    }
+
+    // 遅れて切り離された場合は、読み込めた分を返し、次の呼び出しで RING_BUFFER_DETACHED を返す
+    if (cursor->detached) {
+      result = read_count > 0 ? (int)read_count : RING_BUFFER_DETACHED;
+      break;
+    }
+
+    if (wait) {
+      xEventGroupClearBits(buffer->events, RING_BUFFER_EVENT_DATA);
+    }
+    size_t count = _ring_buffer_peek(buffer, (size_t)(cursor->position - buffer->stream_head), data + read_count,
+                                     size - read_count);
+    cursor->position += count;
+    read_count += count;
+    if (count > 0) {
+      reclaimed |= _ring_buffer_readers_reclaim(buffer);
+    }
+    result = read_count;
+    if (read_count == size) {
+      break;
+    }
+
+    // 書き込みが終了していれば、残りのデータを返して終わる
+    if (buffer->write_finished) {
+      if (read_count == 0) {
+        result = RING_BUFFER_FINISHED;
+      }
+      break;
+    }
+
+    if (xTaskCheckForTimeOut(&timeout, &xTicksToWait) == pdTRUE) {
+      break;
+    }
+
+    // 書き込み側がデータを積むまで待つ
+    _ring_buffer_unlock(buffer);
+    xEventGroupWaitBits(buffer->events, RING_BUFFER_EVENT_READABLE, pdFALSE, pdFALSE, xTicksToWait);
+    _ring_buffer_lock(buffer);
+  }
+
+  if (wait) {
+    __atomic_sub_fetch(&buffer->read_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  if (reclaimed) {
+    _ring_buffer_notify_writers(buffer);
+  }
+  _ring_buffer_unlock(buffer);
+  RING_BUFFER_STAT_LATENCY(buffer, read_latency, start);
+  RING_BUFFER_STAT_RESULT(buffer, result);
+  return result;
+}
@@ -0,0 +1,269 @@
+#include "ring_buffer.h"
+#include "ring_buffer_internal.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+// セグメントに分けたファイルバッファ
+// file_size を segment_size ごとの区間 (セグメント) に分け、区間ごとに "<file_name>.<番号>" のファイルを使う
+// ファイル上の位置 pos は、segments[pos / segment_size] のファイルの pos % segment_size バイト目になる
+// 書き込むときにセグメントのファイルを作り、先頭のデータを読み終えたセグメントはファイルごと消す
+// (segment_recycle が有効なら、消さずに次に作るセグメントのファイルとして使い回す)
+// 状態はファイルのストリームと同じく _ring_buffer_file_lock で守る
+
+// ファイル名の番号の範囲 (開いているファイルと使い回すファイルが、同時にこの数を超えることはない)
+#define RING_BUFFER_SEGMENT_IDS (RING_BUFFER_SEGMENTS_MAX * 2)
+
+// 番号 id のセグメントファイル名を name に書き込む
+static void _ring_buffer_segment_path(RingBuffer *buffer, uint32_t id, char *name, size_t size) {
+  snprintf(name, size, "%s.%u", buffer->segment_name, (unsigned)id);
+}
+
+// 番号 id のファイルを削除する
+static void _ring_buffer_segment_remove(RingBuffer *buffer, uint32_t id) {
+  char name[RING_BUFFER_SEGMENT_NAME_MAX + 8];
+  _ring_buffer_segment_path(buffer, id, name, sizeof(name));
+  remove(name);
+}
+
+// 開いているファイルと使い回すファイルのどれにも使われていない、最も小さい番号を返す
+static uint32_t _ring_buffer_segment_free_id(RingBuffer *buffer) {
+  bool used[RING_BUFFER_SEGMENT_IDS] = {false};
+  for (size_t i = 0; i < buffer->segment_count; i++) {
+    if (buffer->segments[i].file != NULL) {
+      used[buffer->segments[i].id] = true;
+    }
+  }
+  for (size_t i = 0; i < buffer->segment_spare_count; i++) {
+    used[buffer->segment_spares[i].id] = true;
+  }
+  uint32_t id = 0;
+  while (used[id]) {
+    id++;
+  }
+  return id;
+}
+
+// ファイルの数 (開いているセグメントと使い回すために残してあるファイル)
+static size_t _ring_buffer_segment_files(RingBuffer *buffer) {
+  size_t count = buffer->segment_spare_count;
+  for (size_t i = 0; i < buffer->segment_count; i++) {
+    if (buffer->segments[i].file != NULL) {
+      count++;
+    }
+  }
+  return count;
+}
+
+// セグメント slot のファイルを用意する
+// 使い回せるファイルがあればそれを使い、なければ作って事前確保する
+static RingBufferSegment *_ring_buffer_segment_open(RingBuffer *buffer, size_t slot) {
+  RingBufferSegment *segment = &buffer->segments[slot];
+  if (segment->file != NULL) {
+    return segment;
+  }
+  if (buffer->segment_spare_count > 0) {
+    *segment = buffer->segment_spares[--buffer->segment_spare_count];
+    return segment;
+  }
+
+  uint32_t id = _ring_buffer_segment_free_id(buffer);
+  char name[RING_BUFFER_SEGMENT_NAME_MAX + 8];
+  _ring_buffer_segment_path(buffer, id, name, sizeof(name));
+  FILE *file = fopen(name, "w+b");
+  if (file == NULL) {
+    return NULL;
+  }
+  _ring_buffer_file_extend(file, 0, buffer->segment_size, buffer->segment_preallocate);
+  *segment = (RingBufferSegment){
+      .file = file, .pos = RING_BUFFER_FILE_POS_UNKNOWN, .last_op = RING_BUFFER_FILE_OP_NONE, .id = id};
+  return segment;
+}
+
+// セグメントのストリーム位置を offset に合わせる
+// 読み書きの向きが変わらず位置も一致していれば fseek を省略する
+static bool _ring_buffer_segment_seek(RingBufferSegment *segment, size_t offset, int op) {
+  if (segment->pos == offset && segment->last_op == op) {
+    return true;
+  }
+  if (fseek(segment->file, offset, SEEK_SET) != 0) {
+    segment->pos = RING_BUFFER_FILE_POS_UNKNOWN;
+    return false;
+  }
+  segment->pos = offset;
+  segment->last_op = op;
+  return true;
+}
+
+// 初期化関数
+// セグメントが1つも収まらない場合や、ファイル名が長すぎる場合は、セグメントに分けずに1つのファイルを使う
+void _ring_buffer_segment_init(RingBuffer *buffer, const char *file_name, size_t file_size,
+                               const RingBufferConfig *config) {
+  size_t count = config->segment_size > 0 ? file_size / config->segment_size : 0;
+  if (count > RING_BUFFER_SEGMENTS_MAX) {
+    count = RING_BUFFER_SEGMENTS_MAX;
+  }
+  if (file_name == NULL || strlen(file_name) >= RING_BUFFER_SEGMENT_NAME_MAX) {
+    count = 0;
+  }
+  buffer->segment_size = count > 0 ? config->segment_size : 0;
+  buffer->segment_count = count;
+  buffer->segment_limit = count;
+  buffer->segment_recycle = config->segment_recycle;
+  buffer->segment_preallocate = config->preallocate;
+  buffer->segment_spare_count = 0;
+  for (size_t i = 0; i < RING_BUFFER_SEGMENTS_MAX; i++) {
+    buffer->segments[i].file = NULL;
+  }
+  if (count == 0) {
+    buffer->segment_name[0] = '\0';
+    return;
+  }
+
+  // 前回の実行で残ったセグメントファイルを消す
+  snprintf(buffer->segment_name, sizeof(buffer->segment_name), "%s", file_name);
+  for (uint32_t id = 0; id < RING_BUFFER_SEGMENT_IDS; id++) {
+    _ring_buffer_segment_remove(buffer, id);
+  }
+}
+
+// ファイル上の pos から連続領域を書き込み、書き込めたバイト数を返す関数
+// セグメントの境界で分けて、それぞれのファイルへ書き込む
+size_t _ring_buffer_segment_pwrite(RingBuffer *buffer, size_t pos, const uint8_t *data, size_t size) {
+  size_t written = 0;
+  while (written < size) {
+    size_t slot = pos / buffer->segment_size;
+    size_t offset = pos % buffer->segment_size;
+    size_t count = buffer->segment_size - offset;
+    if (count > size - written) {
+      count = size - written;
+    }
+    RingBufferSegment *segment = _ring_buffer_segment_open(buffer, slot);
+    if (segment == NULL || !_ring_buffer_segment_seek(segment, offset, RING_BUFFER_FILE_OP_WRITE)) {
+      break;
+    }
+    size_t result = fwrite(data + written, 1, count, segment->file);
+    segment->pos = result == count ? offset + result : RING_BUFFER_FILE_POS_UNKNOWN;
+    written += result;
+    if (result < count) {
+      break;
+    }
+    pos += count;
+  }
+  return written;
+}
+
+// ファイル上の pos から連続領域を読み込み、読み込めたバイト数を返す関数
+// ファイルがまだないセグメントは読み込めない
+size_t _ring_buffer_segment_pread(RingBuffer *buffer, size_t pos, uint8_t *data, size_t size) {
+  size_t read_count = 0;
+  while (read_count < size) {
+    RingBufferSegment *segment = &buffer->segments[pos / buffer->segment_size];
+    size_t offset = pos % buffer->segment_size;
+    size_t count = buffer->segment_size - offset;
+    if (count > size - read_count) {
+      count = size - read_count;
+    }
+    if (segment->file == NULL || !_ring_buffer_segment_seek(segment, offset, RING_BUFFER_FILE_OP_READ)) {
+      break;
+    }
+    size_t result = fread(data + read_count, 1, count, segment->file);
+    segment->pos = result == count ? offset + result : RING_BUFFER_FILE_POS_UNKNOWN;
+    read_count += result;
+    if (result < count) {
+      break;
+    }
+    pos += count;
+  }
+  return read_count;
+}
+
+// 先頭の head から size バイトを読み終えたときに、読み終えたセグメントのファイルを手放す関数
+// 使い回す場合でも、ファイルの数が segment_limit を超える分は消す
+void _ring_buffer_segment_release(RingBuffer *buffer, size_t head, size_t size) {
+  size_t slot = head / buffer->segment_size;
+  size_t crossed = (head % buffer->segment_size + size) / buffer->segment_size;
+  _ring_buffer_file_lock(buffer);
+  for (size_t i = 0; i < crossed; i++, slot = slot + 1 < buffer->segment_count ? slot + 1 : 0) {
+    RingBufferSegment *segment = &buffer->segments[slot];
+    if (segment->file == NULL) {
+      continue;
+    }
+    if (buffer->segment_recycle && _ring_buffer_segment_files(buffer) <= buffer->segment_limit) {
+      buffer->segment_spares[buffer->segment_spare_count++] = *segment;
+    } else {
+      fclose(segment->file);
+      _ring_buffer_segment_remove(buffer, segment->id);
+    }
+    segment->file = NULL;
+  }
+  _ring_buffer_file_unlock(buffer);
+}
+
+// 書き込める残りのバイト数を返す関数
+// 先頭のセグメントから数えて segment_limit 個のセグメントに収まる分まで書き込める
+size_t _ring_buffer_segment_space(RingBuffer *buffer) {
+  size_t used = buffer->file_head % buffer->segment_size + buffer->file_len;
+  size_t capacity = buffer->segment_limit * buffer->segment_size;
+  return capacity > used ? capacity - used : 0;
+}
+
+// すべてのセグメントファイルの stdio のバッファを書き出す関数
+// sync が true なら、ストレージへの反映も待つ
+bool _ring_buffer_segment_flush(RingBuffer *buffer, bool sync) {
+  bool flushed = true;
+  for (size_t i = 0; i < buffer->segment_count; i++) {
+    FILE *file = buffer->segments[i].file;
+    if (file != NULL) {
+      flushed = fflush(file) == 0 && (!sync || fsync(fileno(file)) == 0) && flushed;
+    }
+  }
+  return flushed;
+}
+
+// すべてのセグメントファイルを閉じて消す関数
+void _ring_buffer_segment_close(RingBuffer *buffer) {
+  for (size_t i = 0; i < buffer->segment_count; i++) {
+    RingBufferSegment *segment = &buffer->segments[i];
+    if (segment->file != NULL) {
+      fclose(segment->file);
+      _ring_buffer_segment_remove(buffer, segment->id);
+      segment->file = NULL;
+    }
+  }
+  while (buffer->segment_spare_count > 0) {
+    RingBufferSegment *spare = &buffer->segment_spares[--buffer->segment_spare_count];
+    fclose(spare->file);
+    _ring_buffer_segment_remove(buffer, spare->id);
+  }
+}
+
+// 同時にファイルを置けるセグメントの数を設定する関数
+void ring_buffer_set_segment_limit(RingBuffer *buffer, size_t count) {
+  if (buffer->segment_size == 0) {
+    return;
+  }
+  _ring_buffer_lock(buffer);
+  _ring_buffer_file_lock(buffer);
+  buffer->segment_limit = count < 1 ? 1 : count > buffer->segment_count ? buffer->segment_count : count;
+  // 減らした分の使い回すファイルを消す
+  while (buffer->segment_spare_count > 0 && _ring_buffer_segment_files(buffer) > buffer->segment_limit) {
+    RingBufferSegment *spare = &buffer->segment_spares[--buffer->segment_spare_count];
+    fclose(spare->file);
+    _ring_buffer_segment_remove(buffer, spare->id);
+  }
+  _ring_buffer_file_unlock(buffer);
+  _ring_buffer_unlock(buffer);
+  // 増やした場合は空きができるので、書き込みを待っているタスクを起こす
+  _ring_buffer_notify_writers(buffer);
+}
+
+// ディスク上にあるセグメントファイルの数を取得する関数
+size_t ring_buffer_segment_files(RingBuffer *buffer) {
+  _ring_buffer_lock(buffer);
+  _ring_buffer_file_lock(buffer);
+  size_t count = _ring_buffer_segment_files(buffer);
+  _ring_buffer_file_unlock(buffer);
+  _ring_buffer_unlock(buffer);
+  return count;
+}
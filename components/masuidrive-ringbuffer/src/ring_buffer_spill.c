@@ -0,0 +1,246 @@
+#include "ring_buffer.h"
+#include "ring_buffer_internal.h"
+
+#include <freertos/task.h>
+
+// ステージングに書き込める残りのバイト数を返す
+// ステージングのデータはいずれファイルへ書き出すため、ファイルの空きも超えないようにする
+size_t _ring_buffer_staging_space(RingBuffer *buffer) {
+  if (buffer->spill_task == NULL || !_ring_buffer_has_file(buffer)) {
+    return 0;
+  }
+  size_t space = buffer->staging_size - buffer->staging_len;
+  size_t file_space = _ring_buffer_file_space(buffer) - buffer->staging_len;
+  return space < file_space ? space : file_space;
+}
+
+// ステージングの書き込み関数
+// 書き込めたバイト数を返し、しきい値を超えたら書き出しタスクを起こす
+size_t _ring_buffer_staging_write(RingBuffer *buffer, const uint8_t *data, size_t size) {
+  size_t space = _ring_buffer_staging_space(buffer);
+  size_t written = size < space ? size : space;
+  if (written > 0) {
+    size_t tail = _ring_buffer_wrap(buffer->staging_head + buffer->staging_len, buffer->staging_size, 0);
+    _ring_buffer_copy_in(buffer->staging_buffer, buffer->staging_size, tail, data, written);
+    __atomic_store_n(&buffer->staging_len, buffer->staging_len + written, __ATOMIC_RELEASE);
+    RING_BUFFER_STAT_ADD(buffer, staging_in, written);
+  }
+  if (buffer->staging_len >= buffer->staging_size / RING_BUFFER_SPILL_THRESHOLD_DIVISOR || written < size) {
+    xTaskNotifyGive(buffer->spill_task);
+  }
+  return written;
+}
+
+// ステージングの先頭から size バイトを捨てる関数
+// 書き出し中の領域を消費した場合は、書き出しの確定時にファイル側で読み飛ばせるように記録する
+void _ring_buffer_staging_consume(RingBuffer *buffer, size_t size) {
+  size_t inflight = size < buffer->staging_inflight ? size : buffer->staging_inflight;
+  buffer->staging_inflight -= inflight;
+  buffer->staging_inflight_consumed += inflight;
+  buffer->staging_head = _ring_buffer_wrap(buffer->staging_head + size, buffer->staging_size, 0);
+  __atomic_store_n(&buffer->staging_len, buffer->staging_len - size, __ATOMIC_RELEASE);
+  RING_BUFFER_STAT_ADD(buffer, staging_out, size);
+}
+
+// ステージングの先頭から offset バイト目以降を、消費せずに最大 size バイト読み込む関数
+size_t _ring_buffer_staging_peek(RingBuffer *buffer, size_t offset, uint8_t *data, size_t size) {
+  if (offset >= buffer->staging_len) {
+    return 0;
+  }
+  size_t count = buffer->staging_len - offset < size ? buffer->staging_len - offset : size;
+  size_t pos = _ring_buffer_wrap(buffer->staging_head + offset, buffer->staging_size, 0);
+  _ring_buffer_copy_out(buffer->staging_buffer, buffer->staging_size, pos, data, count);
+  return count;
+}
+
+// ステージングの読み込み関数
+// ファイルとその前の階層より新しいデータなので、それらが空のときだけ読み込む
+size_t _ring_buffer_staging_read(RingBuffer *buffer, uint8_t *data, size_t size) {
+  if (_ring_buffer_tiered(buffer) > 0 || buffer->staging_len == 0) {
+    return 0;
+  }
+
+  size_t read_count = size < buffer->staging_len ? size : buffer->staging_len;
+  _ring_buffer_copy_out(buffer->staging_buffer, buffer->staging_size, buffer->staging_head, data, read_count);
+  _ring_buffer_staging_consume(buffer, read_count);
+  return read_count;
+}
+
+// ステージングからメモリへ最大 size バイトを移動する関数
+// _ring_buffer_promote と同じく、メモリ側を確定してからステージング側を消費する
+size_t _ring_buffer_staging_promote(RingBuffer *buffer, size_t size) {
+  if (_ring_buffer_tiered(buffer) > 0 || buffer->staging_len == 0) {
+    return 0;
+  }
+
+  RingBufferSpan spans[2];
+  size_t count = _ring_buffer_mem_free_spans(buffer, size < buffer->staging_len ? size : buffer->staging_len, spans);
+  size_t pos = buffer->staging_head;
+  for (int i = 0; i < 2; i++) {
+    _ring_buffer_copy_out(buffer->staging_buffer, buffer->staging_size, pos, spans[i].data, spans[i].size);
+    pos = _ring_buffer_wrap(pos + spans[i].size, buffer->staging_size, 0);
+  }
+  _ring_buffer_mem_commit(buffer, count);
+  _ring_buffer_staging_consume(buffer, count);
+  return count;
+}
+
+// 書き出しの確定
+// written バイトをファイルのデータとして確定し、書き出し中に読み込み側が消費した分はファイルから捨てる
+// SPSC モードの書き込み側はファイルとステージングがともに空になるとメモリへ直接書き込むため、
+// ファイルを確定してからステージングを消費する
+static void _ring_buffer_spill_commit(RingBuffer *buffer, size_t written) {
+  size_t consumed = buffer->staging_inflight_consumed;
+  buffer->staging_inflight = 0;
+  buffer->staging_inflight_consumed = 0;
+
+  _ring_buffer_file_commit(buffer, written);
+  if (consumed < written) {
+    _ring_buffer_staging_consume(buffer, written - consumed);
+  }
+  _ring_buffer_file_consume(buffer, consumed < written ? consumed : written);
+}
+
+// 書き出しタスク
+// ステージングの内容をミューテックスの外でファイルへ書き出すため、書き込み側も読み込み側も止めない
+static void _ring_buffer_spill_task(void *arg) {
+  RingBuffer *buffer = (RingBuffer *)arg;
+
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RING_BUFFER_SPILL_INTERVAL_MS));
+    if (buffer->spill_stop) {
+      break;
+    }
+
+    _ring_buffer_lock(buffer);
+    RingBufferSpan spans[2];
+    size_t size = _ring_buffer_spans(buffer->staging_buffer, buffer->staging_size, buffer->staging_head,
+                                     buffer->staging_len, spans);
+    size_t pos = _ring_buffer_wrap(buffer->file_head + buffer->file_len, buffer->file_size, 0);
+    buffer->staging_inflight = size;
+    buffer->staging_inflight_consumed = 0;
+    _ring_buffer_unlock(buffer);
+
+    // 書き出し中の領域は staging_len に含まれたままなので、書き込み側に上書きされることはない
+    // (読み込み側が消費した部分は上書きされうるが、確定時にファイルから捨てる)
+    size_t written = _ring_buffer_file_write_at(buffer, pos, spans[0].data, spans[0].size);
+    if (written == spans[0].size && spans[1].size > 0) {
+      pos = _ring_buffer_wrap(pos + written, buffer->file_size, 0);
+      written += _ring_buffer_file_write_at(buffer, pos, spans[1].data, spans[1].size);
+    }
+
+    _ring_buffer_lock(buffer);
+    _ring_buffer_spill_commit(buffer, written);
+    if (written > 0) {
+      _ring_buffer_notify_writers(buffer);
+    }
+    if (buffer->staging_len == 0) {
+      xEventGroupSetBits(buffer->events, RING_BUFFER_EVENT_FLUSHED);
+    }
+    _ring_buffer_unlock(buffer);
+  }
+
+  xSemaphoreGive(buffer->spill_done);
+  vTaskDelete(NULL);
+}
+
+// 書き出しタスクの開始関数
+bool ring_buffer_start_spill_task(RingBuffer *buffer, uint8_t *staging, size_t staging_size, uint32_t stack_size,
+                                  UBaseType_t priority) {
+  // 圧縮モードのファイルはミューテックスの外から書き込めないので、書き出しタスクは使えない
+  if (buffer->spill_task != NULL || staging_size == 0 || buffer->compress_work != NULL) {
+    return false;
+  }
+  buffer->spill_done = xSemaphoreCreateBinary();
+  buffer->file_lock = xSemaphoreCreateMutex();
+  if (buffer->spill_done == NULL || buffer->file_lock == NULL) {
+    if (buffer->spill_done != NULL) {
+      vSemaphoreDelete(buffer->spill_done);
+    }
+    if (buffer->file_lock != NULL) {
+      vSemaphoreDelete(buffer->file_lock);
+    }
+    buffer->spill_done = NULL;
+    buffer->file_lock = NULL;
+    return false;
+  }
+
+  _ring_buffer_lock(buffer);
+  buffer->staging_buffer = staging;
+  buffer->staging_size = staging_size;
+  buffer->staging_head = 0;
+  buffer->staging_len = 0;
+  buffer->spill_stop = false;
+
+  TaskHandle_t task;
+  if (xTaskCreate(_ring_buffer_spill_task, "rb_spill", stack_size, buffer, priority, &task) != pdPASS) {
+    _ring_buffer_unlock(buffer);
+    vSemaphoreDelete(buffer->spill_done);
+    vSemaphoreDelete(buffer->file_lock);
+    buffer->spill_done = NULL;
+    buffer->file_lock = NULL;
+    return false;
+  }
+  buffer->spill_task = task;
+  _ring_buffer_unlock(buffer);
+  return true;
+}
+
+// 書き出しタスクの停止関数
+// ステージングに残っているデータは破棄する
+void _ring_buffer_stop_spill_task(RingBuffer *buffer) {
+  _ring_buffer_lock(buffer);
+  TaskHandle_t task = buffer->spill_task;
+  buffer->spill_stop = true;
+  _ring_buffer_unlock(buffer);
+
+  if (task != NULL) {
+    xTaskNotifyGive(task);
+    xSemaphoreTake(buffer->spill_done, portMAX_DELAY);
+    vSemaphoreDelete(buffer->spill_done);
+    vSemaphoreDelete(buffer->file_lock);
+    buffer->spill_done = NULL;
+    buffer->file_lock = NULL;
+    buffer->spill_task = NULL;
+  }
+}
+
+// ステージングを書き出し、ファイルをストレージに反映する関数
+int ring_buffer_flush(RingBuffer *buffer, TickType_t xTicksToWait) {
+  TimeOut_t timeout;
+  vTaskSetTimeOutState(&timeout);
+  _ring_buffer_lock(buffer);
+
+  int result = RING_BUFFER_OK;
+  while (buffer->spill_task != NULL) {
+    if (buffer->cancelled) {
+      result = RING_BUFFER_CANCELED;
+      break;
+    }
+
+    // 書き出しタスクは、書き出しを終えてステージングが空になると FLUSHED を立てる
+    xEventGroupClearBits(buffer->events, RING_BUFFER_EVENT_FLUSHED);
+    if (buffer->staging_len == 0 && buffer->staging_inflight == 0) {
+      break;
+    }
+    if (xTaskCheckForTimeOut(&timeout, &xTicksToWait) == pdTRUE) {
+      result = RING_BUFFER_TIMEOUT;
+      break;
+    }
+
+    xTaskNotifyGive(buffer->spill_task);
+    _ring_buffer_unlock(buffer);
+    xEventGroupWaitBits(buffer->events, RING_BUFFER_EVENT_FLUSHED | RING_BUFFER_EVENT_CANCELED, pdFALSE, pdFALSE,
+                        xTicksToWait);
+    _ring_buffer_lock(buffer);
+  }
+
+  if (result == RING_BUFFER_OK) {
+    result = _ring_buffer_file_checkpoint(buffer);
+  }
+  if (result == RING_BUFFER_OK) {
+    result = _ring_buffer_file_sync(buffer);
+  }
+  _ring_buffer_unlock(buffer);
+  return result;
+}
@@ -0,0 +1,153 @@
+#include "ring_buffer.h"
+#include "ring_buffer_internal.h"
+
+#include <freertos/task.h>
+
+// 読み込みのしきい値
+// 待機中の読み込みタスクは read_threshold_task に自分を登録し、タスク通知 (通知の配列が1つだけの場合はイベントグループ) で起こされる
+// 書き込み側は積んであるデータが read_threshold_wake に届いたときだけ通知するので、書き込みごとには起こさない
+
+#ifdef RING_BUFFER_THRESHOLD_NOTIFY_INDEX
+#if RING_BUFFER_THRESHOLD_NOTIFY_INDEX == 0
+#error "RING_BUFFER_THRESHOLD_NOTIFY_INDEX must not be 0, which ulTaskNotifyTake uses"
+#endif
+#if RING_BUFFER_THRESHOLD_NOTIFY_INDEX >= configTASK_NOTIFICATION_ARRAY_ENTRIES
+#error "RING_BUFFER_THRESHOLD_NOTIFY_INDEX must be less than configTASK_NOTIFICATION_ARRAY_ENTRIES"
+#endif
+
+static void _ring_buffer_threshold_give(RingBuffer *buffer, TaskHandle_t task) {
+  (void)buffer;
+  xTaskNotifyGiveIndexed(task, RING_BUFFER_THRESHOLD_NOTIFY_INDEX);
+}
+
+static void _ring_buffer_threshold_prepare(RingBuffer *buffer) {
+  (void)buffer;
+}
+
+static bool _ring_buffer_threshold_take(RingBuffer *buffer, TickType_t ticks) {
+  (void)buffer;
+  return ulTaskNotifyTakeIndexed(RING_BUFFER_THRESHOLD_NOTIFY_INDEX, pdTRUE, ticks) > 0;
+}
+
+// 書き込み側が登録を取り出した後の通知は必ず届くので、受け取ってタスクに残さない
+static void _ring_buffer_threshold_discard(RingBuffer *buffer) {
+  (void)buffer;
+  ulTaskNotifyTakeIndexed(RING_BUFFER_THRESHOLD_NOTIFY_INDEX, pdTRUE, portMAX_DELAY);
+}
+#else
+// タスク通知の配列に 0 番しかない場合は、アプリケーションの通知と重ならないようイベントグループのビットで待つ
+static void _ring_buffer_threshold_give(RingBuffer *buffer, TaskHandle_t task) {
+  (void)task;
+  xEventGroupSetBits(buffer->events, RING_BUFFER_EVENT_THRESHOLD);
+}
+
+// 前の待機の後に届いたビットを消してから登録する
+static void _ring_buffer_threshold_prepare(RingBuffer *buffer) {
+  xEventGroupClearBits(buffer->events, RING_BUFFER_EVENT_THRESHOLD);
+}
+
+static bool _ring_buffer_threshold_take(RingBuffer *buffer, TickType_t ticks) {
+  return (xEventGroupWaitBits(buffer->events, RING_BUFFER_EVENT_THRESHOLD, pdTRUE, pdFALSE, ticks) &
+          RING_BUFFER_EVENT_THRESHOLD) != 0;
+}
+
+// ビットはタスクではなくバッファに残り、次の待機の前に消すので、ここでは待たない
+static void _ring_buffer_threshold_discard(RingBuffer *buffer) {
+  (void)buffer;
+}
+#endif
+
+// ロックを取らずに、積んであるデータのバイト数を返す
+static size_t _ring_buffer_threshold_stored(RingBuffer *buffer) {
+  return __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE) + __atomic_load_n(&buffer->tier_len, __ATOMIC_RELAXED) +
+         __atomic_load_n(&buffer->file_len, __ATOMIC_RELAXED) + __atomic_load_n(&buffer->staging_len, __ATOMIC_RELAXED);
+}
+
+// 登録されている読み込みタスクを起こす
+// force が false の場合は、積んであるデータが read_threshold_wake に届いているときだけ起こす
+void _ring_buffer_notify_threshold(RingBuffer *buffer, bool force) {
+  if (!force &&
+      _ring_buffer_threshold_stored(buffer) < __atomic_load_n(&buffer->read_threshold_wake, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  TaskHandle_t task = __atomic_exchange_n(&buffer->read_threshold_task, NULL, __ATOMIC_SEQ_CST);
+  if (task != NULL) {
+    _ring_buffer_threshold_give(buffer, task);
+  }
+}
+
+// 読み込みタスクを起こすしきい値を設定する関数
+void ring_buffer_set_read_threshold(RingBuffer *buffer, size_t bytes, TickType_t max_delay_ticks) {
+  _ring_buffer_lock(buffer);
+  buffer->read_threshold = bytes > 0 ? bytes : 1;
+  buffer->read_threshold_delay = max_delay_ticks;
+  _ring_buffer_unlock(buffer);
+
+  // 待機中のタスクがあれば、新しいしきい値で判定し直させる
+  _ring_buffer_notify_threshold(buffer, true);
+}
+
+// しきい値まで積まれるか、最初のデータから max_delay_ticks 経つまで待つ関数
+int ring_buffer_wait_read_threshold(RingBuffer *buffer, TickType_t xTicksToWait) {
+  TimeOut_t timeout;
+  vTaskSetTimeOutState(&timeout);
+  TimeOut_t deadline;
+  TickType_t delay = 0;
+  bool has_deadline = false;
+
+  while (true) {
+    _ring_buffer_lock(buffer);
+    size_t stored = _ring_buffer_stored(buffer);
+    size_t threshold = buffer->read_threshold;
+    if (!has_deadline) {
+      delay = buffer->read_threshold_delay;
+    }
+    bool cancelled = buffer->cancelled;
+    bool finished = buffer->write_finished;
+    _ring_buffer_unlock(buffer);
+
+    if (cancelled) {
+      return RING_BUFFER_CANCELED;
+    }
+    if (stored >= threshold) {
+      return (int)stored;
+    }
+    if (finished) {
+      return stored > 0 ? (int)stored : RING_BUFFER_FINISHED;
+    }
+
+    // 最初のデータを見つけた時点から、遅延の上限を数える
+    // 他の読み込み側が読み切った場合は、次のデータから数え直す
+    if (stored == 0) {
+      has_deadline = false;
+    } else if (!has_deadline && delay != portMAX_DELAY) {
+      vTaskSetTimeOutState(&deadline);
+      has_deadline = true;
+    }
+    if (has_deadline && xTaskCheckForTimeOut(&deadline, &delay) == pdTRUE) {
+      return (int)stored;
+    }
+    if (xTaskCheckForTimeOut(&timeout, &xTicksToWait) == pdTRUE) {
+      return RING_BUFFER_TIMEOUT;
+    }
+
+    // データがなければ最初の書き込みで、あればしきい値に届いたときに起こしてもらう
+    // 登録してから判定し直すので、その間の書き込みの通知を取りこぼすことはない
+    size_t wake = stored > 0 ? threshold : 1;
+    _ring_buffer_threshold_prepare(buffer);
+    __atomic_store_n(&buffer->read_threshold_wake, wake, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&buffer->read_threshold_task, xTaskGetCurrentTaskHandle(), __ATOMIC_SEQ_CST);
+    bool notified = false;
+    if (_ring_buffer_threshold_stored(buffer) < wake && !__atomic_load_n(&buffer->write_finished, __ATOMIC_SEQ_CST) &&
+        !__atomic_load_n(&buffer->cancelled, __ATOMIC_SEQ_CST)) {
+      TickType_t ticks = has_deadline && delay < xTicksToWait ? delay : xTicksToWait;
+      notified = _ring_buffer_threshold_take(buffer, ticks);
+    }
+
+    // 登録を取り消す。書き込み側が先に登録を取り出していれば、その通知は必ず届くので、
+    // まだ受け取っていなければ受け取ってから戻り、呼び出し元のタスクに通知を残さない
+    if (__atomic_exchange_n(&buffer->read_threshold_task, NULL, __ATOMIC_SEQ_CST) == NULL && !notified) {
+      _ring_buffer_threshold_discard(buffer);
+    }
+  }
+}
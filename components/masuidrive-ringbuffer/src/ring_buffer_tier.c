@@ -0,0 +1,138 @@
+#include "ring_buffer.h"
+#include "ring_buffer_internal.h"
+
+// メモリより後ろの階層の積み重ね
+// データはメモリ、tiers[0]、tiers[1]、...、tiers[tier_count - 1] (ファイル)、ステージングの順に古い
+// 書き込みは、それより後ろの階層がすべて空になっている最初の階層から詰め、入りきらない分を次の階層へまとめて送る
+// 補充は先頭側の階層から取り出し、隣り合う階層の間でも後ろから前へまとめて移す
+// ファイルより前の階層に積んであるバイト数は tier_len にまとめ、ロックなしでも参照できるようにする
+
+// 階層を設定する関数
+// config の階層をメモリに近い順に並べ、最後にファイルを置く
+void _ring_buffer_tiers_init(RingBuffer *buffer, const RingBufferConfig *config) {
+  size_t count = config->tiers != NULL ? config->tier_count : 0;
+  if (count > RING_BUFFER_TIERS_MAX) {
+    count = RING_BUFFER_TIERS_MAX;
+  }
+  buffer->tier_len = 0;
+  for (size_t i = 0; i < count; i++) {
+    buffer->tiers[i] = config->tiers[i];
+    buffer->tier_len += buffer->tiers[i].ops->usage(buffer->tiers[i].ctx);
+  }
+  buffer->tiers[count] = (RingBufferTier){.ops = &_ring_buffer_file_tier_ops, .ctx = buffer};
+  buffer->tier_count = count + 1;
+}
+
+// 階層 i に積んであるバイト数
+size_t _ring_buffer_tier_usage(RingBuffer *buffer, size_t i) {
+  return buffer->tiers[i].ops->usage(buffer->tiers[i].ctx);
+}
+
+// 階層 i の先頭から offset バイト目以降を、消費せずに読み込む
+size_t _ring_buffer_tier_peek(RingBuffer *buffer, size_t i, size_t offset, uint8_t *data, size_t size) {
+  return buffer->tiers[i].ops->peek(buffer->tiers[i].ctx, offset, data, size);
+}
+
+// 階層 i の末尾に書き込み、書き込めたバイト数を返す
+static size_t _ring_buffer_tier_write(RingBuffer *buffer, size_t i, const uint8_t *data, size_t size) {
+  size_t written = buffer->tiers[i].ops->write(buffer->tiers[i].ctx, data, size);
+  if (i + 1 < buffer->tier_count) {
+    __atomic_fetch_add(&buffer->tier_len, written, __ATOMIC_RELEASE);
+  }
+  return written;
+}
+
+// 階層 i の先頭から size バイトを捨てる
+void _ring_buffer_tier_consume(RingBuffer *buffer, size_t i, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  buffer->tiers[i].ops->consume(buffer->tiers[i].ctx, size);
+  if (i + 1 < buffer->tier_count) {
+    __atomic_fetch_sub(&buffer->tier_len, size, __ATOMIC_RELEASE);
+  }
+}
+
+// 書き込みを始める階層を返す
+// 順序を保つため、それより後ろの階層 (ファイルとステージングを含む) がすべて空の階層から書き込む
+static size_t _ring_buffer_tiers_start(RingBuffer *buffer) {
+  size_t last = buffer->tier_count - 1;
+  if (buffer->file_len > 0 || buffer->staging_len > 0) {
+    return last;
+  }
+  for (size_t i = last; i-- > 0;) {
+    if (_ring_buffer_tier_usage(buffer, i) > 0) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+// ファイルより前の階層へ書き込み、書き込めたバイト数を返す関数
+// 入りきらない分は、呼び出し側がファイルかステージングへ書き込む
+size_t _ring_buffer_tiers_write(RingBuffer *buffer, const uint8_t *data, size_t size) {
+  if (buffer->write_finished || buffer->cancelled) {
+    return 0;
+  }
+  size_t written = 0;
+  for (size_t i = _ring_buffer_tiers_start(buffer); i + 1 < buffer->tier_count && written < size; i++) {
+    written += _ring_buffer_tier_write(buffer, i, data + written, size - written);
+  }
+  return written;
+}
+
+// 書き込みを始める階層より前の階層に積まれているバイト数を返す関数
+size_t _ring_buffer_tiers_stranded(RingBuffer *buffer) {
+  if (buffer->tier_count == 0) {
+    return 0;
+  }
+  size_t stranded = 0;
+  size_t start = _ring_buffer_tiers_start(buffer);
+  for (size_t i = 0; i < start; i++) {
+    stranded += _ring_buffer_tier_usage(buffer, i);
+  }
+  return stranded;
+}
+
+// ファイルより前の階層に、順序を保ったまま書き込める残りのバイト数を返す関数
+size_t _ring_buffer_tiers_space(RingBuffer *buffer) {
+  size_t space = 0;
+  for (size_t i = _ring_buffer_tiers_start(buffer); i + 1 < buffer->tier_count; i++) {
+    space += buffer->tiers[i].ops->space(buffer->tiers[i].ctx);
+  }
+  return space;
+}
+
+// ファイルより前の階層に置けるバイト数の合計を返す関数
+size_t _ring_buffer_tiers_capacity(RingBuffer *buffer) {
+  size_t capacity = 0;
+  for (size_t i = 0; i + 1 < buffer->tier_count; i++) {
+    capacity += _ring_buffer_tier_usage(buffer, i) + buffer->tiers[i].ops->space(buffer->tiers[i].ctx);
+  }
+  return capacity;
+}
+
+// 隣り合う階層の間で、後ろの階層の先頭から前の階層の末尾へ、それぞれ最大 size バイトを移す関数
+// 前の階層のデータは後ろの階層のデータより古いので、末尾に足しても順序は変わらない
+// 前の組から順に移すので、前の階層に移して空いた分を、すぐに後ろの階層から埋められる
+// 前の階層を確定してから後ろの階層を消費するので、ロックなしで見た _ring_buffer_spilled が一時的に減ることはない
+void _ring_buffer_tiers_cascade(RingBuffer *buffer, size_t size) {
+  uint8_t chunk[RING_BUFFER_TIER_COPY_CHUNK];
+  for (size_t i = 0; i + 1 < buffer->tier_count; i++) {
+    size_t moved = 0;
+    while (moved < size) {
+      size_t count = size - moved < sizeof(chunk) ? size - moved : sizeof(chunk);
+      size_t space = buffer->tiers[i].ops->space(buffer->tiers[i].ctx);
+      size_t len = _ring_buffer_tier_usage(buffer, i + 1);
+      count = count < space ? count : space;
+      count = count < len ? count : len;
+      count = _ring_buffer_tier_peek(buffer, i + 1, 0, chunk, count);
+      count = _ring_buffer_tier_write(buffer, i, chunk, count);
+      if (count == 0) {
+        break;
+      }
+      _ring_buffer_tier_consume(buffer, i + 1, count);
+      moved += count;
+    }
+  }
+}
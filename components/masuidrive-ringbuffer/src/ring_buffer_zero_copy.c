@@ -0,0 +1,114 @@
+#include "ring_buffer.h"
+#include "ring_buffer_internal.h"
+
+// 書き込み領域の予約関数
+// 予約できた場合はミューテックスを保持したまま戻り、ring_buffer_write_commit で解放する
+// ミューテックスは再帰的に取れないので、確定までに同じタスクからこのバッファを操作するとデッドロックする
+int ring_buffer_write_reserve(RingBuffer *buffer, size_t size, RingBufferSpan spans[2]) {
+  if (!buffer->spsc) {
+    _ring_buffer_lock(buffer);
+  }
+
+  int result;
+  if (__atomic_load_n(&buffer->cancelled, __ATOMIC_RELAXED)) {
+    result = RING_BUFFER_CANCELED;
+  } else if (__atomic_load_n(&buffer->write_finished, __ATOMIC_RELAXED)) {
+    result = RING_BUFFER_FINISHED;
+  } else if (_ring_buffer_spilled(buffer) > 0) {
+    // ファイルやステージングにデータが残っている間は、順序を保つためにメモリの領域を渡さない
+    result = 0;
+  } else {
+    result = _ring_buffer_mem_free_spans(buffer, size, spans);
+  }
+
+  if (result <= 0) {
+    spans[0].size = 0;
+    spans[1].size = 0;
+    if (!buffer->spsc) {
+      _ring_buffer_unlock(buffer);
+    }
+    return result;
+  }
+
+  buffer->write_reserved = result;
+  return result;
+}
+
+// 予約した領域のうち size バイトを確定する関数
+int ring_buffer_write_commit(RingBuffer *buffer, size_t size) {
+  if (size > buffer->write_reserved) {
+    size = buffer->write_reserved;
+  }
+  buffer->write_reserved = 0;
+  if (size > 0) {
+    _ring_buffer_mem_commit(buffer, size);
+    _ring_buffer_notify_readers(buffer);
+  }
+
+  if (!buffer->spsc) {
+    _ring_buffer_unlock(buffer);
+  }
+  return RING_BUFFER_OK;
+}
+
+// 読み込み領域の取得関数
+// メモリが空でファイルやステージングにデータがある場合は、先にメモリへ移動する
+int ring_buffer_read_peek(RingBuffer *buffer, size_t size, RingBufferSpan spans[2]) {
+  bool locked = !_ring_buffer_spsc_reader(buffer) ||
+                (__atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE) == 0 && _ring_buffer_spilled(buffer) > 0);
+  if (locked) {
+    _ring_buffer_lock(buffer);
+  }
+
+  int result;
+  if (__atomic_load_n(&buffer->cancelled, __ATOMIC_RELAXED)) {
+    result = RING_BUFFER_CANCELED;
+    spans[0].size = 0;
+    spans[1].size = 0;
+  } else {
+    if (locked && buffer->memory_len == 0 && _ring_buffer_spilled(buffer) > 0) {
+      _ring_buffer_promote(buffer, buffer->promotion_high);
+    }
+    result = _ring_buffer_mem_data_spans(buffer, size, spans);
+    if (result == 0 && __atomic_load_n(&buffer->write_finished, __ATOMIC_ACQUIRE) &&
+        _ring_buffer_spilled(buffer) == 0) {
+      result = RING_BUFFER_FINISHED;
+    }
+  }
+
+  if (locked) {
+    _ring_buffer_unlock(buffer);
+  }
+  return result;
+}
+
+// 取得した読み込み領域のうち size バイトを消費する関数
+int ring_buffer_read_consume(RingBuffer *buffer, size_t size) {
+  bool locked = !_ring_buffer_spsc_reader(buffer);
+  if (locked) {
+    _ring_buffer_lock(buffer);
+  }
+
+  size_t len = __atomic_load_n(&buffer->memory_len, __ATOMIC_ACQUIRE);
+  if (size > len) {
+    size = len;
+  }
+  _ring_buffer_mem_consume(buffer, size);
+
+  // 補充が必要な場合は SPSC モードでもロックを取る
+  if (_ring_buffer_spilled(buffer) > 0) {
+    if (!locked) {
+      _ring_buffer_lock(buffer);
+      locked = true;
+    }
+    _ring_buffer_refill(buffer);
+  }
+  if (size > 0) {
+    _ring_buffer_notify_writers(buffer);
+  }
+
+  if (locked) {
+    _ring_buffer_unlock(buffer);
+  }
+  return RING_BUFFER_OK;
+}
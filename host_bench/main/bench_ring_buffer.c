@@ -0,0 +1,581 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "ring_buffer.h"
+#include "ring_buffer_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// ベンチマーク
+// 条件の組み合わせごとに1行の JSON (JSON Lines) を標準出力へ書き出す
+// リリース間で比較できるように、キーの名前と単位は変えないこと (変える場合は BENCH_SCHEMA を上げる)
+// 機能ごとのベンチマークの行には variant があり、同じ workload の中で機能の有無や方式を区別する
+
+#define BENCH_SCHEMA 1
+#define BENCH_FILE_NAME "bench_buffer.dat"
+
+// stream で流すデータの合計バイト数
+#ifndef BENCH_STREAM_BYTES
+#define BENCH_STREAM_BYTES (4 * 1024 * 1024)
+#endif
+
+// メモリバッファのサイズ (ファイルのサイズは、これに比率を掛けて決める)
+#ifndef BENCH_MEMORY_SIZE
+#define BENCH_MEMORY_SIZE (16 * 1024)
+#endif
+
+#define BENCH_THREADS_MAX 4
+
+static const size_t bench_chunks[] = {16, 256, 4096};
+static const size_t bench_file_ratios[] = {0, 1, 4, 16, 64}; // 0 はメモリだけ
+static const int bench_threads[] = {1, 2, BENCH_THREADS_MAX};
+
+typedef enum {
+  BENCH_STREAM, // 書き込みと読み込みを同時に動かす
+  BENCH_BURST,  // 書き込みを終えてから読み込む (メモリに入りきらない分はすべてファイルへあふれる)
+} BenchWorkload;
+
+typedef struct {
+  RingBuffer *buffer;
+  size_t chunk;
+  size_t ops;          // 書き込みタスクが書き込む回数、読み込みタスクが記録できる回数の上限
+  size_t done_ops;     // 実際に読み書きした回数
+  uint64_t bytes;      // 実際に読み書きしたバイト数
+  uint32_t *latencies; // 1 回ごとの所要時間 (ns)
+  bool combined;       // ring_buffer_write で書き込む (書き込みの集約はこの経路だけで行う)
+  bool ok;
+  SemaphoreHandle_t done;
+} BenchContext;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void bench_producer_task(void *arg) {
+  BenchContext *ctx = (BenchContext *)arg;
+  uint8_t *chunk = malloc(ctx->chunk);
+  memset(chunk, 0x5a, ctx->chunk);
+  ctx->ok = true;
+  for (size_t i = 0; i < ctx->ops; i++) {
+    uint64_t start = now_ns();
+    int result = ctx->combined ? ring_buffer_write(ctx->buffer, chunk, ctx->chunk)
+                               : ring_buffer_write_timeout(ctx->buffer, chunk, ctx->chunk, portMAX_DELAY);
+    ctx->latencies[i] = (uint32_t)(now_ns() - start);
+    if (result != RING_BUFFER_OK) {
+      ctx->ok = false;
+      break;
+    }
+    ctx->done_ops++;
+    ctx->bytes += ctx->chunk;
+  }
+  free(chunk);
+  xSemaphoreGive(ctx->done);
+  vTaskDelete(NULL);
+}
+
+// 書き込みが終了して RING_BUFFER_FINISHED が返るまで読み込む
+static void bench_consumer_task(void *arg) {
+  BenchContext *ctx = (BenchContext *)arg;
+  uint8_t *chunk = malloc(ctx->chunk);
+  ctx->ok = true;
+  while (true) {
+    uint64_t start = now_ns();
+    int result = ring_buffer_read(ctx->buffer, chunk, ctx->chunk, portMAX_DELAY);
+    uint32_t elapsed = (uint32_t)(now_ns() - start);
+    if (result == RING_BUFFER_FINISHED) {
+      break;
+    }
+    if (result < 0) {
+      ctx->ok = false;
+      break;
+    }
+    if (ctx->done_ops < ctx->ops) {
+      ctx->latencies[ctx->done_ops] = elapsed;
+    }
+    ctx->done_ops++;
+    ctx->bytes += result;
+  }
+  free(chunk);
+  xSemaphoreGive(ctx->done);
+  vTaskDelete(NULL);
+}
+
+// タスクごとの所要時間をまとめて並べ替え、パーセンタイルを書き出す
+static void bench_print_latency(const char *name, BenchContext *ctx, int count) {
+  size_t total = 0;
+  for (int i = 0; i < count; i++) {
+    total += ctx[i].done_ops < ctx[i].ops ? ctx[i].done_ops : ctx[i].ops;
+  }
+  uint32_t *all = malloc((total > 0 ? total : 1) * sizeof(uint32_t));
+  size_t n = 0;
+  for (int i = 0; i < count; i++) {
+    size_t ops = ctx[i].done_ops < ctx[i].ops ? ctx[i].done_ops : ctx[i].ops;
+    memcpy(all + n, ctx[i].latencies, ops * sizeof(uint32_t));
+    n += ops;
+  }
+  qsort(all, n, sizeof(uint32_t), compare_u32);
+  uint32_t p50 = n > 0 ? all[n / 2] : 0;
+  uint32_t p99 = n > 0 ? all[n * 99 / 100] : 0;
+  uint32_t p999 = n > 0 ? all[n * 999 / 1000] : 0;
+  uint32_t max = n > 0 ? all[n - 1] : 0;
+  printf(",\"%s_p50_ns\":%lu,\"%s_p99_ns\":%lu,\"%s_p999_ns\":%lu,\"%s_max_ns\":%lu", name, (unsigned long)p50, name,
+         (unsigned long)p99, name, (unsigned long)p999, name, (unsigned long)max);
+  free(all);
+}
+
+static void bench_run(BenchWorkload workload, size_t chunk, size_t file_ratio, int threads) {
+  size_t memory_size = BENCH_MEMORY_SIZE;
+  size_t file_size = BENCH_MEMORY_SIZE * file_ratio;
+  // burst では、全体がメモリとファイルにちょうど収まる量を書き込む
+  size_t total = workload == BENCH_STREAM ? BENCH_STREAM_BYTES : memory_size + file_size;
+  size_t ops = total / chunk / threads;
+  if (ops == 0) {
+    return;
+  }
+
+  uint8_t *memory = malloc(memory_size);
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, memory_size, BENCH_FILE_NAME, file_size);
+
+  BenchContext producers[BENCH_THREADS_MAX];
+  BenchContext consumers[BENCH_THREADS_MAX];
+  for (int i = 0; i < threads; i++) {
+    producers[i] = (BenchContext){.buffer = &buffer,
+                                  .chunk = chunk,
+                                  .ops = ops,
+                                  .latencies = malloc(ops * sizeof(uint32_t)),
+                                  .done = xSemaphoreCreateBinary()};
+    consumers[i] = (BenchContext){.buffer = &buffer,
+                                  .chunk = chunk,
+                                  .ops = ops * threads,
+                                  .latencies = malloc(ops * threads * sizeof(uint32_t)),
+                                  .done = xSemaphoreCreateBinary()};
+  }
+
+  uint64_t start = now_ns();
+  if (workload == BENCH_STREAM) {
+    for (int i = 0; i < threads; i++) {
+      xTaskCreate(bench_consumer_task, "bench_read", 4096, &consumers[i], 5, NULL);
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    xTaskCreate(bench_producer_task, "bench_write", 4096, &producers[i], 5, NULL);
+  }
+  for (int i = 0; i < threads; i++) {
+    xSemaphoreTake(producers[i].done, portMAX_DELAY);
+  }
+  ring_buffer_finish_write(&buffer);
+  if (workload == BENCH_BURST) {
+    for (int i = 0; i < threads; i++) {
+      xTaskCreate(bench_consumer_task, "bench_read", 4096, &consumers[i], 5, NULL);
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    xSemaphoreTake(consumers[i].done, portMAX_DELAY);
+  }
+  uint64_t elapsed = now_ns() - start;
+  if (elapsed == 0) {
+    elapsed = 1;
+  }
+
+  uint64_t written = 0;
+  uint64_t read = 0;
+  size_t write_ops = 0;
+  size_t read_ops = 0;
+  bool ok = true;
+  for (int i = 0; i < threads; i++) {
+    written += producers[i].bytes;
+    read += consumers[i].bytes;
+    write_ops += producers[i].done_ops;
+    read_ops += consumers[i].done_ops;
+    ok = ok && producers[i].ok && consumers[i].ok;
+  }
+  ok = ok && written == (uint64_t)ops * chunk * threads && read == written;
+
+  double seconds = elapsed / 1e9;
+  printf("{\"schema\":%d,\"workload\":\"%s\",\"chunk\":%lu,\"memory_size\":%lu,\"file_size\":%lu,"
+         "\"producers\":%d,\"consumers\":%d,\"bytes\":%llu,\"seconds\":%.6f,\"mb_per_s\":%.2f,"
+         "\"write_ops_per_s\":%.0f,\"read_ops_per_s\":%.0f",
+         BENCH_SCHEMA, workload == BENCH_STREAM ? "stream" : "burst", (unsigned long)chunk,
+         (unsigned long)memory_size, (unsigned long)file_size, threads, threads, (unsigned long long)read, seconds,
+         read / 1e6 / seconds, write_ops / seconds, read_ops / seconds);
+  bench_print_latency("write", producers, threads);
+  bench_print_latency("read", consumers, threads);
+  printf(",\"ok\":%s}\n", ok ? "true" : "false");
+  fflush(stdout);
+
+  for (int i = 0; i < threads; i++) {
+    free(producers[i].latencies);
+    free(consumers[i].latencies);
+    vSemaphoreDelete(producers[i].done);
+    vSemaphoreDelete(consumers[i].done);
+  }
+  ring_buffer_free(&buffer);
+  free(memory);
+  remove(BENCH_FILE_NAME);
+}
+
+// 機能ごとのベンチマーク
+// 同じ負荷を機能の有無や方式 (variant) ごとに測り、1行ずつ書き出す
+
+// ファイルバッファを主に測るときのメモリバッファのサイズ
+#define BENCH_SMALL_MEMORY_SIZE 128
+#define BENCH_SPSC_CHUNK 24
+#define BENCH_COMBINING_PRODUCERS 4
+#define BENCH_COMBINING_RECORDS 10000
+#define BENCH_COMBINING_RECORD_SIZE 16
+#define BENCH_COMBINING_MEMORY_SIZE 4096
+#define BENCH_FILE_TIER_SIZE (64 * 1024)
+#define BENCH_FILE_TIER_BYTES (16 * 1024 * 1024)
+#define BENCH_FILE_TIER_CHUNK 512
+#define BENCH_PREALLOCATE_SIZE (4 * 1024 * 1024)
+#define BENCH_COMPRESS_FILE_SIZE (256 * 1024)
+#define BENCH_COMPRESS_CHUNK 512
+#define BENCH_SECTOR_FILE_SIZE (16 * 1024)
+#define BENCH_SECTOR_RECORD_SIZE 100
+#define BENCH_SECTOR_RECORDS 10000
+#define BENCH_WRAP_MEMORY_SIZE 4096
+#define BENCH_WRAP_CHUNK 24
+#define BENCH_WRAP_ROUNDS 20000
+
+RING_BUFFER_DEFINE(bench_static_buffer, BENCH_WRAP_MEMORY_SIZE, 0);
+
+// 行の先頭から mb_per_s までを書き出す (続くキーと ok は呼び出し側が書く)
+static void bench_print_feature(const char *workload, const char *variant, uint64_t bytes, uint64_t elapsed) {
+  double seconds = (elapsed > 0 ? elapsed : 1) / 1e9;
+  printf("{\"schema\":%d,\"workload\":\"%s\",\"variant\":\"%s\",\"bytes\":%llu,\"seconds\":%.6f,\"mb_per_s\":%.2f",
+         BENCH_SCHEMA, workload, variant, (unsigned long long)bytes, seconds, bytes / 1e6 / seconds);
+}
+
+static void bench_print_end(bool ok) {
+  printf(",\"ok\":%s}\n", ok ? "true" : "false");
+  fflush(stdout);
+}
+
+// 書き込みタスク producers 個と読み込みタスク1個を同時に動かし、書き込みの回数と所要時間を書き出す
+static void bench_run_concurrent(const char *workload, const char *variant, RingBuffer *buffer, size_t chunk,
+                                 int producers, size_t ops, bool combined) {
+  BenchContext writers[BENCH_THREADS_MAX];
+  BenchContext reader = {.buffer = buffer,
+                         .chunk = chunk,
+                         .ops = ops * producers,
+                         .latencies = malloc(ops * producers * sizeof(uint32_t)),
+                         .done = xSemaphoreCreateBinary()};
+  uint64_t start = now_ns();
+  xTaskCreate(bench_consumer_task, "bench_read", 4096, &reader, 5, NULL);
+  for (int i = 0; i < producers; i++) {
+    writers[i] = (BenchContext){.buffer = buffer,
+                                .chunk = chunk,
+                                .ops = ops,
+                                .latencies = malloc(ops * sizeof(uint32_t)),
+                                .combined = combined,
+                                .done = xSemaphoreCreateBinary()};
+    xTaskCreate(bench_producer_task, "bench_write", 4096, &writers[i], 5, NULL);
+  }
+  for (int i = 0; i < producers; i++) {
+    xSemaphoreTake(writers[i].done, portMAX_DELAY);
+  }
+  ring_buffer_finish_write(buffer);
+  xSemaphoreTake(reader.done, portMAX_DELAY);
+  uint64_t elapsed = now_ns() - start;
+
+  bool ok = reader.ok && reader.bytes == (uint64_t)ops * chunk * producers;
+  for (int i = 0; i < producers; i++) {
+    ok = ok && writers[i].ok;
+  }
+  bench_print_feature(workload, variant, reader.bytes, elapsed);
+  printf(",\"chunk\":%lu,\"producers\":%d,\"write_ops_per_s\":%.0f", (unsigned long)chunk, producers,
+         (double)ops * producers / ((elapsed > 0 ? elapsed : 1) / 1e9));
+  bench_print_latency("write", writers, producers);
+  bench_print_end(ok);
+
+  for (int i = 0; i < producers; i++) {
+    free(writers[i].latencies);
+    vSemaphoreDelete(writers[i].done);
+  }
+  free(reader.latencies);
+  vSemaphoreDelete(reader.done);
+}
+
+// SPSC モードとミューテックスの経路で、書き込みタスクと読み込みタスクを1個ずつ動かす
+static void bench_spsc(void) {
+  static uint8_t memory[BENCH_MEMORY_SIZE];
+  for (int spsc = 0; spsc <= 1; spsc++) {
+    RingBuffer buffer;
+    ring_buffer_init(&buffer, memory, sizeof(memory), BENCH_FILE_NAME, BENCH_MEMORY_SIZE);
+    ring_buffer_set_spsc(&buffer, spsc);
+    bench_run_concurrent("spsc", spsc ? "spsc" : "mutex", &buffer, BENCH_SPSC_CHUNK, 1,
+                         BENCH_STREAM_BYTES / BENCH_SPSC_CHUNK, false);
+    ring_buffer_free(&buffer);
+    remove(BENCH_FILE_NAME);
+  }
+}
+
+// 書き込みの集約の有無で、小さな書き込みを複数のタスクから行う
+// ファイルには全体が収まるので、書き込みがあふれることはない
+static void bench_combining(void) {
+  static uint8_t memory[BENCH_COMBINING_MEMORY_SIZE];
+  size_t file_size = BENCH_COMBINING_PRODUCERS * BENCH_COMBINING_RECORDS * BENCH_COMBINING_RECORD_SIZE;
+  for (int combining = 0; combining <= 1; combining++) {
+    RingBuffer buffer;
+    ring_buffer_init(&buffer, memory, sizeof(memory), BENCH_FILE_NAME, file_size);
+    bool ok = ring_buffer_set_write_combining(&buffer, combining);
+    if (ok) {
+      bench_run_concurrent("combining", combining ? "combining" : "mutex", &buffer, BENCH_COMBINING_RECORD_SIZE,
+                           BENCH_COMBINING_PRODUCERS, BENCH_COMBINING_RECORDS, true);
+    }
+    ring_buffer_free(&buffer);
+    remove(BENCH_FILE_NAME);
+  }
+}
+
+// ファイルバッファだけで、半分ほど埋まった状態を保って書き込みと読み込みを繰り返す
+static void bench_file_tier(void) {
+  static uint8_t memory[BENCH_MEMORY_SIZE];
+  static uint8_t chunk[BENCH_FILE_TIER_CHUNK];
+  for (int mapped = 0; mapped <= 1; mapped++) {
+    RingBuffer buffer;
+    ring_buffer_init(&buffer, memory, sizeof(memory), BENCH_FILE_NAME, BENCH_FILE_TIER_SIZE);
+    if (!mapped) {
+      _ring_buffer_file_unmap(&buffer);
+    }
+    uint8_t write_counter = 0;
+    uint8_t read_counter = 0;
+    bool ok = true;
+    uint64_t start = now_ns();
+    for (size_t sent = 0; sent < BENCH_FILE_TIER_BYTES && ok; sent += sizeof(chunk)) {
+      if (_ring_buffer_file_usage(&buffer) > BENCH_FILE_TIER_SIZE / 2) {
+        ok = _ring_buffer_file_read(&buffer, chunk, sizeof(chunk)) == sizeof(chunk) && chunk[0] == read_counter++;
+      }
+      memset(chunk, write_counter++, sizeof(chunk));
+      ok = ok && _ring_buffer_file_write(&buffer, chunk, sizeof(chunk)) == RING_BUFFER_OK;
+    }
+    uint64_t elapsed = now_ns() - start;
+    bench_print_feature("file_tier", mapped ? "mmap" : "stdio", BENCH_FILE_TIER_BYTES, elapsed);
+    printf(",\"file_size\":%lu,\"chunk\":%lu", (unsigned long)BENCH_FILE_TIER_SIZE, (unsigned long)sizeof(chunk));
+    bench_print_end(ok);
+    ring_buffer_free(&buffer);
+    remove(BENCH_FILE_NAME);
+  }
+}
+
+// ファイルを確保する方法ごとの初期化時間
+// 比較のため、以前の1バイトずつのゼロ埋めも bytewise として測る
+static void bench_preallocate(void) {
+  static uint8_t memory[BENCH_MEMORY_SIZE];
+  static const struct {
+    const char *name;
+    RingBufferPreallocate mode;
+  } modes[] = {{"lazy", RING_BUFFER_PREALLOCATE_LAZY},
+               {"zero_fill", RING_BUFFER_PREALLOCATE_ZERO_FILL},
+               {"truncate", RING_BUFFER_PREALLOCATE_TRUNCATE}};
+
+  remove(BENCH_FILE_NAME);
+  uint64_t start = now_ns();
+  FILE *file = fopen(BENCH_FILE_NAME, "w+b");
+  uint8_t zero = 0;
+  for (size_t i = 0; file != NULL && i < BENCH_PREALLOCATE_SIZE; i++) {
+    fwrite(&zero, 1, 1, file);
+  }
+  bool ok = file != NULL && fflush(file) == 0;
+  if (file != NULL) {
+    fclose(file);
+  }
+  uint64_t elapsed = now_ns() - start;
+  bench_print_feature("preallocate", "bytewise", BENCH_PREALLOCATE_SIZE, elapsed);
+  bench_print_end(ok);
+
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    remove(BENCH_FILE_NAME);
+    RingBuffer buffer;
+    RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+    config.preallocate = modes[m].mode;
+    start = now_ns();
+    ring_buffer_init_with_config(&buffer, memory, sizeof(memory), BENCH_FILE_NAME, BENCH_PREALLOCATE_SIZE, &config);
+    elapsed = now_ns() - start;
+    ok = buffer.file != NULL;
+    if (ok && modes[m].mode != RING_BUFFER_PREALLOCATE_LAZY) {
+      fseek(buffer.file, 0, SEEK_END);
+      ok = ftell(buffer.file) == BENCH_PREALLOCATE_SIZE;
+      buffer.file_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+    }
+    bench_print_feature("preallocate", modes[m].name, BENCH_PREALLOCATE_SIZE, elapsed);
+    bench_print_end(ok);
+    ring_buffer_free(&buffer);
+  }
+  remove(BENCH_FILE_NAME);
+}
+
+// JSON 形式のセンサー値を total バイト生成する
+static void bench_make_json_samples(uint8_t *data, size_t total) {
+  size_t used = 0;
+  for (unsigned long t = 0; used < total; t++) {
+    char line[96];
+    int n = snprintf(line, sizeof(line), "{\"ts\":%lu,\"temp\":%lu.%lu,\"hum\":%lu,\"status\":\"ok\"}\n",
+                     1700000000UL + t, 20 + t % 7, t % 10, 40 + t % 13);
+    size_t count = (size_t)n < total - used ? (size_t)n : total - used;
+    memcpy(data + used, line, count);
+    used += count;
+  }
+}
+
+// 差分符号化したセンサー値 (ゆっくり変化する値の int16 の差分) を total バイト生成する
+static void bench_make_delta_samples(uint8_t *data, size_t total) {
+  uint32_t seed = 1;
+  for (size_t i = 0; i + 1 < total; i += 2) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t r = (seed >> 16) % 16;
+    int16_t delta = r == 0 ? -1 : r == 1 ? 1 : 0;
+    memcpy(data + i, &delta, sizeof(delta));
+  }
+}
+
+// 圧縮の有無で、ファイルバッファの半分ずつ書いてから読み出すことを繰り返す
+static void bench_compress(void) {
+  static uint8_t memory[BENCH_SMALL_MEMORY_SIZE];
+  static uint8_t work[RING_BUFFER_COMPRESS_WORK_SIZE];
+  static uint8_t data[BENCH_COMPRESS_FILE_SIZE / 2];
+  static uint8_t read_data[BENCH_COMPRESS_CHUNK];
+  const char *kinds[] = {"json", "delta"};
+  for (int kind = 0; kind < 2; kind++) {
+    if (kind == 0) {
+      bench_make_json_samples(data, sizeof(data));
+    } else {
+      bench_make_delta_samples(data, sizeof(data));
+    }
+    for (int compressed = 0; compressed <= 1; compressed++) {
+      RingBuffer buffer;
+      RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+      config.compress_work = compressed ? work : NULL;
+      ring_buffer_init_with_config(&buffer, memory, sizeof(memory), BENCH_FILE_NAME, BENCH_COMPRESS_FILE_SIZE, &config);
+
+      bool ok = true;
+      uint64_t start = now_ns();
+      for (size_t total = 0; total < BENCH_STREAM_BYTES && ok; total += sizeof(data)) {
+        for (size_t sent = 0; sent < sizeof(data) && ok; sent += BENCH_COMPRESS_CHUNK) {
+          ok = ring_buffer_write(&buffer, data + sent, BENCH_COMPRESS_CHUNK) == RING_BUFFER_OK;
+        }
+        for (size_t received = 0; received < sizeof(data) && ok; received += BENCH_COMPRESS_CHUNK) {
+          ok = ring_buffer_read(&buffer, read_data, BENCH_COMPRESS_CHUNK, 0) == BENCH_COMPRESS_CHUNK &&
+               memcmp(data + received, read_data, BENCH_COMPRESS_CHUNK) == 0;
+        }
+      }
+      uint64_t elapsed = now_ns() - start;
+      RingBufferCompressStats stats;
+      ring_buffer_get_compress_stats(&buffer, &stats);
+      double ratio = stats.stored_bytes > 0 ? (double)stats.raw_bytes / stats.stored_bytes : 1.0;
+      bench_print_feature("compress", compressed ? "compressed" : "plain", BENCH_STREAM_BYTES, elapsed);
+      printf(",\"data\":\"%s\",\"ratio\":%.2f", kinds[kind], ratio);
+      bench_print_end(ok);
+      ring_buffer_free(&buffer);
+      remove(BENCH_FILE_NAME);
+    }
+  }
+}
+
+// セクタへの集約の有無で小さなレコードを書き込み、書き込み増幅 (触れたセクタのバイト数 / 受け付けたバイト数) を測る
+static void bench_write_amplification(void) {
+  static uint8_t memory[BENCH_SMALL_MEMORY_SIZE];
+  static uint8_t sector_buffer[RING_BUFFER_SECTOR_SIZE];
+  static uint8_t read_data[BENCH_SECTOR_RECORD_SIZE];
+  uint8_t record[BENCH_SECTOR_RECORD_SIZE];
+  for (int coalesced = 0; coalesced <= 1; coalesced++) {
+    RingBuffer buffer;
+    RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+    config.sector_buffer = coalesced ? sector_buffer : NULL;
+    ring_buffer_init_with_config(&buffer, memory, sizeof(memory), BENCH_FILE_NAME, BENCH_SECTOR_FILE_SIZE, &config);
+    _ring_buffer_file_unmap(&buffer);
+
+    // 読み込みで空きを作りながら書き込むので、レコードはメモリを越えてファイルへ流れ続ける
+    bool ok = true;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < BENCH_SECTOR_RECORDS && ok; i++) {
+      if (ring_buffer_occupied_size(&buffer) + sizeof(record) > sizeof(memory) + BENCH_SECTOR_FILE_SIZE / 2) {
+        ok = ring_buffer_read(&buffer, read_data, sizeof(read_data), 0) == sizeof(read_data);
+      }
+      memset(record, (uint8_t)i, sizeof(record));
+      ok = ok && ring_buffer_write(&buffer, record, sizeof(record)) == RING_BUFFER_OK;
+    }
+    ok = ok && ring_buffer_flush(&buffer, 0) == RING_BUFFER_OK;
+    uint64_t elapsed = now_ns() - start;
+
+    RingBufferWriteStats stats;
+    ring_buffer_get_write_stats(&buffer, &stats);
+    double amplification =
+        stats.accepted > 0 ? (double)stats.sector_writes * RING_BUFFER_SECTOR_SIZE / stats.accepted : 0.0;
+    bench_print_feature("write_amplification", coalesced ? "coalesced" : "direct", stats.accepted, elapsed);
+    printf(",\"record_size\":%d,\"sector_writes\":%llu,\"amplification\":%.2f", BENCH_SECTOR_RECORD_SIZE,
+           (unsigned long long)stats.sector_writes, amplification);
+    bench_print_end(ok);
+    ring_buffer_free(&buffer);
+    remove(BENCH_FILE_NAME);
+  }
+}
+
+// メモリだけで完結する書き込み1回あたりの所要時間を、バッファの作り方ごとに測る
+// define は RING_BUFFER_DEFINE、pow2 と non_pow2 は ring_buffer_init で作り、non_pow2 は比較で折り返す
+// 読み込みは測らず、メモリがいっぱいになるたびにまとめて空ける
+static void bench_run_wrap(const char *variant, RingBuffer *buffer) {
+  static uint8_t chunk[BENCH_WRAP_CHUNK];
+  static uint8_t read_data[BENCH_WRAP_MEMORY_SIZE];
+  size_t per_round = buffer->memory_size / sizeof(chunk);
+  uint64_t elapsed = 0;
+  bool ok = true;
+  for (size_t round = 0; round < BENCH_WRAP_ROUNDS && ok; round++) {
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < per_round; i++) {
+      ok = ok && ring_buffer_write(buffer, chunk, sizeof(chunk)) == RING_BUFFER_OK;
+    }
+    elapsed += now_ns() - start;
+    ok = ok && ring_buffer_read(buffer, read_data, per_round * sizeof(chunk), 0) == (int)(per_round * sizeof(chunk));
+  }
+  uint64_t writes = (uint64_t)BENCH_WRAP_ROUNDS * per_round;
+  bench_print_feature("memory_wrap", variant, writes * sizeof(chunk), elapsed);
+  printf(",\"memory_size\":%lu,\"chunk\":%d,\"ns_per_write\":%.1f", (unsigned long)buffer->memory_size,
+         BENCH_WRAP_CHUNK, (double)elapsed / writes);
+  bench_print_end(ok);
+  ring_buffer_free(buffer);
+}
+
+static void bench_memory_wrap(void) {
+  static uint8_t memory[BENCH_WRAP_MEMORY_SIZE];
+  RING_BUFFER_INIT_STATIC(bench_static_buffer, BENCH_FILE_NAME, NULL);
+  bench_run_wrap("define", &bench_static_buffer);
+
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, BENCH_WRAP_MEMORY_SIZE, BENCH_FILE_NAME, 0);
+  bench_run_wrap("pow2", &buffer);
+  ring_buffer_init(&buffer, memory, BENCH_WRAP_MEMORY_SIZE - BENCH_WRAP_CHUNK, BENCH_FILE_NAME, 0);
+  bench_run_wrap("non_pow2", &buffer);
+  remove(BENCH_FILE_NAME);
+}
+
+void app_main(void) {
+  for (int w = BENCH_STREAM; w <= BENCH_BURST; w++) {
+    for (size_t c = 0; c < sizeof(bench_chunks) / sizeof(bench_chunks[0]); c++) {
+      for (size_t r = 0; r < sizeof(bench_file_ratios) / sizeof(bench_file_ratios[0]); r++) {
+        for (size_t t = 0; t < sizeof(bench_threads) / sizeof(bench_threads[0]); t++) {
+          bench_run((BenchWorkload)w, bench_chunks[c], bench_file_ratios[r], bench_threads[t]);
+        }
+      }
+    }
+  }
+  bench_spsc();
+  bench_combining();
+  bench_file_tier();
+  bench_preallocate();
+  bench_compress();
+  bench_write_amplification();
+  bench_memory_wrap();
+  exit(0);
+}
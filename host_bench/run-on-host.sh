@@ -0,0 +1,6 @@
+#!/bin/sh
+
+idf.py --preview set-target linux && \
+idf.py build && \
+rm -f bench_buffer.dat && \
+./build/host_bench.elf
@@ -3,6 +3,8 @@
 #include "ring_buffer.h"
 #include "ring_buffer_internal.h"
 #include "unity.h"
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 // Assume these are defined somewhere
@@ -139,7 +141,7 @@ TEST_CASE("Write 3 blocks of size (memory_size - 1), read 1 block, write 1 more
   // Read all remaining
   size_t total_read = 0;
   while (total_read < 3 * sizeof(write_data)) {
-    size_t read = ring_buffer_read(&buffer, read_data, sizeof(read_data), portMAX_DELAY);
+    size_t read = ring_buffer_read(&buffer, read_data, sizeof(read_data), 0);
     total_read += read;
     if (read < sizeof(read_data)) {
       break; // End of data
@@ -177,7 +179,7 @@ TEST_CASE("Write multiple blocks of size (memory_size / 2), partially read, writ
   size_t total_read = 0;
   uint8_t read_data[MEM_BUFFER_SIZE];
   while (true) {
-    size_t read = ring_buffer_read(&buffer, read_data, sizeof(read_data), portMAX_DELAY);
+    size_t read = ring_buffer_read(&buffer, read_data, sizeof(read_data), 0);
     total_read += read;
     if (read < sizeof(read_data)) {
       break; // End of data
@@ -217,6 +219,1070 @@ TEST_CASE("ring buffer cancel", "[ring_buffer]") {
   ring_buffer_free(&buffer);
 }
 
+TEST_CASE("ring buffer promotion watermarks", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  ring_buffer_set_promotion_watermarks(&buffer, MEM_BUFFER_SIZE / 4, MEM_BUFFER_SIZE * 3 / 4);
+
+  uint8_t write_data[MEM_BUFFER_SIZE + FILE_MAX_SIZE / 2];
+  for (size_t i = 0; i < sizeof(write_data); i++) {
+    write_data[i] = (uint8_t)i;
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, write_data, sizeof(write_data)));
+
+  // 低水位を下回らなければ補充しない
+  uint8_t read_data[sizeof(write_data)];
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE / 2, ring_buffer_read(&buffer, read_data, MEM_BUFFER_SIZE / 2, portMAX_DELAY));
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE / 2, buffer.memory_len);
+
+  // 低水位を下回ると高水位まで補充する
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE / 2,
+                    ring_buffer_read(&buffer, read_data + MEM_BUFFER_SIZE / 2, MEM_BUFFER_SIZE / 2, portMAX_DELAY));
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE * 3 / 4, buffer.memory_len);
+
+  // メモリに空きがあってもファイルにデータがあれば順序を保って書き込む
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, write_data, 10));
+
+  size_t remain = sizeof(write_data) - MEM_BUFFER_SIZE;
+  TEST_ASSERT_EQUAL(remain, ring_buffer_read(&buffer, read_data + MEM_BUFFER_SIZE, remain, portMAX_DELAY));
+  TEST_ASSERT_EQUAL_MEMORY(write_data, read_data, sizeof(write_data));
+  TEST_ASSERT_EQUAL(10, ring_buffer_read(&buffer, read_data, 10, portMAX_DELAY));
+  TEST_ASSERT_EQUAL_MEMORY(write_data, read_data, 10);
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer background promotion task", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  TEST_ASSERT_TRUE(ring_buffer_start_promotion_task(&buffer, 4096, 5));
+
+  uint8_t write_data[MEM_BUFFER_SIZE + FILE_MAX_SIZE];
+  for (size_t i = 0; i < sizeof(write_data); i++) {
+    write_data[i] = (uint8_t)(i * 7);
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, write_data, sizeof(write_data)));
+
+  uint8_t read_data[sizeof(write_data)];
+  size_t total_read = 0;
+  for (int i = 0; i < 1000 && total_read < sizeof(write_data); i++) {
+    total_read += ring_buffer_read(&buffer, read_data + total_read, MEM_BUFFER_SIZE / 2, portMAX_DELAY);
+    if (buffer.memory_len == 0) {
+      vTaskDelay(1);
+    }
+  }
+  TEST_ASSERT_EQUAL(sizeof(write_data), total_read);
+  TEST_ASSERT_EQUAL_MEMORY(write_data, read_data, sizeof(write_data));
+
+  ring_buffer_free(&buffer);
+}
+
+typedef struct {
+  RingBuffer *buffer;
+  const uint8_t *data;
+  size_t size;
+  TickType_t delay;
+  int action;
+  SemaphoreHandle_t done;
+} DelayedAction;
+
+#define DELAYED_WRITE 0
+#define DELAYED_READ 1
+#define DELAYED_FINISH 2
+#define DELAYED_CANCEL 3
+
+static void delayed_action_task(void *arg) {
+  DelayedAction *action = (DelayedAction *)arg;
+  vTaskDelay(action->delay);
+  uint8_t sink[MEM_BUFFER_SIZE];
+  switch (action->action) {
+  case DELAYED_WRITE:
+    ring_buffer_write(action->buffer, action->data, action->size);
+    break;
+  case DELAYED_READ:
+    ring_buffer_read(action->buffer, sink, action->size, 0);
+    break;
+  case DELAYED_FINISH:
+    ring_buffer_finish_write(action->buffer);
+    break;
+  case DELAYED_CANCEL:
+    ring_buffer_cancel(action->buffer);
+    break;
+  }
+  xSemaphoreGive(action->done);
+  vTaskDelete(NULL);
+}
+
+static void start_delayed_action(DelayedAction *action, RingBuffer *buffer, int kind, const uint8_t *data,
+                                 size_t size) {
+  action->buffer = buffer;
+  action->data = data;
+  action->size = size;
+  action->delay = pdMS_TO_TICKS(20);
+  action->action = kind;
+  action->done = xSemaphoreCreateBinary();
+  xTaskCreate(delayed_action_task, "delayed", 4096, action, 5, NULL);
+}
+
+static void wait_delayed_action(DelayedAction *action) {
+  xSemaphoreTake(action->done, portMAX_DELAY);
+  vSemaphoreDelete(action->done);
+}
+
+TEST_CASE("ring buffer read times out with partial data", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, (const uint8_t *)"Hello", 5));
+
+  uint8_t read_data[10];
+  TickType_t start = xTaskGetTickCount();
+  TEST_ASSERT_EQUAL(5, ring_buffer_read(&buffer, read_data, sizeof(read_data), pdMS_TO_TICKS(30)));
+  TEST_ASSERT_GREATER_OR_EQUAL(pdMS_TO_TICKS(30), xTaskGetTickCount() - start);
+  TEST_ASSERT_EQUAL_MEMORY("Hello", read_data, 5);
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer blocking read is woken by writer", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, (const uint8_t *)"Hello", 5));
+  DelayedAction action;
+  start_delayed_action(&action, &buffer, DELAYED_WRITE, (const uint8_t *)"World", 5);
+
+  uint8_t read_data[10];
+  TEST_ASSERT_EQUAL(10, ring_buffer_read(&buffer, read_data, sizeof(read_data), portMAX_DELAY));
+  TEST_ASSERT_EQUAL_MEMORY("HelloWorld", read_data, 10);
+  wait_delayed_action(&action);
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer blocking read is woken by finish_write", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, (const uint8_t *)"Hello", 5));
+  DelayedAction action;
+  start_delayed_action(&action, &buffer, DELAYED_FINISH, NULL, 0);
+
+  uint8_t read_data[10];
+  TEST_ASSERT_EQUAL(5, ring_buffer_read(&buffer, read_data, sizeof(read_data), portMAX_DELAY));
+  TEST_ASSERT_EQUAL(RING_BUFFER_FINISHED, ring_buffer_read(&buffer, read_data, sizeof(read_data), portMAX_DELAY));
+  wait_delayed_action(&action);
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer blocking read is woken by cancel", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  DelayedAction action;
+  start_delayed_action(&action, &buffer, DELAYED_CANCEL, NULL, 0);
+
+  uint8_t read_data[10];
+  TEST_ASSERT_EQUAL(RING_BUFFER_CANCELED, ring_buffer_read(&buffer, read_data, sizeof(read_data), portMAX_DELAY));
+  wait_delayed_action(&action);
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer write with timeout waits for free space", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  uint8_t write_data[MEM_BUFFER_SIZE + FILE_MAX_SIZE];
+  memset(write_data, 'A', sizeof(write_data));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, write_data, sizeof(write_data)));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OVERFLOW, ring_buffer_write_timeout(&buffer, write_data, 16, pdMS_TO_TICKS(10)));
+
+  DelayedAction action;
+  start_delayed_action(&action, &buffer, DELAYED_READ, NULL, 32);
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write_timeout(&buffer, write_data, 32, portMAX_DELAY));
+  wait_delayed_action(&action);
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer overflow policy rejects the whole write", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  ring_buffer_set_overflow_policy(&buffer, RING_BUFFER_OVERFLOW_REJECT, 0);
+
+  uint8_t write_data[MEM_BUFFER_SIZE + FILE_MAX_SIZE + 1];
+  memset(write_data, 'A', sizeof(write_data));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OVERFLOW, ring_buffer_write(&buffer, write_data, sizeof(write_data)));
+  TEST_ASSERT_EQUAL(0, ring_buffer_occupied_size(&buffer));
+
+  RingBufferWriteReport report;
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write_report(&buffer, write_data, MEM_BUFFER_SIZE + 100, 0, &report));
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + 100, report.accepted);
+  TEST_ASSERT_EQUAL(RING_BUFFER_OVERFLOW, ring_buffer_write_report(&buffer, write_data, FILE_MAX_SIZE, 0, &report));
+  TEST_ASSERT_EQUAL(0, report.accepted);
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + 100, ring_buffer_occupied_size(&buffer));
+
+  RingBufferOverflowStats stats;
+  ring_buffer_get_overflow_stats(&buffer, &stats);
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + 100, stats.accepted);
+  TEST_ASSERT_EQUAL(0, stats.dropped);
+  TEST_ASSERT_EQUAL(sizeof(write_data) + FILE_MAX_SIZE, stats.rejected);
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer overflow policy drops the oldest data", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  ring_buffer_set_overflow_policy(&buffer, RING_BUFFER_OVERFLOW_DROP_OLDEST, 0);
+
+  uint8_t data[(MEM_BUFFER_SIZE + FILE_MAX_SIZE) * 2];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)(i * 7);
+  }
+  size_t capacity = MEM_BUFFER_SIZE + FILE_MAX_SIZE;
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, capacity));
+
+  // ファイルにデータがある間はメモリに書き込めないので、メモリの分とファイルの先頭の足りない分を捨てる
+  RingBufferWriteReport report;
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write_report(&buffer, data + capacity, 100, 0, &report));
+  TEST_ASSERT_EQUAL(100, report.accepted);
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + 100, report.dropped);
+  TEST_ASSERT_EQUAL(FILE_MAX_SIZE, ring_buffer_occupied_size(&buffer));
+
+  uint8_t read_data[sizeof(data)];
+  TEST_ASSERT_EQUAL(FILE_MAX_SIZE, ring_buffer_read(&buffer, read_data, capacity, 0));
+  TEST_ASSERT_EQUAL_MEMORY(data + MEM_BUFFER_SIZE + 100, read_data, FILE_MAX_SIZE);
+
+  // 全体が入りきらない書き込みは、末尾の入る分だけを残す
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, 10));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write_report(&buffer, data, sizeof(data), 0, &report));
+  TEST_ASSERT_EQUAL(capacity, report.accepted);
+  TEST_ASSERT_EQUAL(10 + sizeof(data) - capacity, report.dropped);
+  TEST_ASSERT_EQUAL(capacity, ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(data + sizeof(data) - capacity, read_data, capacity);
+
+  RingBufferOverflowStats stats;
+  ring_buffer_get_overflow_stats(&buffer, &stats);
+  TEST_ASSERT_EQUAL(capacity + 100 + 10 + capacity, stats.accepted);
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + 100 + 10 + sizeof(data) - capacity, stats.dropped);
+  TEST_ASSERT_EQUAL(0, stats.rejected);
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer overflow policy drops memory and the file shortage without promoting", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  ring_buffer_set_overflow_policy(&buffer, RING_BUFFER_OVERFLOW_DROP_OLDEST, 0);
+
+  uint8_t data[MEM_BUFFER_SIZE + FILE_MAX_SIZE + 10];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)(i * 3);
+  }
+  size_t capacity = MEM_BUFFER_SIZE + FILE_MAX_SIZE;
+  size_t free_space = 4;
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, capacity - free_space));
+
+  // ファイルからメモリへは移さないので、メモリは空のまま、ファイルの先頭から size - free だけを捨てる
+  RingBufferWriteReport report;
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write_report(&buffer, data + capacity - free_space, 10, 0, &report));
+  TEST_ASSERT_EQUAL(10, report.accepted);
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + 10 - free_space, report.dropped);
+  TEST_ASSERT_EQUAL(0, buffer.memory_len);
+  TEST_ASSERT_EQUAL(FILE_MAX_SIZE, ring_buffer_occupied_size(&buffer));
+
+  uint8_t read_data[sizeof(data)];
+  TEST_ASSERT_EQUAL(FILE_MAX_SIZE, ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(data + MEM_BUFFER_SIZE + 10 - free_space, read_data, FILE_MAX_SIZE);
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer overflow policy waits for the spill task instead of dropping", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  uint8_t staging[64];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  ring_buffer_set_overflow_policy(&buffer, RING_BUFFER_OVERFLOW_DROP_OLDEST, 0);
+  TEST_ASSERT_TRUE(ring_buffer_start_spill_task(&buffer, staging, sizeof(staging), 4096, 5));
+
+  uint8_t data[MEM_BUFFER_SIZE + 100];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)(i * 3);
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, MEM_BUFFER_SIZE));
+
+  // メモリはいっぱいで、ステージングより大きいが、ファイルには入るので何も捨てない (size - free = 0)
+  RingBufferWriteReport report;
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write_report(&buffer, data + MEM_BUFFER_SIZE, 100, 0, &report));
+  TEST_ASSERT_EQUAL(100, report.accepted);
+  TEST_ASSERT_EQUAL(0, report.dropped);
+
+  uint8_t read_data[sizeof(data)];
+  TEST_ASSERT_EQUAL(sizeof(data), ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, sizeof(data));
+  ring_buffer_free(&buffer);
+}
+
+#define DROP_SPSC_TOTAL_BYTES (256 * 1024)
+#define DROP_SPSC_CHUNK_SIZE 24
+
+typedef struct {
+  RingBuffer *buffer;
+  size_t received;
+  uint8_t last;
+  bool ok;
+  SemaphoreHandle_t done;
+} DropSpscContext;
+
+// 書き込む位置の下位8ビットを値にして書き込み、最後に書き込みを終了する
+static void drop_spsc_producer_task(void *arg) {
+  DropSpscContext *ctx = (DropSpscContext *)arg;
+  uint8_t chunk[DROP_SPSC_CHUNK_SIZE];
+  for (size_t sent = 0; sent < DROP_SPSC_TOTAL_BYTES; sent += sizeof(chunk)) {
+    for (size_t i = 0; i < sizeof(chunk); i++) {
+      chunk[i] = (uint8_t)(sent + i);
+    }
+    ring_buffer_write(ctx->buffer, chunk, sizeof(chunk));
+  }
+  ring_buffer_finish_write(ctx->buffer);
+  xSemaphoreGive(ctx->done);
+  vTaskDelete(NULL);
+}
+
+static void drop_spsc_consumer_task(void *arg) {
+  DropSpscContext *ctx = (DropSpscContext *)arg;
+  uint8_t chunk[DROP_SPSC_CHUNK_SIZE];
+  ctx->ok = true;
+  while (true) {
+    int result = ring_buffer_read(ctx->buffer, chunk, sizeof(chunk), portMAX_DELAY);
+    if (result == RING_BUFFER_FINISHED) {
+      break;
+    }
+    if (result <= 0) {
+      ctx->ok = false;
+      break;
+    }
+    ctx->received += result;
+    ctx->last = chunk[result - 1];
+  }
+  xSemaphoreGive(ctx->done);
+  vTaskDelete(NULL);
+}
+
+TEST_CASE("ring buffer overflow policy drops the oldest data under SPSC contention", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  ring_buffer_set_spsc(&buffer, true);
+  ring_buffer_set_overflow_policy(&buffer, RING_BUFFER_OVERFLOW_DROP_OLDEST, 0);
+
+  DropSpscContext producer = {.buffer = &buffer, .done = xSemaphoreCreateBinary()};
+  DropSpscContext consumer = {.buffer = &buffer, .done = xSemaphoreCreateBinary()};
+  xTaskCreate(drop_spsc_consumer_task, "consumer", 4096, &consumer, 5, NULL);
+  xTaskCreate(drop_spsc_producer_task, "producer", 4096, &producer, 5, NULL);
+  xSemaphoreTake(producer.done, portMAX_DELAY);
+  xSemaphoreTake(consumer.done, portMAX_DELAY);
+
+  // 読み込んだ分と捨てた分を合わせると書き込んだ分になり、最後に書き込んだデータまで読める
+  RingBufferOverflowStats stats;
+  ring_buffer_get_overflow_stats(&buffer, &stats);
+  TEST_ASSERT_TRUE(consumer.ok);
+  TEST_ASSERT_EQUAL(DROP_SPSC_TOTAL_BYTES, stats.accepted);
+  TEST_ASSERT_EQUAL(DROP_SPSC_TOTAL_BYTES, consumer.received + stats.dropped);
+  TEST_ASSERT_EQUAL((uint8_t)(DROP_SPSC_TOTAL_BYTES - 1), consumer.last);
+  TEST_ASSERT_EQUAL(0, ring_buffer_occupied_size(&buffer));
+
+  vSemaphoreDelete(producer.done);
+  vSemaphoreDelete(consumer.done);
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer overflow policy drops unread data from reader cursors", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, 0);
+  ring_buffer_set_overflow_policy(&buffer, RING_BUFFER_OVERFLOW_DROP_OLDEST, 0);
+  int reader = ring_buffer_add_reader(&buffer, RING_BUFFER_READER_BLOCK);
+
+  uint8_t data[MEM_BUFFER_SIZE + 32];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)i;
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, MEM_BUFFER_SIZE));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data + MEM_BUFFER_SIZE, 32));
+  TEST_ASSERT_EQUAL(32, ring_buffer_reader_skipped(&buffer, reader));
+
+  uint8_t read_data[MEM_BUFFER_SIZE];
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE, ring_buffer_reader_read(&buffer, reader, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(data + 32, read_data, MEM_BUFFER_SIZE);
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer overflow policy blocks until the whole write fits", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  ring_buffer_set_overflow_policy(&buffer, RING_BUFFER_OVERFLOW_BLOCK, pdMS_TO_TICKS(10));
+
+  uint8_t write_data[MEM_BUFFER_SIZE + FILE_MAX_SIZE];
+  memset(write_data, 'A', sizeof(write_data));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, write_data, sizeof(write_data) - 16));
+  TEST_ASSERT_EQUAL(RING_BUFFER_TIMEOUT, ring_buffer_write(&buffer, write_data, 32));
+  TEST_ASSERT_EQUAL(sizeof(write_data) - 16, ring_buffer_occupied_size(&buffer));
+
+  DelayedAction action;
+  start_delayed_action(&action, &buffer, DELAYED_READ, NULL, 16);
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write_timeout(&buffer, write_data, 32, portMAX_DELAY));
+  wait_delayed_action(&action);
+  TEST_ASSERT_EQUAL(sizeof(write_data), ring_buffer_occupied_size(&buffer));
+
+  RingBufferOverflowStats stats;
+  ring_buffer_get_overflow_stats(&buffer, &stats);
+  TEST_ASSERT_EQUAL(sizeof(write_data) - 16 + 32, stats.accepted);
+  TEST_ASSERT_EQUAL(32, stats.rejected);
+
+  ring_buffer_free(&buffer);
+}
+
+#define SPSC_TOTAL_BYTES (1024 * 1024)
+#define SPSC_CHUNK_SIZE 24
+
+typedef struct {
+  RingBuffer *buffer;
+  bool ordered;
+  SemaphoreHandle_t done;
+} SpscContext;
+
+static void spsc_producer_task(void *arg) {
+  SpscContext *ctx = (SpscContext *)arg;
+  uint8_t chunk[SPSC_CHUNK_SIZE];
+  uint8_t counter = 0;
+  for (size_t sent = 0; sent < SPSC_TOTAL_BYTES; sent += SPSC_CHUNK_SIZE) {
+    for (size_t i = 0; i < SPSC_CHUNK_SIZE; i++) {
+      chunk[i] = counter++;
+    }
+    ring_buffer_write_timeout(ctx->buffer, chunk, SPSC_CHUNK_SIZE, portMAX_DELAY);
+  }
+  xSemaphoreGive(ctx->done);
+  vTaskDelete(NULL);
+}
+
+static void spsc_consumer_task(void *arg) {
+  SpscContext *ctx = (SpscContext *)arg;
+  uint8_t chunk[SPSC_CHUNK_SIZE];
+  uint8_t counter = 0;
+  ctx->ordered = true;
+  for (size_t received = 0; received < SPSC_TOTAL_BYTES; received += SPSC_CHUNK_SIZE) {
+    if (ring_buffer_read(ctx->buffer, chunk, SPSC_CHUNK_SIZE, portMAX_DELAY) != SPSC_CHUNK_SIZE) {
+      ctx->ordered = false;
+      break;
+    }
+    for (size_t i = 0; i < SPSC_CHUNK_SIZE; i++) {
+      if (chunk[i] != counter++) {
+        ctx->ordered = false;
+      }
+    }
+  }
+  xSemaphoreGive(ctx->done);
+  vTaskDelete(NULL);
+}
+
+// 書き込みタスクと読み込みタスクを同時に動かし、順序を確認する
+// staging を渡した場合は書き出しタスクも動かす
+static void run_spsc_transfer(bool spsc, uint8_t *staging, size_t staging_size) {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  ring_buffer_set_spsc(&buffer, spsc);
+  if (staging != NULL) {
+    TEST_ASSERT_TRUE(ring_buffer_start_spill_task(&buffer, staging, staging_size, 4096, 5));
+  }
+
+  SpscContext producer = {.buffer = &buffer, .done = xSemaphoreCreateBinary()};
+  SpscContext consumer = {.buffer = &buffer, .done = xSemaphoreCreateBinary()};
+  xTaskCreate(spsc_consumer_task, "consumer", 4096, &consumer, 5, NULL);
+  xTaskCreate(spsc_producer_task, "producer", 4096, &producer, 5, NULL);
+  xSemaphoreTake(producer.done, portMAX_DELAY);
+  xSemaphoreTake(consumer.done, portMAX_DELAY);
+
+  TEST_ASSERT_TRUE(consumer.ordered);
+  vSemaphoreDelete(producer.done);
+  vSemaphoreDelete(consumer.done);
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("SPSC mode keeps order under contention like the mutex path", "[ring_buffer]") {
+  run_spsc_transfer(false, NULL, 0);
+  run_spsc_transfer(true, NULL, 0);
+}
+
+TEST_CASE("ring buffer zero-copy reserve/commit and peek/consume across wrap", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  // 末尾付近まで進めて、予約が折り返すようにする
+  uint8_t data[MEM_BUFFER_SIZE];
+  memset(data, 'x', sizeof(data));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, MEM_BUFFER_SIZE - 10));
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE - 10, ring_buffer_read(&buffer, data, MEM_BUFFER_SIZE - 10, 0));
+
+  RingBufferSpan spans[2];
+  TEST_ASSERT_EQUAL(30, ring_buffer_write_reserve(&buffer, 30, spans));
+  TEST_ASSERT_EQUAL(10, spans[0].size);
+  TEST_ASSERT_EQUAL(20, spans[1].size);
+  for (size_t i = 0; i < spans[0].size; i++) {
+    spans[0].data[i] = i;
+  }
+  for (size_t i = 0; i < spans[1].size; i++) {
+    spans[1].data[i] = spans[0].size + i;
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write_commit(&buffer, 25));
+
+  TEST_ASSERT_EQUAL(25, ring_buffer_read_peek(&buffer, 100, spans));
+  TEST_ASSERT_EQUAL(10, spans[0].size);
+  TEST_ASSERT_EQUAL(15, spans[1].size);
+  TEST_ASSERT_EQUAL(0, spans[0].data[0]);
+  TEST_ASSERT_EQUAL(10, spans[1].data[0]);
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_read_consume(&buffer, 12));
+
+  uint8_t read_data[13];
+  TEST_ASSERT_EQUAL(13, ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+  for (size_t i = 0; i < sizeof(read_data); i++) {
+    TEST_ASSERT_EQUAL(12 + i, read_data[i]);
+  }
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer zero-copy API keeps order with spilled data", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  uint8_t write_data[MEM_BUFFER_SIZE * 3];
+  for (size_t i = 0; i < sizeof(write_data); i++) {
+    write_data[i] = (uint8_t)i;
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, write_data, sizeof(write_data)));
+
+  // ファイルにデータがある間は予約できない
+  RingBufferSpan spans[2];
+  TEST_ASSERT_EQUAL(0, ring_buffer_write_reserve(&buffer, 10, spans));
+
+  // peek/consume でメモリとファイルのデータを順に読める
+  size_t total = 0;
+  while (total < sizeof(write_data)) {
+    int count = ring_buffer_read_peek(&buffer, 50, spans);
+    TEST_ASSERT_GREATER_THAN(0, count);
+    for (int i = 0; i < 2; i++) {
+      TEST_ASSERT_EQUAL_MEMORY(write_data + total, spans[i].data, spans[i].size);
+      total += spans[i].size;
+    }
+    TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_read_consume(&buffer, count));
+  }
+  TEST_ASSERT_EQUAL(0, ring_buffer_read_peek(&buffer, 50, spans));
+
+  // 空になれば予約できる
+  TEST_ASSERT_EQUAL(10, ring_buffer_write_reserve(&buffer, 10, spans));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write_commit(&buffer, 0));
+  ring_buffer_finish_write(&buffer);
+  TEST_ASSERT_EQUAL(RING_BUFFER_FINISHED, ring_buffer_read_peek(&buffer, 50, spans));
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer writev/readv straddling memory and file", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  uint8_t fill[MEM_BUFFER_SIZE - 20];
+  memset(fill, 'F', sizeof(fill));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, fill, sizeof(fill)));
+
+  // ヘッダはメモリに、ペイロードはメモリとファイルにまたがり、トレーラはファイルに入る
+  uint8_t header[8] = "HEADER!";
+  uint8_t payload[40];
+  for (size_t i = 0; i < sizeof(payload); i++) {
+    payload[i] = (uint8_t)i;
+  }
+  uint8_t trailer[6] = "TRAIL";
+  RingBufferVec write_vec[] = {{header, sizeof(header)}, {payload, sizeof(payload)}, {trailer, sizeof(trailer)}};
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_writev(&buffer, write_vec, 3));
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE, buffer.memory_len);
+  TEST_ASSERT_EQUAL(sizeof(header) + sizeof(payload) + sizeof(trailer) - 20, buffer.file_len);
+
+  // 読み込み側も、メモリとファイルの境界をまたぐように分割する
+  uint8_t skip[MEM_BUFFER_SIZE - 25];
+  uint8_t first[9];
+  uint8_t second[45];
+  RingBufferVec read_vec[] = {{skip, sizeof(skip)}, {first, sizeof(first)}, {second, sizeof(second)}};
+  TEST_ASSERT_EQUAL(sizeof(skip) + sizeof(first) + sizeof(second),
+                    ring_buffer_readv(&buffer, read_vec, 3, portMAX_DELAY));
+  TEST_ASSERT_EQUAL_MEMORY(fill, skip, sizeof(skip));
+  TEST_ASSERT_EQUAL_MEMORY(fill, first, 5);
+  TEST_ASSERT_EQUAL_MEMORY(header, first + 5, 4);
+  TEST_ASSERT_EQUAL_MEMORY(header + 4, second, 4);
+  TEST_ASSERT_EQUAL_MEMORY(payload, second + 4, sizeof(payload));
+  TEST_ASSERT_EQUAL_MEMORY(trailer, second + 4 + sizeof(payload), 1);
+
+  uint8_t rest[5];
+  TEST_ASSERT_EQUAL(sizeof(rest), ring_buffer_read(&buffer, rest, sizeof(rest), 0));
+  TEST_ASSERT_EQUAL_MEMORY(trailer + 1, rest, sizeof(rest));
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer writev is all-or-nothing", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  uint8_t fill[MEM_BUFFER_SIZE + FILE_MAX_SIZE - 10];
+  memset(fill, 'F', sizeof(fill));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, fill, sizeof(fill)));
+
+  uint8_t part[6];
+  memset(part, 'P', sizeof(part));
+  RingBufferVec vec[] = {{part, sizeof(part)}, {part, sizeof(part)}};
+  TEST_ASSERT_EQUAL(RING_BUFFER_OVERFLOW, ring_buffer_writev(&buffer, vec, 2));
+  TEST_ASSERT_EQUAL(sizeof(fill), buffer.memory_len + buffer.file_len);
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_writev(&buffer, vec, 1));
+  TEST_ASSERT_EQUAL(sizeof(fill) + sizeof(part), buffer.memory_len + buffer.file_len);
+
+  ring_buffer_free(&buffer);
+}
+
+// i 番目のメッセージの内容を作る (長さは 0 から 299 バイトで変わる)
+static size_t make_msg(size_t i, uint8_t *msg) {
+  size_t size = (i * 37) % 300;
+  for (size_t j = 0; j < size; j++) {
+    msg[j] = (uint8_t)(i + j);
+  }
+  return size;
+}
+
+TEST_CASE("ring buffer messages span memory and file and are never split", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  // いっぱいになるまで書き込む。入りきらないメッセージは何も書き込まれない
+  uint8_t msg[300];
+  size_t written = 0;
+  size_t occupied = 0;
+  while (true) {
+    size_t size = make_msg(written, msg);
+    int result = ring_buffer_write_msg(&buffer, msg, size);
+    if (result == RING_BUFFER_OVERFLOW) {
+      TEST_ASSERT_EQUAL(occupied, buffer.memory_len + buffer.file_len);
+      break;
+    }
+    TEST_ASSERT_EQUAL(RING_BUFFER_OK, result);
+    occupied += size + (size < 0x80 ? 1 : 2);
+    written++;
+  }
+  TEST_ASSERT_GREATER_THAN(3, written);
+  TEST_ASSERT_GREATER_THAN(0, buffer.file_len);
+
+  // 入りきらないバッファでは、メッセージを残したままエラーになる
+  uint8_t small[1];
+  size_t first_size = make_msg(0, msg);
+  TEST_ASSERT_EQUAL(0, first_size);
+  TEST_ASSERT_EQUAL(0, ring_buffer_read_msg(&buffer, small, sizeof(small), 0));
+  TEST_ASSERT_EQUAL(RING_BUFFER_MSG_TOO_LARGE, ring_buffer_read_msg(&buffer, small, sizeof(small), 0));
+
+  // 残りはまとめて読み込む
+  uint8_t data[FILE_MAX_SIZE];
+  size_t lengths[4];
+  size_t read = 1;
+  while (read < written) {
+    int count = ring_buffer_read_msgs(&buffer, data, sizeof(data), lengths, 4, 0);
+    TEST_ASSERT_GREATER_THAN(0, count);
+    uint8_t *p = data;
+    for (int i = 0; i < count; i++) {
+      size_t size = make_msg(read++, msg);
+      TEST_ASSERT_EQUAL(size, lengths[i]);
+      TEST_ASSERT_EQUAL_MEMORY(msg, p, size);
+      p += size;
+    }
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_TIMEOUT, ring_buffer_read_msg(&buffer, data, sizeof(data), pdMS_TO_TICKS(10)));
+  ring_buffer_finish_write(&buffer);
+  TEST_ASSERT_EQUAL(RING_BUFFER_FINISHED, ring_buffer_read_msg(&buffer, data, sizeof(data), portMAX_DELAY));
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer blocking read_msg waits for a whole message", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  // 長さのヘッダだけが書き込まれた状態では読み込めない
+  uint8_t header[] = {5};
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, header, sizeof(header)));
+  uint8_t data[16];
+  TEST_ASSERT_EQUAL(RING_BUFFER_TIMEOUT, ring_buffer_read_msg(&buffer, data, sizeof(data), pdMS_TO_TICKS(10)));
+
+  DelayedAction action;
+  start_delayed_action(&action, &buffer, DELAYED_WRITE, (const uint8_t *)"hello", 5);
+  TEST_ASSERT_EQUAL(5, ring_buffer_read_msg(&buffer, data, sizeof(data), portMAX_DELAY));
+  TEST_ASSERT_EQUAL_MEMORY("hello", data, 5);
+  wait_delayed_action(&action);
+
+  ring_buffer_free(&buffer);
+}
+
+#define STAGING_SIZE 64
+
+TEST_CASE("ring buffer spill task keeps order across memory, file and staging", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  uint8_t staging[STAGING_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  TEST_ASSERT_TRUE(ring_buffer_start_spill_task(&buffer, staging, sizeof(staging), 4096, 5));
+
+  uint8_t write_data[MEM_BUFFER_SIZE + STAGING_SIZE * 4];
+  for (size_t i = 0; i < sizeof(write_data); i++) {
+    write_data[i] = (uint8_t)(i * 7);
+  }
+
+  // 書き出される前のステージングのデータも、メモリの直後に読める
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, write_data, MEM_BUFFER_SIZE + 10));
+  uint8_t read_data[sizeof(write_data)];
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + 5, ring_buffer_read(&buffer, read_data, MEM_BUFFER_SIZE + 5, 0));
+  TEST_ASSERT_EQUAL_MEMORY(write_data, read_data, MEM_BUFFER_SIZE + 5);
+  size_t total = MEM_BUFFER_SIZE + 5;
+
+  // 残りを書き込んでフラッシュすると、ステージングはすべてファイルへ移る
+  size_t written = MEM_BUFFER_SIZE + 10;
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, write_data + written, sizeof(write_data) - written));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_flush(&buffer, portMAX_DELAY));
+  TEST_ASSERT_EQUAL(0, buffer.staging_len);
+  TEST_ASSERT_EQUAL(sizeof(write_data) - total, buffer.memory_len + buffer.file_len);
+
+  TEST_ASSERT_EQUAL(sizeof(write_data) - total, ring_buffer_read(&buffer, read_data + total, sizeof(write_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(write_data, read_data, sizeof(write_data));
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer spill task applies backpressure and keeps total capacity", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  uint8_t staging[STAGING_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  TEST_ASSERT_TRUE(ring_buffer_start_spill_task(&buffer, staging, sizeof(staging), 4096, 5));
+
+  // ステージングより大きな書き込みも、書き出しタスクを待って全体が入る
+  static uint8_t write_data[MEM_BUFFER_SIZE + FILE_MAX_SIZE];
+  for (size_t i = 0; i < sizeof(write_data); i++) {
+    write_data[i] = (uint8_t)i;
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, write_data, sizeof(write_data) - 20));
+  RingBufferVec vec[] = {{write_data + sizeof(write_data) - 20, 20}};
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_writev(&buffer, vec, 1));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OVERFLOW, ring_buffer_write(&buffer, write_data, 1));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OVERFLOW, ring_buffer_writev(&buffer, vec, 1));
+
+  static uint8_t read_data[sizeof(write_data)];
+  TEST_ASSERT_EQUAL(sizeof(read_data), ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(write_data, read_data, sizeof(write_data));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_flush(&buffer, 0));
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer spill task keeps order under contention", "[ring_buffer]") {
+  uint8_t staging[STAGING_SIZE];
+  run_spsc_transfer(false, staging, sizeof(staging));
+  run_spsc_transfer(true, staging, sizeof(staging));
+}
+
+#define COMBINING_PRODUCERS 4
+#define COMBINING_RECORDS 10000
+#define COMBINING_RECORD_SIZE 16
+#define COMBINING_MEMORY_SIZE 4096
+#define COMBINING_FILE_SIZE (1024 * 1024)
+
+typedef struct {
+  RingBuffer *buffer;
+  uint32_t id;
+  bool ok;
+  SemaphoreHandle_t done;
+} CombiningContext;
+
+// 各レコードの先頭に書き込みタスクの番号と連番を入れる
+static void combining_producer_task(void *arg) {
+  CombiningContext *ctx = (CombiningContext *)arg;
+  uint8_t record[COMBINING_RECORD_SIZE];
+  ctx->ok = true;
+  for (uint32_t seq = 0; seq < COMBINING_RECORDS; seq++) {
+    memset(record, (uint8_t)seq, sizeof(record));
+    memcpy(record, &ctx->id, sizeof(uint32_t));
+    memcpy(record + sizeof(uint32_t), &seq, sizeof(uint32_t));
+    if (ring_buffer_write(ctx->buffer, record, sizeof(record)) != RING_BUFFER_OK) {
+      ctx->ok = false;
+    }
+  }
+  xSemaphoreGive(ctx->done);
+  vTaskDelete(NULL);
+}
+
+// レコードが分割されず、書き込みタスクごとに連番の順で届くことを確認する
+static void combining_consumer_task(void *arg) {
+  CombiningContext *ctx = (CombiningContext *)arg;
+  uint32_t next[COMBINING_PRODUCERS] = {0};
+  uint8_t record[COMBINING_RECORD_SIZE];
+  ctx->ok = true;
+  for (size_t i = 0; i < COMBINING_PRODUCERS * COMBINING_RECORDS; i++) {
+    size_t received = 0;
+    while (received < sizeof(record)) {
+      int result = ring_buffer_read(ctx->buffer, record + received, sizeof(record) - received, portMAX_DELAY);
+      if (result <= 0) {
+        ctx->ok = false;
+        goto done;
+      }
+      received += result;
+    }
+    uint32_t id, seq;
+    memcpy(&id, record, sizeof(uint32_t));
+    memcpy(&seq, record + sizeof(uint32_t), sizeof(uint32_t));
+    if (id >= COMBINING_PRODUCERS || seq != next[id]++ || record[COMBINING_RECORD_SIZE - 1] != (uint8_t)seq) {
+      ctx->ok = false;
+    }
+  }
+done:
+  xSemaphoreGive(ctx->done);
+  vTaskDelete(NULL);
+}
+
+// 複数の書き込みタスクを同時に動かし、レコードが書き込みタスクごとの順序で届くことを確認する
+static void run_combining_transfer(bool combining) {
+  static uint8_t memory[COMBINING_MEMORY_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, COMBINING_MEMORY_SIZE, TEST_FILE_NAME, COMBINING_FILE_SIZE);
+  TEST_ASSERT_TRUE(ring_buffer_set_write_combining(&buffer, combining));
+
+  CombiningContext producers[COMBINING_PRODUCERS];
+  CombiningContext consumer = {.buffer = &buffer, .done = xSemaphoreCreateBinary()};
+  xTaskCreate(combining_consumer_task, "consumer", 4096, &consumer, 5, NULL);
+  for (uint32_t i = 0; i < COMBINING_PRODUCERS; i++) {
+    producers[i] = (CombiningContext){.buffer = &buffer, .id = i, .done = xSemaphoreCreateBinary()};
+    xTaskCreate(combining_producer_task, "producer", 4096, &producers[i], 5, NULL);
+  }
+  for (int i = 0; i < COMBINING_PRODUCERS; i++) {
+    xSemaphoreTake(producers[i].done, portMAX_DELAY);
+    TEST_ASSERT_TRUE(producers[i].ok);
+    vSemaphoreDelete(producers[i].done);
+  }
+  xSemaphoreTake(consumer.done, portMAX_DELAY);
+  TEST_ASSERT_TRUE(consumer.ok);
+  vSemaphoreDelete(consumer.done);
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer write combining keeps per-producer order like the mutex path", "[ring_buffer]") {
+  run_combining_transfer(false);
+  run_combining_transfer(true);
+}
+
+TEST_CASE("ring buffer reader cursors read the same stream across memory and file", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  int uploader = ring_buffer_add_reader(&buffer, RING_BUFFER_READER_BLOCK);
+  int logger = ring_buffer_add_reader(&buffer, RING_BUFFER_READER_BLOCK);
+  TEST_ASSERT_NOT_EQUAL(-1, uploader);
+  TEST_ASSERT_NOT_EQUAL(-1, logger);
+
+  uint8_t data[MEM_BUFFER_SIZE * 3];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)i;
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, sizeof(data)));
+
+  // 速いカーソルが読み終えても、遅いカーソルが読むまでデータは残る
+  uint8_t read_data[sizeof(data)];
+  TEST_ASSERT_EQUAL(sizeof(data), ring_buffer_reader_read(&buffer, uploader, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, sizeof(data));
+  TEST_ASSERT_EQUAL(sizeof(data), ring_buffer_occupied_size(&buffer));
+
+  TEST_ASSERT_EQUAL(100, ring_buffer_reader_read(&buffer, logger, read_data, 100, 0));
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, 100);
+  TEST_ASSERT_EQUAL(sizeof(data) - 100, ring_buffer_occupied_size(&buffer));
+  TEST_ASSERT_EQUAL(sizeof(data) - 100,
+                    ring_buffer_reader_read(&buffer, logger, read_data + 100, sizeof(read_data) - 100, 0));
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, sizeof(data));
+  TEST_ASSERT_EQUAL(0, ring_buffer_occupied_size(&buffer));
+  TEST_ASSERT_EQUAL(0, ring_buffer_reader_read(&buffer, logger, read_data, 1, 0));
+
+  // カーソルを削除すると、残りのカーソルが読み終えた分が空きになる
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, 50));
+  TEST_ASSERT_EQUAL(50, ring_buffer_reader_read(&buffer, uploader, read_data, 50, 0));
+  TEST_ASSERT_EQUAL(50, ring_buffer_occupied_size(&buffer));
+  ring_buffer_remove_reader(&buffer, logger);
+  TEST_ASSERT_EQUAL(0, ring_buffer_occupied_size(&buffer));
+
+  ring_buffer_finish_write(&buffer);
+  TEST_ASSERT_EQUAL(RING_BUFFER_FINISHED, ring_buffer_reader_read(&buffer, uploader, read_data, 1, 0));
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer lagging reader cursors block, skip or detach", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  int fast = ring_buffer_add_reader(&buffer, RING_BUFFER_READER_BLOCK);
+  int skipper = ring_buffer_add_reader(&buffer, RING_BUFFER_READER_SKIP);
+  int detached = ring_buffer_add_reader(&buffer, RING_BUFFER_READER_DETACH);
+
+  const size_t capacity = MEM_BUFFER_SIZE + FILE_MAX_SIZE;
+  static uint8_t data[MEM_BUFFER_SIZE + FILE_MAX_SIZE + 64];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)(i * 7);
+  }
+  uint8_t read_data[sizeof(data)];
+
+  // 全体を埋めても、遅いカーソルは読み終えていないので空きはない
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, capacity));
+  TEST_ASSERT_EQUAL(capacity, ring_buffer_reader_read(&buffer, fast, read_data, capacity, 0));
+  TEST_ASSERT_EQUAL(capacity, ring_buffer_occupied_size(&buffer));
+
+  // 遅れているカーソルは方針に従って読み飛ばすか切り離され、書き込める
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data + capacity, 64));
+  TEST_ASSERT_EQUAL(capacity, ring_buffer_occupied_size(&buffer));
+  TEST_ASSERT_EQUAL(64, ring_buffer_reader_read(&buffer, fast, read_data, 64, 0));
+  TEST_ASSERT_EQUAL_MEMORY(data + capacity, read_data, 64);
+
+  TEST_ASSERT_EQUAL(RING_BUFFER_DETACHED, ring_buffer_reader_read(&buffer, detached, read_data, 1, 0));
+  ring_buffer_remove_reader(&buffer, detached);
+
+  TEST_ASSERT_EQUAL(64, ring_buffer_reader_skipped(&buffer, skipper));
+  TEST_ASSERT_EQUAL(capacity, ring_buffer_reader_read(&buffer, skipper, read_data, capacity, 0));
+  TEST_ASSERT_EQUAL_MEMORY(data + 64, read_data, capacity);
+  TEST_ASSERT_EQUAL(0, ring_buffer_occupied_size(&buffer));
+
+  // RING_BUFFER_READER_BLOCK のカーソルが遅れている場合は、書き込み側がオーバーフローする
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, capacity));
+  TEST_ASSERT_EQUAL(capacity, ring_buffer_reader_read(&buffer, skipper, read_data, capacity, 0));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OVERFLOW, ring_buffer_write(&buffer, data, 1));
+  TEST_ASSERT_EQUAL(64, ring_buffer_reader_skipped(&buffer, skipper));
+
+  ring_buffer_free(&buffer);
+}
+
+#define CRASH_FILE_NAME "test_buffer.dat.crash"
+
+// 電源断の時点のファイルを再現するため、開いたままのファイルの内容を別のファイルに写す
+static void copy_file(const char *src, const char *dst) {
+  FILE *in = fopen(src, "rb");
+  FILE *out = fopen(dst, "wb");
+  TEST_ASSERT_NOT_NULL(in);
+  TEST_ASSERT_NOT_NULL(out);
+  uint8_t chunk[256];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+    fwrite(chunk, 1, n, out);
+  }
+  fclose(in);
+  fclose(out);
+}
+
+TEST_CASE("ring buffer persistent mode resumes the file tier after restart", "[ring_buffer]") {
+  remove(TEST_FILE_NAME);
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  config.persistent = true;
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE, &config);
+
+  uint8_t write_data[MEM_BUFFER_SIZE + 300];
+  for (size_t i = 0; i < sizeof(write_data); i++) {
+    write_data[i] = (uint8_t)(i * 3);
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, write_data, sizeof(write_data)));
+  uint8_t read_data[sizeof(write_data)];
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + 100, ring_buffer_read(&buffer, read_data, MEM_BUFFER_SIZE + 100, 0));
+  ring_buffer_free(&buffer);
+
+  // メモリにあったデータは失われ、ファイルに残っていたデータだけが続きから読める
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE, &config);
+  size_t remaining = buffer.file_len;
+  TEST_ASSERT_GREATER_THAN(0, remaining);
+  TEST_ASSERT_EQUAL(remaining, ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(write_data + sizeof(write_data) - remaining, read_data, remaining);
+  ring_buffer_free(&buffer);
+
+  // 通常の初期化ではファイルを切り詰める
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  TEST_ASSERT_EQUAL(0, buffer.file_len);
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer persistent mode recovers the last checkpoint after a crash", "[ring_buffer]") {
+  remove(TEST_FILE_NAME);
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  config.persistent = true;
+  config.checkpoint_interval = 200;
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE, &config);
+
+  uint8_t write_data[FILE_MAX_SIZE];
+  for (size_t i = 0; i < sizeof(write_data); i++) {
+    write_data[i] = (uint8_t)(i * 5);
+  }
+  // メモリを埋めてから、ファイルにチェックポイントの間隔をまたいで書き込む
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, write_data, MEM_BUFFER_SIZE));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, _ring_buffer_file_write(&buffer, write_data, 250));
+  TEST_ASSERT_EQUAL(0, buffer.checkpoint_pending);
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, _ring_buffer_file_write(&buffer, write_data + 250, 100));
+  TEST_ASSERT_EQUAL(100, buffer.checkpoint_pending);
+  uint32_t sequence = buffer.header_sequence;
+
+  // 電源断: チェックポイント後の 100 バイトは失われ、250 バイトが復元される
+  copy_file(TEST_FILE_NAME, CRASH_FILE_NAME);
+  RingBuffer recovered;
+  ring_buffer_init_with_config(&recovered, memory, MEM_BUFFER_SIZE, CRASH_FILE_NAME, FILE_MAX_SIZE, &config);
+  TEST_ASSERT_EQUAL(250, recovered.file_len);
+  TEST_ASSERT_EQUAL(sequence, recovered.header_sequence);
+  uint8_t read_data[250];
+  TEST_ASSERT_EQUAL(sizeof(read_data), _ring_buffer_file_read(&recovered, read_data, sizeof(read_data)));
+  TEST_ASSERT_EQUAL_MEMORY(write_data, read_data, sizeof(read_data));
+  ring_buffer_free(&recovered);
+
+  // 新しい方のスロットが書きかけで壊れていれば、もう一方のスロットに戻る
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_flush(&buffer, portMAX_DELAY));
+  copy_file(TEST_FILE_NAME, CRASH_FILE_NAME);
+  FILE *file = fopen(CRASH_FILE_NAME, "r+b");
+  fseek(file, buffer.header_slot * RING_BUFFER_HEADER_SLOT_SIZE + offsetof(RingBufferFileHeader, len), SEEK_SET);
+  fputc(0xFF, file);
+  fclose(file);
+  ring_buffer_init_with_config(&recovered, memory, MEM_BUFFER_SIZE, CRASH_FILE_NAME, FILE_MAX_SIZE, &config);
+  TEST_ASSERT_EQUAL(250, recovered.file_len);
+  ring_buffer_free(&recovered);
+  remove(CRASH_FILE_NAME);
+
+  ring_buffer_free(&buffer);
+}
+
 TEST_CASE("Normal write and read in memory buffer", "[ring_buffer mem]") {
   uint8_t memory[MEM_BUFFER_SIZE];
   RingBuffer buffer;
@@ -281,6 +1347,74 @@ TEST_CASE("Partial read from memory buffer", "[ring_buffer mem]") {
   ring_buffer_free(&buffer);
 }
 
+// 旧実装と同じ1バイトずつの参照モデル
+typedef struct {
+  uint8_t data[MEM_BUFFER_SIZE];
+  size_t size;
+  size_t head;
+  size_t len;
+} ReferenceRing;
+
+static int reference_write(ReferenceRing *ref, const uint8_t *data, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    if (ref->len >= ref->size) {
+      return i;
+    }
+    ref->data[(ref->head + ref->len) % ref->size] = data[i];
+    ref->len++;
+  }
+  return RING_BUFFER_OK;
+}
+
+static int reference_read(ReferenceRing *ref, uint8_t *data, size_t size) {
+  size_t read_count = 0;
+  while (read_count < size && ref->len > 0) {
+    data[read_count++] = ref->data[ref->head];
+    ref->head = (ref->head + 1) % ref->size;
+    ref->len--;
+  }
+  return read_count;
+}
+
+static void check_mem_equivalence(size_t memory_size) {
+  uint8_t memory[MEM_BUFFER_SIZE] = {0};
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, memory_size, TEST_FILE_NAME, FILE_MAX_SIZE);
+  ReferenceRing ref = {.size = memory_size};
+
+  uint32_t seed = 12345;
+  uint8_t counter = 0;
+  for (int i = 0; i < 2000; i++) {
+    seed = seed * 1103515245 + 12345;
+    size_t size = (seed >> 16) % (memory_size + 8);
+    uint8_t data[MEM_BUFFER_SIZE + 8];
+    uint8_t expected[MEM_BUFFER_SIZE + 8];
+    if ((seed >> 8) & 1) {
+      for (size_t j = 0; j < size; j++) {
+        data[j] = counter++;
+      }
+      TEST_ASSERT_EQUAL(reference_write(&ref, data, size), _ring_buffer_mem_write(&buffer, data, size));
+    } else {
+      int read_count = reference_read(&ref, expected, size);
+      TEST_ASSERT_EQUAL(read_count, _ring_buffer_mem_read(&buffer, data, size));
+      TEST_ASSERT_EQUAL_MEMORY(expected, data, read_count);
+    }
+    TEST_ASSERT_EQUAL(ref.head, buffer.memory_head);
+    TEST_ASSERT_EQUAL(ref.len, buffer.memory_len);
+    TEST_ASSERT_EQUAL_MEMORY(ref.data, memory, memory_size);
+  }
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("Memory bulk copy matches byte-wise reference (power of two)", "[ring_buffer mem]") {
+  check_mem_equivalence(MEM_BUFFER_SIZE);
+}
+
+TEST_CASE("Memory bulk copy matches byte-wise reference (non power of two)", "[ring_buffer mem]") {
+  check_mem_equivalence(MEM_BUFFER_SIZE - 27);
+}
+
 // file
 TEST_CASE("Normal write and read in file buffer", "[ring_buffer mem]") {
   uint8_t memory[MEM_BUFFER_SIZE];
@@ -346,6 +1480,774 @@ TEST_CASE("Partial read from file buffer", "[ring_buffer file]") {
   ring_buffer_free(&buffer);
 }
 
+TEST_CASE("File span write and read across wrap point", "[ring_buffer file]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  // シーク位置を確認するため、メモリマップされていても stdio の経路を使う
+  _ring_buffer_file_unmap(&buffer);
+
+  uint8_t write_data[FILE_MAX_SIZE];
+  uint8_t read_data[FILE_MAX_SIZE];
+  uint8_t write_counter = 0;
+  uint8_t read_counter = 0;
+  size_t chunk_sizes[] = {300, 700, 1, 511, 1024, 3, 999};
+  for (int i = 0; i < 20; i++) {
+    size_t size = chunk_sizes[i % (sizeof(chunk_sizes) / sizeof(chunk_sizes[0]))];
+    size_t space = FILE_MAX_SIZE - _ring_buffer_file_usage(&buffer);
+    for (size_t j = 0; j < size; j++) {
+      write_data[j] = write_counter + j;
+    }
+    int result = _ring_buffer_file_write(&buffer, write_data, size);
+    size_t written = result == RING_BUFFER_OK ? size : (size_t)result;
+    TEST_ASSERT_EQUAL(size <= space ? size : space, written);
+    write_counter += written;
+    // 連続した書き込みではシーク位置が書き込み末尾と一致している
+    if (written > 0) {
+      TEST_ASSERT_EQUAL((buffer.file_head + buffer.file_len - 1) % FILE_MAX_SIZE + 1, buffer.file_pos);
+    }
+
+    size_t read_size = _ring_buffer_file_read(&buffer, read_data, size / 2 + 1);
+    for (size_t j = 0; j < read_size; j++) {
+      TEST_ASSERT_EQUAL((uint8_t)(read_counter + j), read_data[j]);
+    }
+    read_counter += read_size;
+  }
+
+  ring_buffer_free(&buffer);
+}
+
+#define FILE_ROUND_TRIP_SIZE (16 * 1024)
+#define FILE_ROUND_TRIP_TOTAL_BYTES (256 * 1024)
+#define FILE_ROUND_TRIP_CHUNK_SIZE 512
+
+// ファイルバッファだけで書き込みと読み込みを繰り返し、順序どおりに読めることを確認する
+static void run_file_round_trip(bool mapped) {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_ROUND_TRIP_SIZE);
+  if (!mapped) {
+    _ring_buffer_file_unmap(&buffer);
+  }
+
+  static uint8_t chunk[FILE_ROUND_TRIP_CHUNK_SIZE];
+  uint8_t write_counter = 0;
+  uint8_t read_counter = 0;
+  for (size_t sent = 0; sent < FILE_ROUND_TRIP_TOTAL_BYTES; sent += sizeof(chunk)) {
+    // 半分ほど埋まった状態を保ち、書き込みと読み込みが折り返しをまたぐようにする
+    if (_ring_buffer_file_usage(&buffer) > FILE_ROUND_TRIP_SIZE / 2) {
+      TEST_ASSERT_EQUAL(sizeof(chunk), _ring_buffer_file_read(&buffer, chunk, sizeof(chunk)));
+      TEST_ASSERT_EQUAL(read_counter, chunk[0]);
+      read_counter++;
+    }
+    memset(chunk, write_counter++, sizeof(chunk));
+    TEST_ASSERT_EQUAL(RING_BUFFER_OK, _ring_buffer_file_write(&buffer, chunk, sizeof(chunk)));
+  }
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("File tier keeps order with memory map and stdio", "[ring_buffer file]") {
+  run_file_round_trip(false);
+  run_file_round_trip(true);
+}
+
+#define PREALLOCATE_TEST_SIZE (64 * 1024)
+
+// 指定した確保方法で初期化し、ファイルの大きさと読み書きを確認する
+static void run_preallocate(RingBufferPreallocate mode) {
+  remove(TEST_FILE_NAME);
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  config.preallocate = mode;
+
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, PREALLOCATE_TEST_SIZE, &config);
+
+  // 確保した場合は、ファイルがデータ領域の末尾まで伸びている
+  if (mode != RING_BUFFER_PREALLOCATE_LAZY) {
+    fseek(buffer.file, 0, SEEK_END);
+    TEST_ASSERT_EQUAL(PREALLOCATE_TEST_SIZE, ftell(buffer.file));
+    buffer.file_pos = RING_BUFFER_FILE_POS_UNKNOWN;
+  }
+  uint8_t write_data[] = "preallocated";
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, _ring_buffer_file_write(&buffer, write_data, sizeof(write_data)));
+  uint8_t read_data[sizeof(write_data)];
+  TEST_ASSERT_EQUAL(sizeof(read_data), _ring_buffer_file_read(&buffer, read_data, sizeof(read_data)));
+  TEST_ASSERT_EQUAL_MEMORY(write_data, read_data, sizeof(read_data));
+
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("File preallocation modes", "[ring_buffer file]") {
+  run_preallocate(RING_BUFFER_PREALLOCATE_LAZY);
+  run_preallocate(RING_BUFFER_PREALLOCATE_ZERO_FILL);
+  run_preallocate(RING_BUFFER_PREALLOCATE_TRUNCATE);
+}
+
+#define COMPRESS_FILE_SIZE (16 * 1024)
+
+// JSON 形式のセンサー値を total バイト生成する
+static void make_json_samples(uint8_t *data, size_t total) {
+  size_t used = 0;
+  for (unsigned long t = 0; used < total; t++) {
+    char line[96];
+    int n = snprintf(line, sizeof(line), "{\"ts\":%lu,\"temp\":%lu.%lu,\"hum\":%lu,\"status\":\"ok\"}\n",
+                     1700000000UL + t, 20 + t % 7, t % 10, 40 + t % 13);
+    size_t count = (size_t)n < total - used ? (size_t)n : total - used;
+    memcpy(data + used, line, count);
+    used += count;
+  }
+}
+
+// 差分符号化したセンサー値 (ゆっくり変化する値の int16 の差分) を total バイト生成する
+static void make_delta_samples(uint8_t *data, size_t total) {
+  uint32_t seed = 1;
+  for (size_t i = 0; i + 1 < total; i += 2) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t r = (seed >> 16) % 16;
+    int16_t delta = r == 0 ? -1 : r == 1 ? 1 : 0;
+    memcpy(data + i, &delta, sizeof(delta));
+  }
+}
+
+TEST_CASE("Compressed file tier round-trips and holds more than file_size", "[ring_buffer file]") {
+  static uint8_t work[RING_BUFFER_COMPRESS_WORK_SIZE];
+  static uint8_t data[COMPRESS_FILE_SIZE * 3];
+  static uint8_t read_data[sizeof(data)];
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  config.compress_work = work;
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, COMPRESS_FILE_SIZE, &config);
+
+  // 圧縮が効くデータは file_size を超えて積める
+  make_json_samples(data, sizeof(data));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, sizeof(data)));
+  TEST_ASSERT_EQUAL(sizeof(data) - MEM_BUFFER_SIZE, buffer.file_len);
+  TEST_ASSERT_LESS_THAN(COMPRESS_FILE_SIZE, buffer.file_used);
+
+  // 半端なサイズで読み、フレームの途中からの読み込みと補充を確認する
+  size_t received = 0;
+  while (received < sizeof(data)) {
+    int n = ring_buffer_read(&buffer, read_data + received, 777, 0);
+    TEST_ASSERT_GREATER_THAN(0, n);
+    received += n;
+  }
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, sizeof(data));
+  TEST_ASSERT_EQUAL(0, buffer.file_used);
+
+  // 縮まないデータはそのまま格納し、空きは file_size を超えない
+  uint32_t seed = 7;
+  for (size_t i = 0; i < sizeof(data); i++) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = (uint8_t)(seed >> 16);
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_OVERFLOW, ring_buffer_write(&buffer, data, sizeof(data)));
+  size_t stored = buffer.memory_len + buffer.file_len;
+  TEST_ASSERT_LESS_OR_EQUAL(MEM_BUFFER_SIZE + COMPRESS_FILE_SIZE, stored);
+  TEST_ASSERT_EQUAL(stored, ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, stored);
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("Compressed file tier resumes after restart in persistent mode", "[ring_buffer file]") {
+  static uint8_t work[RING_BUFFER_COMPRESS_WORK_SIZE];
+  static uint8_t data[COMPRESS_FILE_SIZE * 2];
+  static uint8_t read_data[sizeof(data)];
+  remove(TEST_FILE_NAME);
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  config.persistent = true;
+  config.compress_work = work;
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, COMPRESS_FILE_SIZE, &config);
+
+  make_delta_samples(data, sizeof(data));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, sizeof(data)));
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + 1000, ring_buffer_read(&buffer, read_data, MEM_BUFFER_SIZE + 1000, 0));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_flush(&buffer, 0));
+  size_t file_len = buffer.file_len;
+  size_t file_used = buffer.file_used;
+  ring_buffer_free(&buffer);
+
+  // 展開後のバイト数はヘッダから戻す。溜めていたチャンクも含め、読み終えた位置の続きから読める
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, COMPRESS_FILE_SIZE, &config);
+  size_t remaining = buffer.file_len;
+  TEST_ASSERT_EQUAL(file_len, remaining);
+  TEST_ASSERT_EQUAL(file_used, buffer.file_used);
+  TEST_ASSERT_GREATER_THAN(0, remaining);
+  TEST_ASSERT_EQUAL(remaining, ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(data + sizeof(data) - remaining, read_data, remaining);
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("Compressed file tier drops frames from a corrupt header", "[ring_buffer file]") {
+  static uint8_t work[RING_BUFFER_COMPRESS_WORK_SIZE];
+  static uint8_t data[COMPRESS_FILE_SIZE * 2];
+  static uint8_t read_data[sizeof(data)];
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  config.compress_work = work;
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, COMPRESS_FILE_SIZE, &config);
+
+  make_json_samples(data, sizeof(data));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, sizeof(data)));
+  size_t open_len = buffer.compress_open_len;
+
+  // 2 つ目のフレームのヘッダを、格納サイズが元のサイズより大きい値で壊す
+  uint8_t header[RING_BUFFER_COMPRESS_FRAME_HEADER];
+  TEST_ASSERT_EQUAL(sizeof(header), _ring_buffer_file_read_at(&buffer, buffer.file_head, header, sizeof(header)));
+  size_t first_raw = header[0] | (size_t)header[1] << 8;
+  size_t first_size = sizeof(header) + (header[2] | (size_t)header[3] << 8);
+  TEST_ASSERT_GREATER_THAN(first_size, buffer.file_used);
+  const uint8_t corrupt[RING_BUFFER_COMPRESS_FRAME_HEADER] = {1, 0, 0xff, 0xff};
+  TEST_ASSERT_EQUAL(sizeof(corrupt), _ring_buffer_file_write_at(&buffer, buffer.file_head + first_size, corrupt,
+                                                                sizeof(corrupt)));
+
+  // 壊れたフレームの手前までと、チャンクに溜めていたデータは読める
+  size_t kept = MEM_BUFFER_SIZE + first_raw;
+  size_t received = 0;
+  int n;
+  while ((n = ring_buffer_read(&buffer, read_data + received, 777, 0)) > 0) {
+    received += n;
+  }
+  TEST_ASSERT_EQUAL(kept + open_len, received);
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, kept);
+  TEST_ASSERT_EQUAL_MEMORY(data + sizeof(data) - open_len, read_data + kept, open_len);
+  TEST_ASSERT_EQUAL(0, buffer.file_used);
+
+  RingBufferCompressStats stats;
+  ring_buffer_get_compress_stats(&buffer, &stats);
+  TEST_ASSERT_EQUAL(1, stats.corrupt_frames);
+  TEST_ASSERT_EQUAL(sizeof(data) - kept - open_len, stats.lost_bytes);
+  ring_buffer_free(&buffer);
+}
+
+#define COMPRESS_RATIO_TOTAL_BYTES (256 * 1024)
+#define COMPRESS_RATIO_FILE_SIZE (64 * 1024)
+#define COMPRESS_RATIO_CHUNK_SIZE 512
+
+// データ全体をファイルバッファ経由で書いて読み、圧縮率を返す
+static double run_compress_round_trip(const uint8_t *data, size_t size, void *work) {
+  static uint8_t read_data[COMPRESS_RATIO_CHUNK_SIZE];
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  config.compress_work = work;
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, COMPRESS_RATIO_FILE_SIZE, &config);
+
+  for (size_t total = 0; total < COMPRESS_RATIO_TOTAL_BYTES; total += size) {
+    // ファイルバッファの半分ずつ書いてから読み出す
+    for (size_t sent = 0; sent < size; sent += COMPRESS_RATIO_CHUNK_SIZE) {
+      TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data + sent, COMPRESS_RATIO_CHUNK_SIZE));
+    }
+    for (size_t received = 0; received < size; received += COMPRESS_RATIO_CHUNK_SIZE) {
+      TEST_ASSERT_EQUAL(COMPRESS_RATIO_CHUNK_SIZE, ring_buffer_read(&buffer, read_data, COMPRESS_RATIO_CHUNK_SIZE, 0));
+      TEST_ASSERT_EQUAL_MEMORY(data + received, read_data, COMPRESS_RATIO_CHUNK_SIZE);
+    }
+  }
+
+  RingBufferCompressStats stats;
+  ring_buffer_get_compress_stats(&buffer, &stats);
+  double ratio = stats.stored_bytes > 0 ? (double)stats.raw_bytes / stats.stored_bytes : 1.0;
+  ring_buffer_free(&buffer);
+  return ratio;
+}
+
+TEST_CASE("Compressed file tier ratio", "[ring_buffer file]") {
+  static uint8_t work[RING_BUFFER_COMPRESS_WORK_SIZE];
+  static uint8_t data[COMPRESS_RATIO_FILE_SIZE / 2];
+  for (int kind = 0; kind < 2; kind++) {
+    if (kind == 0) {
+      make_json_samples(data, sizeof(data));
+    } else {
+      make_delta_samples(data, sizeof(data));
+    }
+    run_compress_round_trip(data, sizeof(data), NULL);
+    TEST_ASSERT_GREATER_THAN(2, (int)run_compress_round_trip(data, sizeof(data), work));
+  }
+}
+
+#define SECTOR_FILE_SIZE (16 * 1024)
+#define SECTOR_RECORD_SIZE 100
+
+// 小さなレコードをファイルバッファに書き込み、書き込みの統計を返す
+static RingBufferWriteStats run_sector_writes(uint8_t *sector_buffer, size_t records) {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  config.sector_buffer = sector_buffer;
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, SECTOR_FILE_SIZE, &config);
+  _ring_buffer_file_unmap(&buffer);
+
+  uint8_t record[SECTOR_RECORD_SIZE];
+  for (size_t i = 0; i < records; i++) {
+    memset(record, (uint8_t)i, sizeof(record));
+    TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, record, sizeof(record)));
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_flush(&buffer, 0));
+  RingBufferWriteStats stats;
+  ring_buffer_get_write_stats(&buffer, &stats);
+  ring_buffer_free(&buffer);
+  return stats;
+}
+
+TEST_CASE("Sector coalescing writes only whole aligned sectors until flush", "[ring_buffer file]") {
+  static uint8_t sector_buffer[RING_BUFFER_SECTOR_SIZE];
+  static uint8_t data[SECTOR_FILE_SIZE + MEM_BUFFER_SIZE];
+  static uint8_t read_data[sizeof(data)];
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  config.sector_buffer = sector_buffer;
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, SECTOR_FILE_SIZE, &config);
+  TEST_ASSERT_NULL(buffer.file_map);
+
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)(i * 11);
+  }
+  // 1.5 セクタ分を書くと、書き込まれるのは先頭の1セクタだけ
+  size_t size = MEM_BUFFER_SIZE + RING_BUFFER_SECTOR_SIZE * 3 / 2;
+  for (size_t sent = 0; sent < size; sent += 64) {
+    TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data + sent, 64));
+  }
+  RingBufferWriteStats stats;
+  ring_buffer_get_write_stats(&buffer, &stats);
+  TEST_ASSERT_EQUAL(size - MEM_BUFFER_SIZE, stats.accepted);
+  TEST_ASSERT_EQUAL(RING_BUFFER_SECTOR_SIZE, stats.written);
+  TEST_ASSERT_EQUAL(1, stats.sector_writes);
+
+  // セクタに溜めているデータも読める
+  TEST_ASSERT_EQUAL(size, ring_buffer_read(&buffer, read_data, size, 0));
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, size);
+
+  // 明示的なフラッシュで半端なセクタを書き込む
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_flush(&buffer, 0));
+  ring_buffer_get_write_stats(&buffer, &stats);
+  TEST_ASSERT_EQUAL(RING_BUFFER_SECTOR_SIZE * 3 / 2, stats.written);
+  TEST_ASSERT_EQUAL(2, stats.sector_writes);
+
+  // 折り返しをまたいでも順序どおりに読める
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, sizeof(data)));
+  TEST_ASSERT_EQUAL(sizeof(data), ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, sizeof(data));
+  ring_buffer_free(&buffer);
+
+  // 小さなレコードを直接書く場合と比べた書き込み増幅
+  const size_t records = SECTOR_FILE_SIZE / SECTOR_RECORD_SIZE;
+  RingBufferWriteStats direct = run_sector_writes(NULL, records);
+  RingBufferWriteStats coalesced = run_sector_writes(sector_buffer, records);
+  TEST_ASSERT_LESS_THAN(direct.sector_writes, coalesced.sector_writes);
+}
+
+TEST_CASE("Sector coalescing resumes a partial sector after restart", "[ring_buffer file]") {
+  static uint8_t sector_buffer[RING_BUFFER_SECTOR_SIZE];
+  static uint8_t data[RING_BUFFER_SECTOR_SIZE * 2];
+  static uint8_t read_data[sizeof(data)];
+  remove(TEST_FILE_NAME);
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  config.persistent = true;
+  config.sector_buffer = sector_buffer;
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, SECTOR_FILE_SIZE, &config);
+  TEST_ASSERT_EQUAL(RING_BUFFER_SECTOR_SIZE, buffer.file_offset);
+
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)(i * 13);
+  }
+  size_t half = RING_BUFFER_SECTOR_SIZE / 2;
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, MEM_BUFFER_SIZE + half));
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE, ring_buffer_read(&buffer, read_data, MEM_BUFFER_SIZE, 0));
+  ring_buffer_free(&buffer);
+
+  // 途中まで書いたセクタを読み直し、続きを書き足す
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, SECTOR_FILE_SIZE, &config);
+  size_t remaining = buffer.file_len;
+  TEST_ASSERT_GREATER_THAN(0, remaining);
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data + MEM_BUFFER_SIZE + half, RING_BUFFER_SECTOR_SIZE));
+  size_t size = remaining + RING_BUFFER_SECTOR_SIZE;
+  TEST_ASSERT_EQUAL(size, ring_buffer_read(&buffer, read_data, size, 0));
+  TEST_ASSERT_EQUAL_MEMORY(data + MEM_BUFFER_SIZE + half - remaining, read_data, size);
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("ring buffer runtime statistics count tiers, overflows and latency", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  RingBufferStats stats;
+#if RING_BUFFER_STATS
+  uint8_t data[MEM_BUFFER_SIZE + FILE_MAX_SIZE];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)i;
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, MEM_BUFFER_SIZE + 100));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OVERFLOW, ring_buffer_write(&buffer, data, FILE_MAX_SIZE));
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + FILE_MAX_SIZE, ring_buffer_occupied_size(&buffer));
+
+  TEST_ASSERT_TRUE(ring_buffer_get_stats(&buffer, &stats));
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE, stats.memory_in);
+  TEST_ASSERT_EQUAL(FILE_MAX_SIZE, stats.file_in);
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE, stats.memory_high_water);
+  TEST_ASSERT_EQUAL(FILE_MAX_SIZE, stats.file_high_water);
+  TEST_ASSERT_EQUAL(2, stats.spill_count);
+  TEST_ASSERT_EQUAL(1, stats.overflow_count);
+  TEST_ASSERT_TRUE(stats.lock_count >= 2);
+
+  // 読み込むとファイルからメモリへ補充され、補充した分もメモリに積んだバイト数に数える
+  uint8_t read_data[sizeof(data)];
+  TEST_ASSERT_EQUAL(sizeof(data), ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_TRUE(ring_buffer_get_stats(&buffer, &stats));
+  TEST_ASSERT_EQUAL(0, ring_buffer_occupied_size(&buffer));
+  TEST_ASSERT_EQUAL(stats.memory_in, stats.memory_out);
+  TEST_ASSERT_EQUAL(stats.file_in, stats.file_out);
+
+  uint32_t writes = 0;
+  uint32_t reads = 0;
+  for (int i = 0; i < RING_BUFFER_LATENCY_BUCKETS; i++) {
+    writes += stats.write_latency[i];
+    reads += stats.read_latency[i];
+  }
+  TEST_ASSERT_EQUAL(2, writes);
+  TEST_ASSERT_EQUAL(1, reads);
+
+  ring_buffer_cancel(&buffer);
+  TEST_ASSERT_EQUAL(RING_BUFFER_CANCELED, ring_buffer_read(&buffer, read_data, 1, 0));
+  TEST_ASSERT_TRUE(ring_buffer_get_stats(&buffer, &stats));
+  TEST_ASSERT_EQUAL(1, stats.canceled_count);
+
+  ring_buffer_reset_stats(&buffer);
+  TEST_ASSERT_TRUE(ring_buffer_get_stats(&buffer, &stats));
+  TEST_ASSERT_EQUAL(0, stats.memory_in);
+  TEST_ASSERT_EQUAL(0, stats.memory_high_water);
+#else
+  TEST_ASSERT_FALSE(ring_buffer_get_stats(&buffer, &stats));
+#endif
+  ring_buffer_free(&buffer);
+}
+
+#define SEGMENT_SIZE 256
+#define SEGMENT_FILE_SIZE (SEGMENT_SIZE * 4)
+
+// ファイルが残っているかを返す
+static bool segment_file_exists(uint32_t id) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s.%u", TEST_FILE_NAME, (unsigned)id);
+  FILE *file = fopen(name, "rb");
+  if (file != NULL) {
+    fclose(file);
+  }
+  return file != NULL;
+}
+
+TEST_CASE("Segmented file tier creates and removes whole segment files", "[ring_buffer file]") {
+  static uint8_t data[MEM_BUFFER_SIZE + SEGMENT_FILE_SIZE];
+  static uint8_t read_data[sizeof(data)];
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  config.segment_size = SEGMENT_SIZE;
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, SEGMENT_FILE_SIZE, &config);
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)(i * 7 + i / 251);
+  }
+
+  // 書き込んだ分だけセグメントファイルができる
+  TEST_ASSERT_EQUAL(0, ring_buffer_segment_files(&buffer));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, MEM_BUFFER_SIZE + SEGMENT_SIZE + 1));
+  TEST_ASSERT_EQUAL(2, ring_buffer_segment_files(&buffer));
+  TEST_ASSERT_TRUE(segment_file_exists(0));
+  TEST_ASSERT_TRUE(segment_file_exists(1));
+
+  // 読み終えたセグメントはファイルごと消える
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + SEGMENT_SIZE,
+                    ring_buffer_read(&buffer, read_data, MEM_BUFFER_SIZE + SEGMENT_SIZE, 0));
+  TEST_ASSERT_EQUAL(1, ring_buffer_segment_files(&buffer));
+  TEST_ASSERT_FALSE(segment_file_exists(0));
+
+  // セグメントの境界と折り返しをまたいでも、書き込んだ順に読み出せる
+  // 先頭のセグメントの読み終えた部分は空かないので、ファイルには3セグメント分ずつ書き込む
+  const size_t round_size = MEM_BUFFER_SIZE + SEGMENT_SIZE * 3;
+  size_t received = MEM_BUFFER_SIZE + SEGMENT_SIZE;
+  size_t written = MEM_BUFFER_SIZE + SEGMENT_SIZE + 1;
+  for (int round = 0; round < 3; round++) {
+    TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data + written, round_size - written));
+    while (received < round_size) {
+      int n = ring_buffer_read(&buffer, read_data + received, 100, 0);
+      TEST_ASSERT_GREATER_THAN(0, n);
+      received += n;
+    }
+    TEST_ASSERT_EQUAL_MEMORY(data, read_data, round_size);
+    written = received = 0;
+  }
+  TEST_ASSERT_LESS_OR_EQUAL(1, ring_buffer_segment_files(&buffer));
+
+  // 全体が入りきらない場合は、セグメントの数で決まる容量まで受け付ける
+  TEST_ASSERT_EQUAL(RING_BUFFER_OVERFLOW, ring_buffer_write(&buffer, data, sizeof(data)));
+  TEST_ASSERT_LESS_OR_EQUAL(MEM_BUFFER_SIZE + SEGMENT_FILE_SIZE, ring_buffer_occupied_size(&buffer));
+  TEST_ASSERT_LESS_OR_EQUAL(4, ring_buffer_segment_files(&buffer));
+
+  ring_buffer_free(&buffer);
+  for (uint32_t id = 0; id < RING_BUFFER_SEGMENTS_MAX * 2; id++) {
+    TEST_ASSERT_FALSE(segment_file_exists(id));
+  }
+}
+
+TEST_CASE("Segmented file tier recycles files and honours the segment limit", "[ring_buffer file]") {
+  static uint8_t data[SEGMENT_FILE_SIZE];
+  static uint8_t read_data[sizeof(data)];
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  config.segment_size = SEGMENT_SIZE;
+  config.segment_recycle = true;
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, SEGMENT_FILE_SIZE, &config);
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)(i * 13);
+  }
+
+  // 上限を2つにすると、ファイルに積めるのは2セグメント分まで
+  ring_buffer_set_segment_limit(&buffer, 2);
+  TEST_ASSERT_EQUAL(RING_BUFFER_OVERFLOW, ring_buffer_write(&buffer, data, sizeof(data)));
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + SEGMENT_SIZE * 2, ring_buffer_occupied_size(&buffer));
+  TEST_ASSERT_EQUAL(2, ring_buffer_segment_files(&buffer));
+
+  // 読み終えたファイルは消さずに残し、次のセグメントに使い回す
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + SEGMENT_SIZE * 2, ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, MEM_BUFFER_SIZE + SEGMENT_SIZE * 2);
+  TEST_ASSERT_EQUAL(2, ring_buffer_segment_files(&buffer));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, MEM_BUFFER_SIZE + SEGMENT_SIZE * 2));
+  TEST_ASSERT_EQUAL(2, ring_buffer_segment_files(&buffer));
+  TEST_ASSERT_FALSE(segment_file_exists(2));
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE + SEGMENT_SIZE * 2, ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, MEM_BUFFER_SIZE + SEGMENT_SIZE * 2);
+
+  // 上限を1つに減らすと、使い回すファイルも1つまでに減る
+  ring_buffer_set_segment_limit(&buffer, 1);
+  TEST_ASSERT_EQUAL(1, ring_buffer_segment_files(&buffer));
+  ring_buffer_set_segment_limit(&buffer, 100);
+  TEST_ASSERT_EQUAL(4, buffer.segment_limit);
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("Stacked tiers cascade between memory, RAM tiers and the file", "[ring_buffer file]") {
+  static uint8_t data[MEM_BUFFER_SIZE * 8];
+  static uint8_t read_data[sizeof(data)];
+  uint8_t memory[MEM_BUFFER_SIZE];
+  uint8_t psram[2][MEM_BUFFER_SIZE * 2];
+  RingBufferMemoryTier psram_tiers[2];
+  RingBufferTier tiers[2] = {ring_buffer_memory_tier_init(&psram_tiers[0], psram[0], sizeof(psram[0])),
+                             ring_buffer_memory_tier_init(&psram_tiers[1], psram[1], sizeof(psram[1]))};
+  RingBuffer buffer;
+  RingBufferConfig config = RING_BUFFER_CONFIG_DEFAULT;
+  config.tiers = tiers;
+  config.tier_count = 2;
+  ring_buffer_init_with_config(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE, &config);
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)(i * 31 + i / 253);
+  }
+
+  // メモリ、1段目、2段目、ファイルの順にあふれる
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, sizeof(data)));
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE, buffer.memory_len);
+  TEST_ASSERT_EQUAL(sizeof(psram[0]), psram_tiers[0].len);
+  TEST_ASSERT_EQUAL(sizeof(psram[1]), psram_tiers[1].len);
+  TEST_ASSERT_EQUAL(sizeof(data) - MEM_BUFFER_SIZE - sizeof(psram), buffer.file_len);
+  TEST_ASSERT_EQUAL(sizeof(data), ring_buffer_occupied_size(&buffer));
+
+  // 読み込むと、隣り合う階層の間でも繰り上がる
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE, ring_buffer_read(&buffer, read_data, MEM_BUFFER_SIZE, 0));
+  TEST_ASSERT_EQUAL(sizeof(psram[0]), psram_tiers[0].len);
+  TEST_ASSERT_LESS_THAN(sizeof(data) - MEM_BUFFER_SIZE - sizeof(psram), buffer.file_len);
+
+  // 書き込んだ順に読み出せる
+  size_t received = MEM_BUFFER_SIZE;
+  while (received < sizeof(data)) {
+    int n = ring_buffer_read(&buffer, read_data + received, 77, 0);
+    TEST_ASSERT_GREATER_THAN(0, n);
+    received += n;
+  }
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, sizeof(data));
+  TEST_ASSERT_EQUAL(0, psram_tiers[0].len + psram_tiers[1].len + buffer.file_len);
+
+  // 書き込む量が全階層の合計を超える場合は、入る分だけ書き込む
+  static uint8_t large[MEM_BUFFER_SIZE + sizeof(psram) + FILE_MAX_SIZE + 1];
+  TEST_ASSERT_EQUAL(RING_BUFFER_OVERFLOW, ring_buffer_write(&buffer, large, sizeof(large)));
+  TEST_ASSERT_EQUAL(sizeof(large) - 1, ring_buffer_occupied_size(&buffer));
+  ring_buffer_free(&buffer);
+}
+
+RING_BUFFER_DEFINE(static_ring_buffer, MEM_BUFFER_SIZE, FILE_MAX_SIZE);
+
+TEST_CASE("Statically defined ring buffer uses masks and no heap for its primitives", "[ring_buffer]") {
+  RING_BUFFER_INIT_STATIC(static_ring_buffer, TEST_FILE_NAME, NULL);
+  TEST_ASSERT_EQUAL(MEM_BUFFER_SIZE - 1, static_ring_buffer.memory_mask);
+  TEST_ASSERT_EQUAL(FILE_MAX_SIZE, static_ring_buffer.file_size);
+  TEST_ASSERT_EQUAL(sizeof(RingBuffer), static_ring_buffer_static.buffer_size);
+  TEST_ASSERT_EQUAL_PTR(&static_ring_buffer_static.mutex, static_ring_buffer.mutex);
+  TEST_ASSERT_EQUAL_PTR(&static_ring_buffer_static.events, static_ring_buffer.events);
+
+  // メモリの折り返しとファイルへのあふれをまたいで読み書きできる
+  uint8_t data[MEM_BUFFER_SIZE * 3];
+  uint8_t read_data[sizeof(data)];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)(i * 5);
+  }
+  for (int round = 0; round < 3; round++) {
+    TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&static_ring_buffer, data, 100));
+    TEST_ASSERT_EQUAL(100, ring_buffer_read(&static_ring_buffer, read_data, 100, 0));
+    TEST_ASSERT_EQUAL_MEMORY(data, read_data, 100);
+  }
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&static_ring_buffer, data, sizeof(data)));
+  TEST_ASSERT_EQUAL(sizeof(data), ring_buffer_read(&static_ring_buffer, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, sizeof(data));
+
+  // 解放した後も、同じ領域で初期化し直せる
+  ring_buffer_free(&static_ring_buffer);
+  RING_BUFFER_INIT_STATIC(static_ring_buffer, TEST_FILE_NAME, NULL);
+  TEST_ASSERT_EQUAL(0, ring_buffer_occupied_size(&static_ring_buffer));
+  ring_buffer_free(&static_ring_buffer);
+}
+
+TEST_CASE("Read threshold wakes the reader by size, deadline or finish", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  ring_buffer_set_read_threshold(&buffer, 200, pdMS_TO_TICKS(50));
+  uint8_t data[200] = {0};
+
+  // しきい値に届かない小さな書き込みでは起きず、時間切れになる
+  TEST_ASSERT_EQUAL(RING_BUFFER_TIMEOUT, ring_buffer_wait_read_threshold(&buffer, pdMS_TO_TICKS(10)));
+
+  // ファイルにあふれた分も合わせてしきい値に届くと起きる
+  DelayedAction action;
+  start_delayed_action(&action, &buffer, DELAYED_WRITE, data, sizeof(data));
+  TickType_t start = xTaskGetTickCount();
+  TEST_ASSERT_EQUAL(sizeof(data), ring_buffer_wait_read_threshold(&buffer, portMAX_DELAY));
+  TEST_ASSERT_LESS_THAN(pdMS_TO_TICKS(50), xTaskGetTickCount() - start);
+  wait_delayed_action(&action);
+  uint8_t read_data[sizeof(data)];
+  TEST_ASSERT_EQUAL(sizeof(data), ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+
+  // しきい値に届かなくても、最初のデータから遅延の上限が過ぎると起きる
+  start_delayed_action(&action, &buffer, DELAYED_WRITE, data, 10);
+  start = xTaskGetTickCount();
+  TEST_ASSERT_EQUAL(10, ring_buffer_wait_read_threshold(&buffer, portMAX_DELAY));
+  TEST_ASSERT_GREATER_OR_EQUAL(pdMS_TO_TICKS(20 + 50), xTaskGetTickCount() - start);
+  wait_delayed_action(&action);
+
+  // 書き込みの終了で、しきい値を待たずに起きる
+  start_delayed_action(&action, &buffer, DELAYED_FINISH, NULL, 0);
+  ring_buffer_set_read_threshold(&buffer, 200, portMAX_DELAY);
+  TEST_ASSERT_EQUAL(10, ring_buffer_wait_read_threshold(&buffer, portMAX_DELAY));
+  wait_delayed_action(&action);
+  TEST_ASSERT_EQUAL(10, ring_buffer_read(&buffer, read_data, sizeof(read_data), 0));
+  TEST_ASSERT_EQUAL(RING_BUFFER_FINISHED, ring_buffer_wait_read_threshold(&buffer, portMAX_DELAY));
+
+  // 戻った後に、呼び出し元のタスクに通知が残っておらず、アプリケーションが使う 0 番の通知にも触れない
+#ifdef RING_BUFFER_THRESHOLD_NOTIFY_INDEX
+  TEST_ASSERT_NOT_EQUAL(0, RING_BUFFER_THRESHOLD_NOTIFY_INDEX);
+  TEST_ASSERT_EQUAL(0, ulTaskNotifyTakeIndexed(RING_BUFFER_THRESHOLD_NOTIFY_INDEX, pdTRUE, 0));
+#endif
+  TEST_ASSERT_EQUAL(0, ulTaskNotifyTake(pdTRUE, 0));
+  ring_buffer_free(&buffer);
+}
+
+TEST_CASE("Element writes and reads never split an element", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  // 12バイトの要素は、メモリとファイルの合計にちょうど入る個数だけ書き込まれる
+  uint8_t data[(MEM_BUFFER_SIZE + FILE_MAX_SIZE) / 12 + 4][12];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i / 12][i % 12] = (uint8_t)(i * 3);
+  }
+  size_t capacity = (MEM_BUFFER_SIZE + FILE_MAX_SIZE) / 12;
+  TEST_ASSERT_EQUAL(capacity, ring_buffer_write_elements(&buffer, data, 12, sizeof(data) / 12));
+  TEST_ASSERT_EQUAL(capacity * 12, ring_buffer_occupied_size(&buffer));
+  TEST_ASSERT_EQUAL(0, ring_buffer_write_elements(&buffer, data, 12, 1));
+
+  // 読み込みも要素単位で、max_count を超えない
+  uint8_t read_data[sizeof(data) / 12][12];
+  TEST_ASSERT_EQUAL(5, ring_buffer_read_elements(&buffer, read_data, 12, 5, 0));
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, 5 * 12);
+  TEST_ASSERT_EQUAL(capacity - 5, ring_buffer_read_elements(&buffer, read_data[5], 12, sizeof(data) / 12, 0));
+  TEST_ASSERT_EQUAL_MEMORY(data, read_data, capacity * 12);
+  TEST_ASSERT_EQUAL(RING_BUFFER_TIMEOUT, ring_buffer_read_elements(&buffer, read_data, 12, 1, 0));
+
+  // 要素に満たない残りは、書き込みが終了しても読み込まない
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data[0], 7));
+  TEST_ASSERT_EQUAL(RING_BUFFER_TIMEOUT, ring_buffer_read_elements(&buffer, read_data, 12, 1, 0));
+  ring_buffer_finish_write(&buffer);
+  TEST_ASSERT_EQUAL(RING_BUFFER_FINISHED, ring_buffer_read_elements(&buffer, read_data, 12, 1, 0));
+  TEST_ASSERT_EQUAL(RING_BUFFER_FINISHED, ring_buffer_write_elements(&buffer, data, 12, 1));
+  ring_buffer_free(&buffer);
+}
+
+typedef struct {
+  uint8_t data[MEM_BUFFER_SIZE * 4];
+  size_t len;
+  size_t budget; // これから受け付ける残りのバイト数
+  size_t calls;
+} DrainSink;
+
+static size_t drain_sink(void *ctx, const uint8_t *data, size_t size) {
+  DrainSink *sink = (DrainSink *)ctx;
+  size_t count = size < sink->budget ? size : sink->budget;
+  memcpy(sink->data + sink->len, data, count);
+  sink->len += count;
+  sink->budget -= count;
+  sink->calls++;
+  return count;
+}
+
+TEST_CASE("Drain hands memory spans and file chunks to the sink", "[ring_buffer]") {
+  uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+
+  // メモリの折り返しとファイルへのあふれをまたぐデータを用意する
+  uint8_t data[MEM_BUFFER_SIZE * 3];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)(i * 7);
+  }
+  uint8_t read_data[MEM_BUFFER_SIZE];
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, 100));
+  TEST_ASSERT_EQUAL(100, ring_buffer_read(&buffer, read_data, 100, 0));
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, ring_buffer_write(&buffer, data, sizeof(data)));
+  TEST_ASSERT_EQUAL(sizeof(data) - MEM_BUFFER_SIZE, buffer.file_len);
+
+  // sink が途中までしか受け付けなければ、受け付けた分だけ消費する
+  DrainSink sink = {.len = 0, .budget = 50, .calls = 0};
+  TEST_ASSERT_EQUAL(50, ring_buffer_drain(&buffer, drain_sink, &sink, SIZE_MAX));
+  TEST_ASSERT_EQUAL(sizeof(data) - 50, ring_buffer_occupied_size(&buffer));
+
+  // メモリは補充せず、ファイルから直接 sink に渡す
+  sink.budget = SIZE_MAX;
+  size_t size = MEM_BUFFER_SIZE - 50 + 10;
+  TEST_ASSERT_EQUAL(size, ring_buffer_drain(&buffer, drain_sink, &sink, size));
+  TEST_ASSERT_EQUAL(0, buffer.memory_len);
+  TEST_ASSERT_EQUAL(sizeof(data) - MEM_BUFFER_SIZE - 10, buffer.file_len);
+
+  // ファイルのデータは RING_BUFFER_DRAIN_CHUNK バイトずつまとめて渡す
+  sink.calls = 0;
+  TEST_ASSERT_EQUAL(sizeof(data) - MEM_BUFFER_SIZE - 10, ring_buffer_drain(&buffer, drain_sink, &sink, SIZE_MAX));
+  TEST_ASSERT_EQUAL(1, sink.calls);
+  TEST_ASSERT_EQUAL(sizeof(data), sink.len);
+  TEST_ASSERT_EQUAL_MEMORY(data, sink.data, sizeof(data));
+
+  // 空になった後は 0 を、書き込みが終了していれば RING_BUFFER_FINISHED を返す
+  TEST_ASSERT_EQUAL(0, ring_buffer_drain(&buffer, drain_sink, &sink, SIZE_MAX));
+  ring_buffer_finish_write(&buffer);
+  TEST_ASSERT_EQUAL(RING_BUFFER_FINISHED, ring_buffer_drain(&buffer, drain_sink, &sink, SIZE_MAX));
+  ring_buffer_free(&buffer);
+}
+
 void app_main(void) {
   UNITY_BEGIN();
   puts(">>>>>>>");
@@ -359,3 +2261,4 @@ void app_main(void) {
   UNITY_END();
   exit(0);
 }
+
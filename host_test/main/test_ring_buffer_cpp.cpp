@@ -0,0 +1,55 @@
+#include "freertos/FreeRTOS.h"
+#include "ring_buffer.hpp"
+#include "unity.h"
+#include <array>
+
+#define MEM_BUFFER_SIZE 128
+#define FILE_MAX_SIZE 1024
+#define TEST_FILE_NAME "test_buffer.dat"
+
+namespace {
+
+struct Sample {
+  uint32_t timestamp;
+  int16_t values[3];
+};
+
+} // namespace
+
+TEST_CASE("C++ typed ring buffer pushes and pops whole elements", "[ring_buffer cpp]") {
+  static uint8_t memory[MEM_BUFFER_SIZE];
+  RingBuffer buffer;
+  ring_buffer_init(&buffer, memory, MEM_BUFFER_SIZE, TEST_FILE_NAME, FILE_MAX_SIZE);
+  masuidrive::UniqueRingBuffer owner(&buffer);
+  masuidrive::TypedRingBuffer<Sample> samples(owner);
+
+  // 範囲をまとめて書き込むと、入る分だけが要素単位で書き込まれる
+  constexpr size_t capacity = (MEM_BUFFER_SIZE + FILE_MAX_SIZE) / sizeof(Sample);
+  static std::array<Sample, capacity + 3> data;
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = Sample{static_cast<uint32_t>(i), {static_cast<int16_t>(i), -1, 1}};
+  }
+  TEST_ASSERT_EQUAL(capacity, samples.push(std::span<const Sample>(data)));
+  TEST_ASSERT_EQUAL(capacity, samples.size());
+  TEST_ASSERT_FALSE(samples.push(data[0]));
+
+  Sample sample;
+  TEST_ASSERT_EQUAL(1, samples.pop(sample, 0));
+  TEST_ASSERT_EQUAL(0, sample.timestamp);
+  static std::array<Sample, capacity + 3> read_data;
+  TEST_ASSERT_EQUAL(capacity - 1, samples.pop(std::span<Sample>(read_data), 0));
+  TEST_ASSERT_EQUAL_MEMORY(&data[1], read_data.data(), (capacity - 1) * sizeof(Sample));
+  TEST_ASSERT_EQUAL(RING_BUFFER_TIMEOUT, samples.pop(sample, 0));
+
+  // バイト列の読み書き
+  const uint8_t bytes[] = {1, 2, 3, 4, 5};
+  uint8_t read_bytes[sizeof(bytes)];
+  TEST_ASSERT_EQUAL(RING_BUFFER_OK, owner.write(bytes));
+  TEST_ASSERT_EQUAL(sizeof(bytes), owner.read(read_bytes, 0));
+  TEST_ASSERT_EQUAL_MEMORY(bytes, read_bytes, sizeof(bytes));
+
+  // 所有を移すと、移した先が破棄するときに解放する
+  masuidrive::UniqueRingBuffer moved(std::move(owner));
+  TEST_ASSERT_FALSE(owner);
+  TEST_ASSERT_EQUAL_PTR(&buffer, moved.get());
+}